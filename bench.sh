@@ -0,0 +1,13 @@
+#!/bin/sh
+# Builds the page allocator benchmark for the host (no kernel or QEMU needed) and runs it; see
+# bench/pgalloc-bench.cpp for the options.
+
+TOP=`pwd`
+BENCH_DIR=$TOP/bench
+OUT_DIR=$BENCH_DIR/out
+CXX=${CXX:-c++}
+
+mkdir -p $OUT_DIR
+$CXX -std=gnu++17 -O2 -g -Wall -I$BENCH_DIR/shim -o $OUT_DIR/pgalloc-bench \
+	$BENCH_DIR/pgalloc-bench.cpp $BENCH_DIR/shim/shim.cpp $TOP/coursework/buddy.cpp $TOP/coursework/buddy-bitmap.cpp $TOP/coursework/slab.cpp || exit 1
+$OUT_DIR/pgalloc-bench $*
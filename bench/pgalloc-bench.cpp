@@ -0,0 +1,492 @@
+/*
+ * Host-side benchmark and trace-replay harness for the page allocators in coursework/.
+ *
+ * The allocators are built against the stand-in InfOS headers in bench/shim, so they can be measured on a
+ * plain Linux box without booting the kernel under QEMU.  Build and run through ./bench.sh, e.g.
+ *
+ *   ./bench.sh --algorithm=buddy --workload=mixed --ops=2000000
+ *   ./bench.sh --algorithm=buddy-lazy --workload=bursty -o pgalloc.lazy.slack=32
+ *   ./bench.sh --algorithm=buddy-bitmap --workload=zipf
+ *   ./bench.sh --algorithm=buddy --trace=boot.trace
+ *
+ * Options:
+ *   --algorithm=NAME   allocator to drive, by its name() (default: buddy); --list shows the built-in ones
+ *   --workload=NAME    uniform | zipf | bursty | mixed (default: uniform)
+ *   --trace=FILE       replay a recorded trace instead of a synthetic workload
+ *   --pages=N          number of page descriptors / pages of memory (default: 262144, i.e. 1 GiB)
+ *   --ops=N            number of timed allocate/free operations (default: 2000000)
+ *   --live=N           number of blocks the synthetic workloads keep allocated (default: 4096)
+ *   --order=N          block order of the uniform, zipf and bursty workloads (default: 0)
+ *   --max-order=N      largest order the mixed workload asks for (default: 9)
+ *   --burst=N          blocks allocated and then freed per burst by the bursty workload (default: 512)
+ *   --seed=N           random seed (default: 1)
+ *   -o KEY=VALUE       kernel command-line argument, e.g. -o pgalloc.pcp.high=0
+ *   --dump             print the allocator's dump_state() at the end
+ *   -v                 show the allocator's log messages
+ *
+ * Workloads:
+ *   uniform  keep about --live blocks of --order allocated, freeing a uniformly random one
+ *   zipf     as uniform, but the block to free is picked by recency with a Zipf(1.2) law, so most blocks die young
+ *   bursty   a base of --live/2 blocks, then repeatedly allocate --burst blocks and free them in random order
+ *   mixed    as uniform, with each order k in 0..--max-order asked for with probability proportional to 2^-k
+ *
+ * Trace format: one event per line; "a <id> <order>" allocates a block and calls it <id>, "f <id>" frees the
+ * block called <id>.  Lines starting with '#' are ignored.  A kernel log with the events recorded by
+ * pgalloc.trace=1 (see buddy_dump_trace()) can be replayed as it is: everything before "[pgtrace] " on a line is
+ * skipped, the recorded pfns serve as block ids, and the split, merge and range events are not replayed, since
+ * the allocator under test makes its own.  Recorded allocation failures are counted.
+ *
+ * Latencies include the cost of reading the clock around every call (some tens of nanoseconds).  The
+ * fragmentation figures describe the layout of free memory as the harness sees it (pages it has not been
+ * handed), so pages held in allocator-internal caches count as free.
+ */
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/cmdline.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+using namespace infos::kernel;
+using namespace infos::mm;
+
+#define MAX_ORDER 18
+
+struct Options {
+    const char* algorithm = "buddy";
+    const char* workload = "uniform";
+    const char* trace = NULL;
+    uint64_t pages = 262144;
+    uint64_t ops = 2000000;
+    uint64_t live = 4096;
+    int order = 0;
+    int max_order = 9;
+    uint64_t burst = 512;
+    uint64_t seed = 1;
+    bool dump = false;
+    bool verbose = false;
+};
+
+struct Block {
+    PageDescriptor* pgd;
+    int order;
+};
+
+static Options options;
+static PageAllocatorAlgorithm* algorithm;
+static PageDescriptor* descriptors;
+static std::vector<uint8_t> page_in_use;        // pages the harness has been handed and not yet freed
+static std::vector<uint64_t> alloc_latencies;   // ns
+static std::vector<uint64_t> free_latencies;
+static uint64_t nr_failed_allocs;
+static uint64_t nr_timed_ops;
+static uint64_t total_op_ns;
+static std::mt19937_64 rng;
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void mark_block(const Block& block, bool in_use)
+{
+    uint64_t pfn = block.pgd - descriptors;
+    for (uint64_t i = 0; i < (1ull << block.order); i++) {
+        if (page_in_use[pfn + i] == in_use) {
+            fprintf(stderr, "error: pfn %lx handed out twice or freed while free\n", pfn + i);
+            abort();
+        }
+        page_in_use[pfn + i] = in_use;
+    }
+}
+
+/**
+ * Allocates a block, timing the call if 'timed'.
+ * @return true if the allocator found a block.
+ */
+static bool do_alloc(int order, Block& block, bool timed = true)
+{
+    uint64_t start = now_ns();
+    PageDescriptor* pgd = algorithm->allocate_pages(order);
+    uint64_t elapsed = now_ns() - start;
+
+    if (timed) {
+        alloc_latencies.push_back(elapsed);
+        total_op_ns += elapsed;
+        nr_timed_ops++;
+    }
+    if (pgd == NULL) {
+        nr_failed_allocs++;
+        return false;
+    }
+
+    block.pgd = pgd;
+    block.order = order;
+    if ((uint64_t)(pgd - descriptors) & ((1ull << order) - 1)) {
+        fprintf(stderr, "error: block of order %d at pfn %lx is misaligned\n", order, (uint64_t)(pgd - descriptors));
+        abort();
+    }
+    mark_block(block, true);
+    return true;
+}
+
+static void do_free(const Block& block, bool timed = true)
+{
+    mark_block(block, false);
+
+    uint64_t start = now_ns();
+    algorithm->free_pages(block.pgd, block.order);
+    uint64_t elapsed = now_ns() - start;
+
+    if (timed) {
+        free_latencies.push_back(elapsed);
+        total_op_ns += elapsed;
+        nr_timed_ops++;
+    }
+}
+
+static int pick_order()
+{
+    if (strcmp(options.workload, "mixed") != 0) return options.order;
+
+    // P(order k) is proportional to 2^-k, i.e. every order accounts for about the same number of pages:
+    std::uniform_int_distribution<uint64_t> dist(1, (1ull << (options.max_order + 1)) - 1);
+    uint64_t r = dist(rng);
+    int order = options.max_order;
+    while (order > 0 && r >= (1ull << order)) {
+        r -= 1ull << order;
+        order--;
+    }
+    return options.max_order - order;
+}
+
+/**
+ * Picks which live block to free: uniformly, or (zipf) by recency with a Zipf(1.2) law over the live blocks.
+ */
+static size_t pick_victim(size_t nr_live)
+{
+    if (strcmp(options.workload, "zipf") == 0) {
+        const double s = 1.2;
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        double x = pow(1 + u * (pow((double)nr_live, 1 - s) - 1), 1 / (1 - s));
+        size_t rank = std::min((size_t)x, nr_live);
+        if (rank < 1) rank = 1;
+        return nr_live - rank;      // rank 1 is the most recently allocated block
+    }
+    return std::uniform_int_distribution<size_t>(0, nr_live - 1)(rng);
+}
+
+static void remove_live(std::vector<Block>& live, size_t index)
+{
+    if (strcmp(options.workload, "zipf") == 0) {
+        // keep the live list in allocation order, so that recency ranks stay meaningful
+        live.erase(live.begin() + index);
+    } else {
+        live[index] = live.back();
+        live.pop_back();
+    }
+}
+
+static uint64_t frag_nr_free;
+static double frag_unusable[MAX_ORDER + 1];
+static int frag_largest = -1;
+
+/**
+ * Records how usable free memory is for each order, at the end of the timed phase (while the workload's blocks
+ * are still allocated): the unusable free space index of order k is the fraction of free pages that do not lie
+ * in a free, naturally aligned block of 2^k pages.
+ */
+static void snapshot_fragmentation()
+{
+    frag_nr_free = 0;
+    for (auto in_use : page_in_use) frag_nr_free += !in_use;
+    frag_largest = -1;
+
+    for (int order = 0; order <= MAX_ORDER; order++) {
+        uint64_t size = 1ull << order, usable = 0;
+        for (uint64_t pfn = 0; pfn + size <= options.pages; pfn += size) {
+            uint64_t i = 0;
+            while (i < size && !page_in_use[pfn + i]) i++;
+            if (i == size) usable += size;
+        }
+        if (usable) frag_largest = order;
+        frag_unusable[order] = frag_nr_free ? 1.0 - (double)usable / frag_nr_free : 0;
+    }
+}
+
+static void report_fragmentation()
+{
+    printf("%-12s %lu free pages at the end of the run\n", "free", frag_nr_free);
+    printf("%-12s", "unusable");
+    for (int order = 0; order <= MAX_ORDER; order++) printf(" %d:%.3f", order, frag_unusable[order]);
+    printf("\n%-12s order %d\n", "largest", frag_largest);
+}
+
+static void run_steady_state()
+{
+    std::vector<Block> live;
+    Block block;
+
+    // Warm up (untimed) to the target number of live blocks.
+    while (live.size() < options.live && do_alloc(pick_order(), block, false)) {
+        live.push_back(block);
+    }
+    nr_failed_allocs = 0;
+
+    for (uint64_t op = 0; op < options.ops; op++) {
+        bool alloc = live.empty() || (live.size() < 2 * options.live && (rng() & 1));
+        if (alloc) {
+            if (do_alloc(pick_order(), block)) live.push_back(block);
+        } else {
+            size_t victim = pick_victim(live.size());
+            do_free(live[victim]);
+            remove_live(live, victim);
+        }
+    }
+
+    snapshot_fragmentation();
+    for (const auto& b : live) do_free(b, false);
+}
+
+static void run_bursty()
+{
+    std::vector<Block> base, burst;
+    Block block;
+
+    while (base.size() < options.live / 2 && do_alloc(options.order, block, false)) {
+        base.push_back(block);
+    }
+    nr_failed_allocs = 0;
+
+    uint64_t op = 0;
+    while (op < options.ops) {
+        for (uint64_t i = 0; i < options.burst && op < options.ops; i++, op++) {
+            if (do_alloc(options.order, block)) burst.push_back(block);
+        }
+        std::shuffle(burst.begin(), burst.end(), rng);
+        for (; !burst.empty() && op < options.ops; op++) {
+            do_free(burst.back());
+            burst.pop_back();
+        }
+        // occasionally replace a base block, so that the long-lived set slowly moves around
+        if (!base.empty() && (rng() & 7) == 0) {
+            size_t victim = std::uniform_int_distribution<size_t>(0, base.size() - 1)(rng);
+            do_free(base[victim], false);
+            if (do_alloc(options.order, block, false)) base[victim] = block;
+            else remove_live(base, victim);
+        }
+    }
+
+    snapshot_fragmentation();
+    for (const auto& b : burst) do_free(b, false);
+    for (const auto& b : base) do_free(b, false);
+}
+
+static bool run_trace(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+
+    std::unordered_map<uint64_t, Block> blocks;
+    char buffer[256];
+    uint64_t line_no = 0, nr_bad = 0, nr_recorded_failures = 0;
+    while (fgets(buffer, sizeof(buffer), f)) {
+        line_no++;
+        buffer[strcspn(buffer, "\n")] = 0;
+        // in a kernel log the event follows a tag, and the lines without one are not part of the trace:
+        const char* line = buffer;
+        const char* tag = strstr(buffer, "[pgtrace] ");
+        if (tag) line = tag + strlen("[pgtrace] ");
+        else if (buffer[0] != '#' && buffer[0] != 0 && !(buffer[1] == ' ' && buffer[2] >= '0' && buffer[2] <= '9')) continue;
+        if (line[0] == '#' || line[0] == 0) continue;
+        if (strchr("smir", line[0]) != NULL && line[1] == ' ') continue;
+        if (line[0] == 'x' && line[1] == ' ') {
+            nr_recorded_failures++;
+            continue;
+        }
+
+        char op;
+        unsigned long id;
+        int order;
+        Block block;
+        if (sscanf(line, "%c %lu %d", &op, &id, &order) == 3 && op == 'a') {
+            if (blocks.count(id)) {
+                fprintf(stderr, "%s:%lu: block %lu is already allocated\n", path, line_no, id);
+                nr_bad++;
+            } else if (do_alloc(order, block)) {
+                blocks[id] = block;
+            }
+        } else if (sscanf(line, "%c %lu", &op, &id) == 2 && op == 'f') {
+            auto it = blocks.find(id);
+            if (it == blocks.end()) {
+                // the allocation failed earlier, or the trace is broken
+                nr_bad++;
+                continue;
+            }
+            do_free(it->second);
+            blocks.erase(it);
+        } else {
+            fprintf(stderr, "%s:%lu: cannot parse '%s'\n", path, line_no, line);
+            nr_bad++;
+        }
+    }
+    fclose(f);
+
+    if (nr_bad) fprintf(stderr, "%lu trace events skipped\n", nr_bad);
+    if (nr_recorded_failures) printf("%-12s %lu allocations failed when the trace was recorded\n", "recorded", nr_recorded_failures);
+    snapshot_fragmentation();
+    for (const auto& b : blocks) do_free(b.second, false);
+    return true;
+}
+
+static void report_latencies(const char* what, std::vector<uint64_t>& latencies)
+{
+    if (latencies.empty()) {
+        printf("%-12s none\n", what);
+        return;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    uint64_t sum = 0;
+    for (auto l : latencies) sum += l;
+    auto pct = [&](double p) { return latencies[std::min(latencies.size() - 1, (size_t)(p * latencies.size()))]; };
+    printf("%-12s %10zu ops  mean %7.1f ns  p50 %5lu  p90 %5lu  p99 %6lu  p99.9 %7lu  max %8lu ns\n", what,
+           latencies.size(), (double)sum / latencies.size(), pct(0.5), pct(0.9), pct(0.99), pct(0.999), latencies.back());
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [--algorithm=NAME] [--workload=uniform|zipf|bursty|mixed] [--trace=FILE] [--pages=N]\n"
+                    "          [--ops=N] [--live=N] [--order=N] [--max-order=N] [--burst=N] [--seed=N]\n"
+                    "          [-o KEY=VALUE]... [--dump] [--list] [-v]\n", prog);
+}
+
+static bool parse_arguments(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = strchr(arg, '=');
+        value = value ? value + 1 : "";
+
+        if (strncmp(arg, "--algorithm=", 12) == 0) options.algorithm = value;
+        else if (strncmp(arg, "--workload=", 11) == 0) options.workload = value;
+        else if (strncmp(arg, "--trace=", 8) == 0) options.trace = value;
+        else if (strncmp(arg, "--pages=", 8) == 0) options.pages = strtoull(value, NULL, 0);
+        else if (strncmp(arg, "--ops=", 6) == 0) options.ops = strtoull(value, NULL, 0);
+        else if (strncmp(arg, "--live=", 7) == 0) options.live = strtoull(value, NULL, 0);
+        else if (strncmp(arg, "--order=", 8) == 0) options.order = atoi(value);
+        else if (strncmp(arg, "--max-order=", 12) == 0) options.max_order = atoi(value);
+        else if (strncmp(arg, "--burst=", 8) == 0) options.burst = strtoull(value, NULL, 0);
+        else if (strncmp(arg, "--seed=", 7) == 0) options.seed = strtoull(value, NULL, 0);
+        else if (strcmp(arg, "--dump") == 0) options.dump = true;
+        else if (strcmp(arg, "-v") == 0) options.verbose = true;
+        else if (strcmp(arg, "--list") == 0) {
+            for (auto reg = page_allocator_algorithms; reg; reg = reg->next) printf("%s\n", reg->algorithm->name());
+            exit(0);
+        } else if (strcmp(arg, "-o") == 0 && i + 1 < argc) {
+            if (!apply_cmdline_argument(argv[++i])) {
+                fprintf(stderr, "unknown command-line argument '%s'\n", argv[i]);
+                return false;
+            }
+        } else {
+            usage(argv[0]);
+            return false;
+        }
+    }
+
+    const char* workloads[] = { "uniform", "zipf", "bursty", "mixed" };
+    bool known = options.trace != NULL;
+    for (auto w : workloads) known |= strcmp(options.workload, w) == 0;
+    if (!known) {
+        fprintf(stderr, "unknown workload '%s'\n", options.workload);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    if (!parse_arguments(argc, argv)) return 1;
+    rng.seed(options.seed);
+
+    for (auto reg = page_allocator_algorithms; reg; reg = reg->next) {
+        if (strcmp(reg->algorithm->name(), options.algorithm) == 0) algorithm = reg->algorithm;
+    }
+    if (!algorithm) {
+        fprintf(stderr, "unknown algorithm '%s' (try --list)\n", options.algorithm);
+        return 1;
+    }
+
+    if (options.verbose) {
+        syslog.threshold = LogLevel::DEBUG;
+        mm_log.threshold = LogLevel::DEBUG;
+    }
+
+    descriptors = new PageDescriptor[options.pages]();
+    page_in_use.assign(options.pages, 0);
+    sys.mm().pgalloc().setup(descriptors, options.pages, algorithm);
+    if (!algorithm->init(descriptors, options.pages)) {
+        fprintf(stderr, "%s: init failed\n", algorithm->name());
+        return 1;
+    }
+
+    // Like a PC memory map: everything but the first page is usable, and the first 1 MiB is then reserved.
+    uint64_t start = now_ns();
+    algorithm->insert_page_range(descriptors + 1, options.pages - 1);
+    uint64_t ingest_ns = now_ns() - start;
+    algorithm->remove_page_range(descriptors + 1, 255);
+
+    for (uint64_t pfn = 0; pfn < 256 && pfn < options.pages; pfn++) {
+        page_in_use[pfn] = 1;
+    }
+
+    printf("%-12s %s\n", "algorithm", algorithm->name());
+    printf("%-12s %lu pages in %lu us\n", "ingest", options.pages - 1, ingest_ns / 1000);
+
+    uint64_t wall_start = now_ns();
+    if (options.trace) {
+        printf("%-12s %s\n", "trace", options.trace);
+        if (!run_trace(options.trace)) return 1;
+    } else {
+        printf("%-12s %s (%lu ops, %lu live blocks)\n", "workload", options.workload, options.ops, options.live);
+        if (strcmp(options.workload, "bursty") == 0) run_bursty();
+        else run_steady_state();
+    }
+    uint64_t wall_ns = now_ns() - wall_start;
+
+    report_latencies("alloc", alloc_latencies);
+    report_latencies("free", free_latencies);
+    printf("%-12s %lu\n", "failed", nr_failed_allocs);
+    printf("%-12s %.2f Mops/s in allocator calls (%.2f s wall)\n", "throughput",
+           total_op_ns ? nr_timed_ops * 1e3 / total_op_ns : 0.0, wall_ns / 1e9);
+
+    report_fragmentation();
+
+    // Everything has been freed again: see how well free memory came back together, by allocating as much as
+    // possible from the largest order down.
+    std::vector<Block> probe;
+    Block block;
+    for (int order = MAX_ORDER; order >= 0; order--) {
+        while (do_alloc(order, block, false)) probe.push_back(block);
+    }
+    uint64_t recovered = 0;
+    for (const auto& b : probe) recovered += 1ull << b.order;
+    printf("%-12s %lu pages allocatable after the run, in %zu blocks\n", "recovered", recovered, probe.size());
+    for (const auto& b : probe) do_free(b, false);
+
+    if (options.dump) {
+        mm_log.threshold = LogLevel::DEBUG;
+        algorithm->dump_state();
+    }
+    return 0;
+}
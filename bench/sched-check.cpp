@@ -0,0 +1,448 @@
+/*
+ * Host-side model check of the priority schedulers in coursework/.
+ *
+ * The schedulers are built against the stand-in InfOS headers in bench/shim, on a simulated clock: every pick
+ * stands for one timer tick, after which the clock and the picked entity's CPU runtime move on by --tick.  Build
+ * and run through ./sched-check.sh, e.g.
+ *
+ *   ./sched-check.sh
+ *   ./sched-check.sh --algorithm=mq --entities=10000
+ *   ./sched-check.sh --algorithm=o1mq -o sched.slice.interactive=20
+ *   ./sched-check.sh --pgalloc=buddy-bitmap
+ *
+ * Options:
+ *   --algorithm=NAME   scheduler to check, by its name() (default: every one the harness has checks for)
+ *   --pgalloc=NAME     page allocator under the schedulers (default: buddy); the runqueue nodes only come from
+ *                      their slab cache under buddy or buddy-lazy, and from the heap otherwise
+ *   --entities=N       number of entities of the model check (default: 3000)
+ *   --ops=N            number of random operations of the model check (default: 1000000)
+ *   --picks=N          number of picks of the other checks (default: 100000)
+ *   --tick=N           ns each pick stands for (default: 10000000)
+ *   --aging=N          sched.aging.threshold, in ms, of the aging check (default: 500)
+ *   --slice=N          sched.slice.normal, in ms, of the timeslice check (default: 50)
+ *   --seed=N           random seed (default: 1)
+ *   -o KEY=VALUE       kernel command-line argument, e.g. -o sched.balance.interval=0
+ *   -v                 show the schedulers' log messages (including the sched.debug statistics)
+ *
+ * Checks:
+ *   model        random adds, removes and picks over --entities entities.  mq (with aging off) must pick exactly
+ *                what a reference model of FIFO queues per priority class picks; o1mq, whose dynamic priorities
+ *                are not modelled, must pick nothing exactly when nothing is runnable, and only runnable entities.
+ *   aging        (mq) 3 realtime entities that never sleep, over 5 normal and 5 daemon ones: no lower priority
+ *                entity may wait for longer than the aging threshold plus two picks for each of them, and realtime
+ *                entities may not wait for more than one promoted pick in a row.
+ *   interactive  (o1mq) an entity that wakes every 200 ms, among 20 normal entities that never sleep, must run
+ *                within a pick of waking on average, and every one of the others must still run.
+ *   slices       (o1mq) normal entities that never sleep must each run for --slice at a time.
+ *   stats        the model check's workload again, with sched.debug=1.
+ *
+ * The harness is single-threaded, so the load balancer has only the one CPU to balance, and is not exercised.
+ */
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/cmdline.h>
+#include <infos/kernel/sched.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+using namespace infos::kernel;
+using namespace infos::mm;
+
+#define NR_CLASSES 4
+
+struct Options {
+    const char* algorithm = NULL;
+    const char* pgalloc = "buddy";
+    uint64_t entities = 3000;
+    uint64_t ops = 1000000;
+    uint64_t picks = 100000;
+    uint64_t tick = 10000000;
+    uint64_t aging = 500;
+    uint64_t slice = 50;
+    uint64_t seed = 1;
+    bool verbose = false;
+};
+
+static Options options;
+static SchedulingAlgorithm* scheduler;
+static std::mt19937_64 rng;
+static uint64_t now;
+
+static const char* class_names[NR_CLASSES] = { "realtime", "interactive", "normal", "daemon" };
+
+/**
+ * Sets a kernel command-line argument that a check depends on.
+ */
+static void set_argument(const char* key, uint64_t value)
+{
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%s=%lu", key, value);
+    apply_cmdline_argument(buffer);
+}
+
+/**
+ * Picks the next entity, and lets it run for a tick.
+ */
+static SchedulingEntity* pick()
+{
+    SchedulingEntity* entity = scheduler->pick_next_entity();
+    now += options.tick;
+    sys.set_runtime(now);
+    if (entity) entity->increment_cpu_runtime(options.tick);
+    return entity;
+}
+
+/**
+ * Makes entities for a check.  They are never freed, so that no entity of a later check can have the address,
+ * and with it the sleep history that o1mq keeps, of one that has gone.
+ */
+static std::vector<SchedulingEntity*> make_entities(SchedulingEntityPriority::SchedulingEntityPriority priority, unsigned int count, const char* name)
+{
+    std::vector<SchedulingEntity*> entities;
+    for (unsigned int i = 0; i < count; i++) {
+        entities.push_back(new SchedulingEntity(priority, name));
+    }
+    return entities;
+}
+
+/**
+ * Random adds, removes and picks, checked against a reference model of the runqueues (exact for mq, the
+ * invariants only for o1mq).
+ */
+static bool check_model()
+{
+    bool exact = strcmp(scheduler->name(), "mq") == 0;
+    if (exact) set_argument("sched.aging.threshold", 0);
+
+    std::vector<SchedulingEntity*> entities;
+    for (unsigned int priority = 0; priority < NR_CLASSES; priority++) {
+        auto some = make_entities((SchedulingEntityPriority::SchedulingEntityPriority)priority, options.entities / NR_CLASSES
+                                  + (priority < options.entities % NR_CLASSES), class_names[priority]);
+        entities.insert(entities.end(), some.begin(), some.end());
+    }
+    std::vector<uint8_t> queued(entities.size(), 0);
+    std::deque<SchedulingEntity*> model[NR_CLASSES];
+    uint64_t nr_queued = 0, nr_picks = 0, nr_idle = 0, max_queued = 0;
+    bool ok = true;
+
+    for (uint64_t op = 0; op < options.ops && ok; op++) {
+        size_t index = rng() % entities.size();
+        SchedulingEntity* entity = entities[index];
+        auto& queue = model[entity->priority()];
+
+        switch (rng() % 3) {
+        case 0:
+            if (queued[index]) break;
+            scheduler->add_to_runqueue(*entity);
+            queued[index] = 1;
+            queue.push_back(entity);
+            nr_queued++;
+            max_queued = std::max(max_queued, nr_queued);
+            break;
+
+        case 1:
+            if (!queued[index]) break;
+            scheduler->remove_from_runqueue(*entity);
+            queued[index] = 0;
+            queue.erase(std::find(queue.begin(), queue.end(), entity));
+            nr_queued--;
+            break;
+
+        default: {
+            // the model: the head of the highest priority non-empty queue runs, and goes to the back of it
+            SchedulingEntity* expected = NULL;
+            for (auto& q : model) {
+                if (q.empty()) continue;
+                expected = q.front();
+                q.pop_front();
+                q.push_back(expected);
+                break;
+            }
+
+            SchedulingEntity* picked = pick();
+            nr_picks++;
+            if (picked == NULL) nr_idle++;
+            if ((picked == NULL) != (nr_queued == 0)) {
+                printf("%-12s op %lu: picked %s with %lu entities runnable\n", "FAIL", op, picked ? "an entity" : "nothing", nr_queued);
+                ok = false;
+            } else if (exact && picked != expected) {
+                printf("%-12s op %lu: picked %s %p, the model picked %p\n", "FAIL", op,
+                       picked ? picked->name().c_str() : "nothing", (void*)picked, (void*)expected);
+                ok = false;
+            } else if (picked) {
+                size_t j = std::find(entities.begin(), entities.end(), picked) - entities.begin();
+                if (j == entities.size() || !queued[j]) {
+                    printf("%-12s op %lu: picked an entity that is not runnable\n", "FAIL", op);
+                    ok = false;
+                }
+            }
+            break;
+        }
+        }
+    }
+
+    for (size_t i = 0; i < entities.size(); i++) {
+        if (queued[i]) scheduler->remove_from_runqueue(*entities[i]);
+    }
+    if (pick() != NULL) {
+        printf("%-12s an entity was picked after every entity was removed\n", "FAIL");
+        ok = false;
+    }
+    if (exact) set_argument("sched.aging.threshold", options.aging);
+
+    printf("%-12s %lu ops over %lu entities (at most %lu runnable): %lu picks, %lu idle, %s\n", "model",
+           options.ops, options.entities, max_queued, nr_picks, nr_idle, !ok ? "failed" : exact ? "as the model" : "invariants held");
+    return ok;
+}
+
+/**
+ * Lower priority entities behind realtime ones that never sleep: none may starve.
+ */
+static bool check_aging()
+{
+    set_argument("sched.aging.threshold", options.aging);
+    std::vector<SchedulingEntity*> entities = make_entities(SchedulingEntityPriority::REALTIME, 3, "realtime");
+    auto normal = make_entities(SchedulingEntityPriority::NORMAL, 5, "normal");
+    auto daemon = make_entities(SchedulingEntityPriority::DAEMON, 5, "daemon");
+    entities.insert(entities.end(), normal.begin(), normal.end());
+    entities.insert(entities.end(), daemon.begin(), daemon.end());
+    unsigned int nr_lower = normal.size() + daemon.size();
+
+    std::unordered_map<SchedulingEntity*, uint64_t> last_run;
+    for (auto entity : entities) {
+        scheduler->add_to_runqueue(*entity);
+        last_run[entity] = now;
+    }
+
+    uint64_t max_wait[NR_CLASSES] = {}, nr_runs[NR_CLASSES] = {};
+    unsigned int lower_in_a_row = 0, max_lower_in_a_row = 0;
+    for (uint64_t i = 0; i < options.picks; i++) {
+        uint64_t picked_at = now;
+        SchedulingEntity* entity = pick();
+        if (entity == NULL) continue;       // (nothing was added: the wait at the end shows it)
+        unsigned int priority = entity->priority();
+        max_wait[priority] = std::max(max_wait[priority], picked_at - last_run[entity]);
+        last_run[entity] = now;
+        nr_runs[priority]++;
+
+        lower_in_a_row = priority == SchedulingEntityPriority::REALTIME ? 0 : lower_in_a_row + 1;
+        max_lower_in_a_row = std::max(max_lower_in_a_row, lower_in_a_row);
+    }
+    // (an entity that is still waiting at the end has waited at least this long)
+    for (auto entity : entities) {
+        unsigned int priority = entity->priority();
+        max_wait[priority] = std::max(max_wait[priority], now - last_run[entity]);
+        scheduler->remove_from_runqueue(*entity);
+    }
+
+    // the last entity to age waits for every other lower priority entity to have been promoted, every other pick:
+    uint64_t bound = options.aging * 1000000 + (2 * nr_lower + 1) * options.tick;
+    bool ok = max_wait[SchedulingEntityPriority::NORMAL] <= bound && max_wait[SchedulingEntityPriority::DAEMON] <= bound
+            && max_lower_in_a_row <= 1;
+
+    printf("%-12s picks realtime %lu normal %lu daemon %lu; max wait realtime %lu normal %lu daemon %lu ms (bound %lu); "
+           "at most %u lower priority picks in a row\n", "aging",
+           nr_runs[0], nr_runs[2], nr_runs[3], max_wait[0] / 1000000, max_wait[2] / 1000000, max_wait[3] / 1000000,
+           bound / 1000000, max_lower_in_a_row);
+    if (!ok) printf("%-12s a lower priority entity starved, or realtime entities waited behind promotions\n", "FAIL");
+    return ok;
+}
+
+/**
+ * An entity that sleeps most of the time, among ones that never do: it should run as soon as it wakes.
+ */
+static bool check_interactive()
+{
+    const uint64_t sleep = 200000000;
+    std::vector<SchedulingEntity*> hogs = make_entities(SchedulingEntityPriority::NORMAL, 20, "hog");
+    SchedulingEntity& sleeper = *make_entities(SchedulingEntityPriority::NORMAL, 1, "sleeper")[0];
+    for (auto hog : hogs) scheduler->add_to_runqueue(*hog);
+
+    std::unordered_map<SchedulingEntity*, uint64_t> last_run;
+    bool awake = false;
+    uint64_t wake_at = now, wait = 0, total_wait = 0, max_wait = 0, nr_wakeups = 0, max_hog_gap = 0;
+    for (uint64_t i = 0; i < options.picks; i++) {
+        if (!awake && now >= wake_at) {
+            scheduler->add_to_runqueue(sleeper);
+            awake = true;
+            wait = 0;
+        }
+
+        SchedulingEntity* entity = pick();
+        if (entity == &sleeper) {
+            // it only ever runs for a tick before going back to sleep
+            total_wait += wait;
+            max_wait = std::max(max_wait, wait);
+            nr_wakeups++;
+            scheduler->remove_from_runqueue(sleeper);
+            awake = false;
+            wake_at = now + sleep;
+        } else {
+            if (awake) wait++;
+            if (last_run.count(entity)) max_hog_gap = std::max(max_hog_gap, now - last_run[entity]);
+            last_run[entity] = now;
+        }
+    }
+    if (awake) scheduler->remove_from_runqueue(sleeper);
+    for (auto hog : hogs) scheduler->remove_from_runqueue(*hog);
+
+    double average = nr_wakeups ? (double)total_wait / nr_wakeups : 0;
+    bool ok = nr_wakeups > 0 && average <= 1 && last_run.size() == hogs.size();
+    printf("%-12s %lu wakeups, waited %.2f picks on average and %lu at most; %zu/%zu others ran, at most %lu ms apart\n",
+           "interactive", nr_wakeups, average, max_wait, last_run.size(), hogs.size(), max_hog_gap / 1000000);
+    if (!ok) printf("%-12s the sleeper was kept waiting, or the others starved\n", "FAIL");
+    return ok;
+}
+
+/**
+ * Entities that never sleep: each runs for its class' timeslice before the next takes over.
+ */
+static bool check_slices()
+{
+    set_argument("sched.slice.normal", options.slice);
+    std::vector<SchedulingEntity*> hogs = make_entities(SchedulingEntityPriority::NORMAL, 8, "hog");
+    for (auto hog : hogs) scheduler->add_to_runqueue(*hog);
+
+    uint64_t expected = (options.slice * 1000000 + options.tick - 1) / options.tick;
+    uint64_t run = 0, nr_runs = 0, nr_wrong = 0;
+    SchedulingEntity* previous = NULL;
+    for (uint64_t i = 0; i < options.picks; i++) {
+        SchedulingEntity* entity = pick();
+        if (entity != previous && previous != NULL) {
+            nr_runs++;
+            if (run != expected) nr_wrong++;
+            run = 0;
+        }
+        previous = entity;
+        run++;
+    }
+    for (auto hog : hogs) scheduler->remove_from_runqueue(*hog);
+
+    printf("%-12s %lu runs of %lu ms slices, %lu not of %lu picks\n", "slices", nr_runs, options.slice, nr_wrong, expected);
+    if (nr_wrong) printf("%-12s entities ran for more or less than their timeslice\n", "FAIL");
+    return nr_wrong == 0;
+}
+
+static bool check_stats()
+{
+    apply_cmdline_argument("sched.debug=1");
+    uint64_t ops = options.ops;
+    options.ops = std::min(ops, (uint64_t)100000);
+    printf("%-12s sched.debug=1\n", "stats");
+    bool ok = check_model();
+    options.ops = ops;
+    apply_cmdline_argument("sched.debug=0");
+    return ok;
+}
+
+struct Check {
+    const char* algorithm;      // or NULL for every algorithm
+    bool (*run)();
+};
+
+static const Check checks[] = {
+    { NULL, check_model },
+    { "mq", check_aging },
+    { "o1mq", check_interactive },
+    { "o1mq", check_slices },
+    { NULL, check_stats },
+};
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [--algorithm=NAME] [--pgalloc=NAME] [--entities=N] [--ops=N] [--picks=N] [--tick=N] [--aging=N]\n"
+                    "          [--slice=N] [--seed=N] [-o KEY=VALUE]... [-v]\n", prog);
+}
+
+static bool parse_arguments(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = strchr(arg, '=');
+        value = value ? value + 1 : "";
+
+        if (strncmp(arg, "--algorithm=", 12) == 0) options.algorithm = value;
+        else if (strncmp(arg, "--pgalloc=", 10) == 0) options.pgalloc = value;
+        else if (strncmp(arg, "--entities=", 11) == 0) options.entities = strtoull(value, NULL, 0);
+        else if (strncmp(arg, "--ops=", 6) == 0) options.ops = strtoull(value, NULL, 0);
+        else if (strncmp(arg, "--picks=", 8) == 0) options.picks = strtoull(value, NULL, 0);
+        else if (strncmp(arg, "--tick=", 7) == 0) options.tick = strtoull(value, NULL, 0);
+        else if (strncmp(arg, "--aging=", 8) == 0) options.aging = strtoull(value, NULL, 0);
+        else if (strncmp(arg, "--slice=", 8) == 0) options.slice = strtoull(value, NULL, 0);
+        else if (strncmp(arg, "--seed=", 7) == 0) options.seed = strtoull(value, NULL, 0);
+        else if (strcmp(arg, "-v") == 0) options.verbose = true;
+        else if (strcmp(arg, "-o") == 0 && i + 1 < argc) {
+            if (!apply_cmdline_argument(argv[++i])) {
+                fprintf(stderr, "unknown command-line argument '%s'\n", argv[i]);
+                return false;
+            }
+        } else {
+            usage(argv[0]);
+            return false;
+        }
+    }
+
+    if (options.entities == 0 || options.tick == 0) {
+        usage(argv[0]);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    if (!parse_arguments(argc, argv)) return 1;
+    rng.seed(options.seed);
+
+    if (options.verbose) {
+        syslog.threshold = LogLevel::DEBUG;
+        mm_log.threshold = LogLevel::DEBUG;
+    }
+
+    // The schedulers take their runqueue nodes from a slab cache when the page allocator is a buddy allocator.
+    PageAllocatorAlgorithm* pgalloc = NULL;
+    for (auto reg = page_allocator_algorithms; reg; reg = reg->next) {
+        if (strcmp(reg->algorithm->name(), options.pgalloc) == 0) pgalloc = reg->algorithm;
+    }
+    if (!pgalloc) {
+        fprintf(stderr, "unknown page allocator '%s'\n", options.pgalloc);
+        return 1;
+    }
+    const uint64_t nr_pages = 65536;
+    PageDescriptor* descriptors = new PageDescriptor[nr_pages]();
+    sys.mm().pgalloc().setup(descriptors, nr_pages, pgalloc);
+    if (!pgalloc->init(descriptors, nr_pages)) {
+        fprintf(stderr, "%s: init failed\n", pgalloc->name());
+        return 1;
+    }
+    pgalloc->insert_page_range(descriptors + 1, nr_pages - 1);
+    sys.set_runtime(now);
+    printf("%-12s %s\n", "pgalloc", pgalloc->name());
+
+    bool ok = true, found = false;
+    for (auto reg = scheduling_algorithms; reg; reg = reg->next) {
+        scheduler = reg->algorithm;
+        if (options.algorithm && strcmp(scheduler->name(), options.algorithm) != 0) continue;
+        found = true;
+
+        printf("%-12s %s\n", "algorithm", scheduler->name());
+        scheduler->init();
+        for (const auto& check : checks) {
+            if (check.algorithm && strcmp(check.algorithm, scheduler->name()) != 0) continue;
+            ok &= check.run();
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "unknown algorithm '%s'\n", options.algorithm);
+        return 1;
+    }
+
+    printf("%-12s %s\n", "result", ok ? "pass" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,14 @@
+/*
+ * Host stand-in for <infos/define.h>, just enough to build coursework/buddy*.cpp outside of the kernel.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+#define __packed __attribute__((packed))
+
+typedef uint64_t pfn_t;
+typedef uintptr_t virt_addr_t;
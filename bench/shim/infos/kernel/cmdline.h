@@ -0,0 +1,33 @@
+/*
+ * Host stand-in for <infos/kernel/cmdline.h>: arguments register themselves in a list, and the harness feeds
+ * them the key=value pairs given with -o.
+ */
+#pragma once
+
+namespace infos
+{
+	namespace kernel
+	{
+		struct CmdLineArgument
+		{
+			CmdLineArgument(const char *key, void (*handler)(const char *value));
+
+			const char *key;
+			void (*handler)(const char *value);
+			CmdLineArgument *next;
+		};
+
+		extern CmdLineArgument *cmdline_arguments;
+
+		/**
+		 * Passes "key=value" to every handler registered for key.
+		 * @return true if at least one handler took the argument.
+		 */
+		bool apply_cmdline_argument(const char *key_value);
+	}
+}
+
+#define RegisterCmdLineArgument(_name, _key) \
+	static void __cmdline_##_name(const char *value); \
+	static infos::kernel::CmdLineArgument __cmdline_arg_##_name(_key, __cmdline_##_name); \
+	static void __cmdline_##_name(const char *value)
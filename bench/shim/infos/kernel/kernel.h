@@ -0,0 +1,35 @@
+/*
+ * Host stand-in for <infos/kernel/kernel.h>: a Kernel that only has a memory manager and a clock.
+ */
+#pragma once
+
+#include <infos/mm/mm.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		class Kernel
+		{
+		public:
+			mm::MemoryManager& mm() { return _mm; }
+
+			/**
+			 * Nanoseconds since the harness started, or the time last given to set_runtime().
+			 */
+			uint64_t runtime() const;
+
+			/**
+			 * Stops the clock at 'ns', for harnesses that simulate the passing of time.
+			 */
+			void set_runtime(uint64_t ns) { _simulated_runtime = ns; _simulated = true; }
+
+		private:
+			mm::MemoryManager _mm;
+			bool _simulated = false;
+			uint64_t _simulated_runtime = 0;
+		};
+
+		extern Kernel sys;
+	}
+}
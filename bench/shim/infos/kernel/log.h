@@ -0,0 +1,37 @@
+/*
+ * Host stand-in for <infos/kernel/log.h>: messages at or above the harness' log threshold go to stderr.
+ */
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		namespace LogLevel
+		{
+			enum LogLevel
+			{
+				DEBUG,
+				INFO,
+				IMPORTANT,
+				WARNING,
+				ERROR,
+				FATAL,
+				SILENT,
+			};
+		}
+
+		class Log
+		{
+		public:
+			void message(LogLevel::LogLevel level, const char *message);
+			void messagef(LogLevel::LogLevel level, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+			LogLevel::LogLevel threshold = LogLevel::SILENT;
+		};
+
+		extern Log syslog;
+	}
+}
@@ -0,0 +1,81 @@
+/*
+ * Host stand-in for <infos/kernel/sched.h>: scheduling entities are plain objects with a name, a priority and a
+ * CPU runtime that the harness charges itself, and scheduling algorithms register themselves in a list.
+ */
+#pragma once
+
+#include <infos/define.h>
+#include <string>
+
+namespace infos
+{
+	namespace kernel
+	{
+		namespace SchedulingEntityPriority
+		{
+			enum SchedulingEntityPriority
+			{
+				REALTIME,
+				INTERACTIVE,
+				NORMAL,
+				DAEMON,
+			};
+		}
+
+		namespace SchedulingEntityState
+		{
+			enum SchedulingEntityState
+			{
+				STOPPED,
+				SLEEPING,
+				RUNNABLE,
+				RUNNING,
+			};
+		}
+
+		class SchedulingEntity
+		{
+		public:
+			typedef uint64_t EntityRuntime;
+
+			SchedulingEntity(SchedulingEntityPriority::SchedulingEntityPriority priority, const char *name)
+				: _priority(priority), _name(name), _cpu_runtime(0) { }
+
+			SchedulingEntityPriority::SchedulingEntityPriority priority() const { return _priority; }
+			const std::string& name() const { return _name; }
+
+			EntityRuntime cpu_runtime() const { return _cpu_runtime; }
+			void increment_cpu_runtime(EntityRuntime delta) { _cpu_runtime += delta; }
+
+		private:
+			SchedulingEntityPriority::SchedulingEntityPriority _priority;
+			std::string _name;
+			EntityRuntime _cpu_runtime;
+		};
+
+		class SchedulingAlgorithm
+		{
+		public:
+			virtual const char *name() const = 0;
+			virtual void init() { }
+
+			virtual void add_to_runqueue(SchedulingEntity& entity) = 0;
+			virtual void remove_from_runqueue(SchedulingEntity& entity) = 0;
+			virtual SchedulingEntity *pick_next_entity() = 0;
+		};
+
+		struct SchedulingAlgorithmRegistration
+		{
+			SchedulingAlgorithmRegistration(SchedulingAlgorithm *algorithm);
+
+			SchedulingAlgorithm *algorithm;
+			SchedulingAlgorithmRegistration *next;
+		};
+
+		extern SchedulingAlgorithmRegistration *scheduling_algorithms;
+	}
+}
+
+#define RegisterScheduler(_algo_class) \
+	static _algo_class __sched_algo_##_algo_class; \
+	static infos::kernel::SchedulingAlgorithmRegistration __sched_reg_##_algo_class(&__sched_algo_##_algo_class)
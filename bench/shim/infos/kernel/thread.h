@@ -0,0 +1,6 @@
+/*
+ * Host stand-in for <infos/kernel/thread.h>.  The schedulers only use the SchedulingEntity in <infos/kernel/sched.h>.
+ */
+#pragma once
+
+#include <infos/kernel/sched.h>
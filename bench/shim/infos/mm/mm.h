@@ -0,0 +1,24 @@
+/*
+ * Host stand-in for <infos/mm/mm.h>.
+ */
+#pragma once
+
+#include <infos/mm/page-allocator.h>
+#include <infos/kernel/log.h>
+
+namespace infos
+{
+	namespace mm
+	{
+		class MemoryManager
+		{
+		public:
+			PageAllocator& pgalloc() { return _pgalloc; }
+
+		private:
+			PageAllocator _pgalloc;
+		};
+
+		extern kernel::Log mm_log;
+	}
+}
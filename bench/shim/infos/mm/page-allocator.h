@@ -0,0 +1,80 @@
+/*
+ * Host stand-in for <infos/mm/page-allocator.h>.  The PageAllocator front end only does the pfn/pgd/address
+ * conversions, over a descriptor array and an (unbacked until touched) memory area set up by the harness.
+ */
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos
+{
+	namespace mm
+	{
+		namespace PageDescriptorType
+		{
+			enum PageDescriptorType
+			{
+				INVALID = 0,
+				RESERVED = 1,
+				AVAILABLE = 2,
+				ALLOCATED = 3,
+			};
+		}
+
+		struct PageDescriptor
+		{
+			PageDescriptor *next_free;
+			PageDescriptorType::PageDescriptorType type;
+		};
+
+		class PageAllocatorAlgorithm
+		{
+		public:
+			virtual bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) = 0;
+			virtual PageDescriptor *allocate_pages(int order) = 0;
+			virtual void free_pages(PageDescriptor *pgd, int order) = 0;
+			virtual void insert_page_range(PageDescriptor *start, uint64_t count) = 0;
+			virtual void remove_page_range(PageDescriptor *start, uint64_t count) = 0;
+			virtual const char *name() const = 0;
+			virtual void dump_state() const = 0;
+		};
+
+		class PageAllocator
+		{
+		public:
+			void setup(PageDescriptor *descriptors, uint64_t nr_descriptors, PageAllocatorAlgorithm *algorithm);
+
+			PageDescriptor *alloc_pages(int order) { return _algorithm->allocate_pages(order); }
+			void free_pages(PageDescriptor *pgd, int order) { _algorithm->free_pages(pgd, order); }
+
+			pfn_t pgd_to_pfn(const PageDescriptor *pgd) const { return (pfn_t)(pgd - _descriptors); }
+			PageDescriptor *pfn_to_pgd(pfn_t pfn) const { return &_descriptors[pfn]; }
+
+			virt_addr_t pgd_to_vpa(const PageDescriptor *pgd) const { return (virt_addr_t)_memory + (pgd_to_pfn(pgd) << 12); }
+			PageDescriptor *vpa_to_pgd(virt_addr_t vpa) const { return pfn_to_pgd((vpa - (virt_addr_t)_memory) >> 12); }
+
+		private:
+			PageDescriptor *_descriptors;
+			uint64_t _nr_descriptors;
+			char *_memory;
+			PageAllocatorAlgorithm *_algorithm;
+		};
+
+		/**
+		 * Every algorithm built into the harness, so that it can be picked by name.
+		 */
+		struct PageAllocatorRegistration
+		{
+			PageAllocatorRegistration(PageAllocatorAlgorithm *algorithm);
+
+			PageAllocatorAlgorithm *algorithm;
+			PageAllocatorRegistration *next;
+		};
+
+		extern PageAllocatorRegistration *page_allocator_algorithms;
+	}
+}
+
+#define RegisterPageAllocator(_algo_class) \
+	static _algo_class __pgalloc_algo_##_algo_class; \
+	static infos::mm::PageAllocatorRegistration __pgalloc_reg_##_algo_class(&__pgalloc_algo_##_algo_class)
@@ -0,0 +1,17 @@
+/*
+ * Host stand-in for <infos/util/lock.h>.  The harness is single-threaded and has no interrupts to mask.
+ */
+#pragma once
+
+namespace infos
+{
+	namespace util
+	{
+		class UniqueIRQLock
+		{
+		public:
+			UniqueIRQLock() { }
+			~UniqueIRQLock() { }
+		};
+	}
+}
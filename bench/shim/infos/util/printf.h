@@ -0,0 +1,18 @@
+/*
+ * Host stand-in for <infos/util/printf.h>.  The kernel's snprintf tolerates the destination buffer also being
+ * one of the arguments (dump_state() appends with "%s..."), which the C library's does not, so format into a
+ * scratch buffer first.
+ */
+#pragma once
+
+#include <stdio.h>
+
+namespace infos
+{
+	namespace util
+	{
+		int infos_snprintf(char *buffer, int size, const char *format, ...) __attribute__((format(printf, 3, 4)));
+	}
+}
+
+#define snprintf infos_snprintf
@@ -0,0 +1,17 @@
+/*
+ * Host stand-in for <infos/util/string.h>.
+ */
+#pragma once
+
+#include <string.h>
+
+namespace infos
+{
+	namespace util
+	{
+		using ::memset;
+		using ::strlen;
+		using ::strncmp;
+		using ::strncpy;
+	}
+}
@@ -0,0 +1,117 @@
+/*
+ * Definitions behind the host stand-ins for the InfOS headers used by the page allocators and schedulers.
+ */
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/cmdline.h>
+#include <infos/kernel/sched.h>
+#include <infos/util/printf.h>
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+using namespace infos::kernel;
+using namespace infos::mm;
+
+Kernel infos::kernel::sys;
+Log infos::kernel::syslog;
+Log infos::mm::mm_log;
+
+PageAllocatorRegistration *infos::mm::page_allocator_algorithms;
+SchedulingAlgorithmRegistration *infos::kernel::scheduling_algorithms;
+CmdLineArgument *infos::kernel::cmdline_arguments;
+
+static const char *level_names[] = { "debug", "info", "important", "warning", "error", "fatal" };
+
+void Log::message(LogLevel::LogLevel level, const char *message)
+{
+	if (level < threshold) return;
+	fprintf(stderr, "%s: %s\n", level_names[level], message);
+}
+
+void Log::messagef(LogLevel::LogLevel level, const char *format, ...)
+{
+	if (level < threshold) return;
+
+	char buffer[1024];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+
+	message(level, buffer);
+}
+
+int infos::util::infos_snprintf(char *buffer, int size, const char *format, ...)
+{
+	char scratch[4096];
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(scratch, sizeof(scratch), format, args);
+	va_end(args);
+
+	if (size > 0) {
+		int copied = n < size ? n : size - 1;
+		memcpy(buffer, scratch, copied);
+		buffer[copied] = 0;
+	}
+	return n;
+}
+
+uint64_t Kernel::runtime() const
+{
+	static struct timespec start;
+	struct timespec now;
+
+	if (_simulated) return _simulated_runtime;
+	if (start.tv_sec == 0 && start.tv_nsec == 0) clock_gettime(CLOCK_MONOTONIC, &start);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) * 1000000000ull + (now.tv_nsec - start.tv_nsec);
+}
+
+void PageAllocator::setup(PageDescriptor *descriptors, uint64_t nr_descriptors, PageAllocatorAlgorithm *algorithm)
+{
+	_descriptors = descriptors;
+	_nr_descriptors = nr_descriptors;
+	_algorithm = algorithm;
+
+	// Only pages that an algorithm actually writes to (e.g. to zero them) get backed by host memory.
+	_memory = (char *)mmap(NULL, nr_descriptors << 12, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (_memory == MAP_FAILED) {
+		perror("mmap");
+		abort();
+	}
+}
+
+PageAllocatorRegistration::PageAllocatorRegistration(PageAllocatorAlgorithm *algorithm) : algorithm(algorithm), next(page_allocator_algorithms)
+{
+	page_allocator_algorithms = this;
+}
+
+SchedulingAlgorithmRegistration::SchedulingAlgorithmRegistration(SchedulingAlgorithm *algorithm) : algorithm(algorithm), next(scheduling_algorithms)
+{
+	scheduling_algorithms = this;
+}
+
+CmdLineArgument::CmdLineArgument(const char *key, void (*handler)(const char *value)) : key(key), handler(handler), next(cmdline_arguments)
+{
+	cmdline_arguments = this;
+}
+
+bool infos::kernel::apply_cmdline_argument(const char *key_value)
+{
+	const char *eq = strchr(key_value, '=');
+	if (!eq) return false;
+
+	size_t key_len = eq - key_value;
+	bool taken = false;
+	for (CmdLineArgument *arg = cmdline_arguments; arg; arg = arg->next) {
+		if (strlen(arg->key) == key_len && strncmp(arg->key, key_value, key_len) == 0) {
+			arg->handler(eq + 1);
+			taken = true;
+		}
+	}
+	return taken;
+}
@@ -0,0 +1,473 @@
+/*
+ * The Bitmap Buddy Page Allocator
+ * A buddy allocator that keeps its state in per-order bitmaps instead of free lists threaded through the
+ * page descriptors; selected with pgalloc.algorithm=buddy-bitmap.
+ */
+
+#include <infos/mm/page-allocator.h>
+#include <infos/mm/mm.h>
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/log.h>
+#include <infos/util/printf.h>
+
+#include "buddy.h"
+#include "smp.h"
+
+using namespace infos::kernel;
+using namespace infos::mm;
+using namespace infos::util;
+
+#define BITMAP_MAX_LEVELS	7		// levels of a bitmap: enough for 64^7 = 2^42 blocks
+#define BITMAP_MAX_PENDING	32		// ranges of memory kept aside by insert_page_range() until the first allocation
+
+/**
+ * A range of pages inserted before the bitmaps have been set up, [start, end) in pfns.
+ */
+struct BitmapPendingRange {
+    pfn_t start;
+    pfn_t end;
+};
+
+/**
+ * The free blocks of one order, as a bitmap with a bit per aligned block of that order (set if the block is free
+ * and not part of a larger free block), and summary levels above it: bit i of level l+1 is set if word i of
+ * level l is not zero.  The top level is a single word, so the first free block is found with one
+ * count-trailing-zeros per level, and setting or clearing a bit touches the levels above only when a word
+ * becomes non-zero or zero.
+ */
+struct OrderBitmap {
+    uint64_t* levels[BITMAP_MAX_LEVELS];
+    unsigned int nr_levels;
+    uint64_t nr_free;       // bits set in level 0
+};
+
+/**
+ * A buddy page allocation algorithm over bitmaps.  Finding, splitting and merging blocks only reads and writes
+ * the bitmaps, which are dense (a 64-byte cache line covers 512 blocks of an order), and never the
+ * PageDescriptor array: a block's page descriptor is only computed, from its pfn, to be handed out.
+ */
+class BitmapBuddyPageAllocator : public PageAllocatorAlgorithm
+{
+private:
+    /**
+     * Points the levels of every order's bitmap into a pool of words, one after the other.  Order k has a bit per
+     * naturally aligned block of 2^k pages, plus a summary level per 64 words below it, up to a single word: sum
+     * over k of (nr_pgd / 2^k) * (1 + 1/64 + ...) bits, i.e. a little over nr_pgd / 32 bytes (512 KiB for 8 GiB).
+     * @param pool is the pool, or NULL to only count its words
+     * @return the number of words of the pool, or 0 if a bitmap would need more than BITMAP_MAX_LEVELS levels.
+     */
+    uint64_t lay_out_bitmaps(uint64_t* pool) {
+        uint64_t nr_pool_words = 0;
+        for (int order = 0; order <= MAX_ORDER; order++) {
+            OrderBitmap& bitmap = _orders[order];
+            // one bit per block of this order that starts in memory (and the buddy of the last one), and then one
+            // per word of the level below:
+            uint64_t nr_bits = ((_nr_pgd + (1ull << order) - 1) >> order) + 1;
+            bitmap.nr_levels = 0;
+            do {
+                if (bitmap.nr_levels == BITMAP_MAX_LEVELS) return 0;
+                uint64_t nr_words = (nr_bits + 63) / 64;
+                if (pool != NULL) bitmap.levels[bitmap.nr_levels] = pool + nr_pool_words;
+                bitmap.nr_levels++;
+                nr_pool_words += nr_words;
+                nr_bits = nr_words;
+            } while (nr_bits > 1);
+        }
+        return nr_pool_words;
+    }
+
+    /**
+     * Carves the bitmaps out of the start of the largest range inserted so far, and frees the rest of every
+     * inserted range into them.  As with the list-based allocator's page metadata, this waits for the first
+     * allocation, by when the kernel has removed again whatever it inserted only to reserve it.
+     */
+    void carve_bitmaps() {
+        if (_pool != NULL) return;
+        uint64_t nr_pool_pages = (_nr_pool_words * sizeof(uint64_t) + (1ul << PAGE_BITS) - 1) >> PAGE_BITS;
+        int largest = -1;
+        for (unsigned int i = 0; i < _nr_pending; i++) {
+            uint64_t length = _pending[i].end - _pending[i].start;
+            if (length >= nr_pool_pages and (largest < 0 or length > _pending[largest].end - _pending[largest].start)) {
+                largest = i;
+            }
+        }
+        if (largest < 0) {
+            syslog.messagef(LogLevel::FATAL, "No inserted range can hold the %lu pages of the buddy bitmaps!", nr_pool_pages);
+            return;
+        }
+        pfn_t pool_pfn = _pending[largest].start;
+        _pending[largest].start += nr_pool_pages;
+        _pool = (uint64_t*)sys.mm().pgalloc().pgd_to_vpa(sys.mm().pgalloc().pfn_to_pgd(pool_pfn));
+        for (uint64_t i = 0; i < _nr_pool_words; i++) {
+            _pool[i] = 0;
+        }
+        lay_out_bitmaps(_pool);
+        mm_log.messagef(LogLevel::INFO, "Buddy bitmaps for %lu pages in pfns [%lx, %lx)",
+                        _nr_pgd, pool_pfn, pool_pfn + nr_pool_pages);
+
+        for (unsigned int i = 0; i < _nr_pending; i++) {
+            free_range(_pending[i].start, _pending[i].end);
+        }
+        _nr_pending = 0;
+    }
+
+    /**
+     * Records a range of pages inserted before the bitmaps exist, keeping the pending ranges sorted and joining
+     * the range to its neighbours where they touch.
+     * @return false if there was no room for another range.
+     */
+    bool add_pending_range(pfn_t start, pfn_t end) {
+        unsigned int i = 0;
+        while (i < _nr_pending and _pending[i].start < start) i++;
+        bool joins_previous = i > 0 and _pending[i - 1].end == start;
+        bool joins_next = i < _nr_pending and _pending[i].start == end;
+        if (joins_previous and joins_next) {
+            _pending[i - 1].end = _pending[i].end;
+            for (unsigned int j = i + 1; j < _nr_pending; j++) _pending[j - 1] = _pending[j];
+            _nr_pending--;
+        } else if (joins_previous) {
+            _pending[i - 1].end = end;
+        } else if (joins_next) {
+            _pending[i].start = start;
+        } else {
+            if (_nr_pending == BITMAP_MAX_PENDING) return false;
+            for (unsigned int j = _nr_pending; j > i; j--) _pending[j] = _pending[j - 1];
+            _pending[i].start = start;
+            _pending[i].end = end;
+            _nr_pending++;
+        }
+        return true;
+    }
+
+    /**
+     * Takes a range of pages out of the pending ranges.  There must be room for one more pending range, in case
+     * the range splits one in two.
+     * @return the number of pages of the range that were not pending.
+     */
+    uint64_t remove_pending_range(pfn_t start, pfn_t end) {
+        uint64_t nr_not_pending = 0;
+        pfn_t covered = start;      // the pages of [start, covered) have been accounted for
+        for (unsigned int i = 0; i < _nr_pending and covered < end; ) {
+            BitmapPendingRange& range = _pending[i];
+            if (range.end <= covered) {
+                i++;
+                continue;
+            }
+            if (range.start >= end) break;
+            if (range.start > covered) nr_not_pending += range.start - covered;
+            covered = range.end < end ? range.end : end;
+            if (range.start < start and range.end > end) {
+                // the range is split in two around the pages removed:
+                for (unsigned int j = _nr_pending; j > i + 1; j--) _pending[j] = _pending[j - 1];
+                _pending[i + 1].start = end;
+                _pending[i + 1].end = range.end;
+                _nr_pending++;
+                range.end = start;
+                break;
+            } else if (range.start < start) {
+                range.end = start;
+                i++;
+            } else if (range.end > end) {
+                range.start = end;
+                break;
+            } else {
+                for (unsigned int j = i + 1; j < _nr_pending; j++) _pending[j - 1] = _pending[j];
+                _nr_pending--;
+            }
+        }
+        if (covered < end) nr_not_pending += end - covered;
+        return nr_not_pending;
+    }
+
+    /**
+     * Checks whether the block of the given order and index is free.
+     */
+    bool test_block(int order, pfn_t index) const {
+        return (_orders[order].levels[0][index / 64] >> (index % 64)) & 1;
+    }
+
+    /**
+     * Marks the block of the given order and index as free, updating the summary levels on the way up only
+     * while a word goes from zero to non-zero.
+     */
+    void set_block(int order, pfn_t index) {
+        OrderBitmap& bitmap = _orders[order];
+        for (unsigned int level = 0; level < bitmap.nr_levels; level++) {
+            uint64_t& word = bitmap.levels[level][index / 64];
+            bool was_empty = word == 0;
+            word |= 1ull << (index % 64);
+            if (!was_empty) break;
+            index /= 64;
+        }
+        if (bitmap.nr_free++ == 0) _nonempty_orders |= 1u << order;
+        _nr_free_pages += 1ull << order;
+    }
+
+    /**
+     * Marks the free block of the given order and index as no longer free, updating the summary levels on the way
+     * up only while a word goes from non-zero to zero.
+     */
+    void clear_block(int order, pfn_t index) {
+        OrderBitmap& bitmap = _orders[order];
+        for (unsigned int level = 0; level < bitmap.nr_levels; level++) {
+            uint64_t& word = bitmap.levels[level][index / 64];
+            word &= ~(1ull << (index % 64));
+            if (word != 0) break;
+            index /= 64;
+        }
+        if (--bitmap.nr_free == 0) _nonempty_orders &= ~(1u << order);
+        _nr_free_pages -= 1ull << order;
+    }
+
+    /**
+     * Finds the lowest free block of the given order, which must have one, by descending the summary levels.
+     * @return the block's index (its pfn >> order).
+     */
+    pfn_t find_first_block(int order) const {
+        const OrderBitmap& bitmap = _orders[order];
+        pfn_t index = 0;
+        for (int level = bitmap.nr_levels - 1; level >= 0; level--) {
+            index = index * 64 + __builtin_ctzll(bitmap.levels[level][index]);
+        }
+        return index;
+    }
+
+    /**
+     * Frees a block, merging it with its buddy for as long as the buddy is free.  Buddies that lie outside of
+     * memory or in a reserved range never have their bit set, so they are never merged with.
+     */
+    void free_block(pfn_t pfn, int order) {
+        pfn_t index = pfn >> order;
+        while (order < MAX_ORDER and test_block(order, index ^ 1)) {
+            clear_block(order, index ^ 1);
+            index >>= 1;
+            order++;
+            _nr_merges++;
+        }
+        set_block(order, index);
+    }
+
+    /**
+     * Frees [start, end) as the largest naturally aligned blocks that fit, merging each with its free buddies.
+     */
+    void free_range(pfn_t start, pfn_t end) {
+        while (start < end) {
+            int order = start == 0 ? MAX_ORDER : __builtin_ctzll(start);
+            if (order > MAX_ORDER) order = MAX_ORDER;
+            while ((1ull << order) > end - start) order--;
+            free_block(start, order);
+            start += 1ull << order;
+        }
+    }
+
+    /**
+     * Finds the free block that holds the given page.
+     * @param order receives the order of the block
+     * @return true if the page is free.
+     */
+    bool find_free_block_of(pfn_t pfn, int& order) const {
+        for (order = 0; order <= MAX_ORDER; order++) {
+            if (test_block(order, pfn >> order)) return true;
+        }
+        return false;
+    }
+
+    /**
+     * Takes every free page of [first, end) out of the bitmaps.  The free block holding each part of the range is
+     * found by testing one bit per order, and the parts of it outside of the range are freed again.
+     * @return the number of pages of the range that were not free.
+     */
+    uint64_t reserve_range(pfn_t first, pfn_t end) {
+        uint64_t nr_not_free = 0;
+        pfn_t pfn = first;
+        while (pfn < end) {
+            int order;
+            if (!find_free_block_of(pfn, order)) {
+                nr_not_free++;
+                pfn++;
+                continue;
+            }
+            pfn_t block_start = pfn & ~((1ull << order) - 1);
+            pfn_t block_end = block_start + (1ull << order);
+            clear_block(order, block_start >> order);
+            // give back what lies outside of the range, on either side:
+            free_range(block_start, pfn);
+            if (block_end > end) {
+                free_range(end, block_end);
+                block_end = end;
+            }
+            pfn = block_end;
+        }
+        return nr_not_free;
+    }
+
+public:
+    /**
+     * Allocates 2^order number of contiguous pages: takes the lowest free block of the smallest order that has
+     * one (found with a count-trailing-zeros over the mask of non-empty orders), and splits it down, marking the
+     * right-hand half free at every step.
+     * @param order The power of two, of the number of contiguous pages to allocate.
+     * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+     * allocation failed.
+     */
+    PageDescriptor *allocate_pages(int order) override
+    {
+        assert(0 <= order and order <= MAX_ORDER);
+        UniqueSpinLock l(_lock);
+        if (_pool == NULL) {
+            carve_bitmaps();
+        }
+        uint32_t candidates = _nonempty_orders & ~((1u << order) - 1);
+        if (candidates == 0) {
+            _nr_failures[order]++;
+            syslog.messagef(LogLevel::FATAL, "Could not find free memory space; block of order size [%d] not allocated", order);
+            return NULL;
+        }
+        int source_order = __builtin_ctz(candidates);
+        pfn_t index = find_first_block(source_order);
+        clear_block(source_order, index);
+        for (int split_order = source_order - 1; split_order >= order; split_order--) {
+            index *= 2;
+            set_block(split_order, index + 1);
+            _nr_splits++;
+        }
+        return sys.mm().pgalloc().pfn_to_pgd(index << order);
+    }
+
+    /**
+     * Frees 2^order contiguous pages.
+     * @param pgd A pointer to an array of page descriptors to be freed.
+     * @param order The power of two number of contiguous pages to free.
+     */
+    void free_pages(PageDescriptor *pgd, int order) override
+    {
+        assert(0 <= order and order <= MAX_ORDER);
+        pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+        assert(pfn < _nr_pgd and pfn % (1ull << order) == 0);
+        UniqueSpinLock l(_lock);
+        free_block(pfn, order);
+    }
+
+    /**
+     * Marks a range of pages as available for allocation.
+     * @param start A pointer to the first page descriptors to be made available.
+     * @param count The number of page descriptors to make available.
+     */
+    virtual void insert_page_range(PageDescriptor *start, uint64_t count) override
+    {
+        pfn_t first = sys.mm().pgalloc().pgd_to_pfn(start);
+        assert(first + count <= _nr_pgd);
+        UniqueSpinLock l(_lock);
+        if (_pool == NULL) {
+            // the bitmaps are carved out of inserted memory, which waits for the first allocation:
+            if (add_pending_range(first, first + count)) return;
+            mm_log.messagef(LogLevel::WARNING, "More than %u ranges inserted before the first allocation", BITMAP_MAX_PENDING);
+            carve_bitmaps();
+            if (_pool == NULL) return;
+        }
+        free_range(first, first + count);
+    }
+
+    /**
+     * Marks a range of pages as unavailable for allocation.
+     * @param start A pointer to the first page descriptors to be made unavailable.
+     * @param count The number of page descriptors to make unavailable.
+     */
+    virtual void remove_page_range(PageDescriptor *start, uint64_t count) override
+    {
+        pfn_t first = sys.mm().pgalloc().pgd_to_pfn(start);
+        pfn_t end = first + count;
+        assert(end <= _nr_pgd);
+        UniqueSpinLock l(_lock);
+        if (_pool == NULL and _nr_pending == BITMAP_MAX_PENDING) {
+            // (the removal may split a pending range, and there is no room for the second half)
+            carve_bitmaps();
+        }
+        uint64_t nr_not_free = _pool == NULL ? remove_pending_range(first, end) : reserve_range(first, end);
+        if (nr_not_free > 0) {
+            mm_log.messagef(LogLevel::ERROR, "%lu pages of pfns [%lx, %lx) were not free and could not be reserved",
+                            nr_not_free, first, end);
+        }
+    }
+
+    /**
+     * Initialises the allocation algorithm: sizes the bitmaps of every order for the given number of pages.  They
+     * are carved out of the memory inserted next, at the first allocation (see carve_bitmaps()), with no block free.
+     * @return Returns TRUE if the algorithm was successfully initialised, FALSE otherwise.
+     */
+    bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) override
+    {
+        _nr_pgd = nr_page_descriptors;
+        _nr_pool_words = lay_out_bitmaps(NULL);
+        if (_nr_pool_words == 0) {
+            syslog.messagef(LogLevel::FATAL, "Bitmap buddy allocator cannot track %lu pages!", nr_page_descriptors);
+            return false;
+        }
+        _pool = NULL;
+        _nr_pending = 0;
+        for (int order = 0; order <= MAX_ORDER; order++) {
+            _orders[order].nr_free = 0;
+            _nr_failures[order] = 0;
+        }
+        _nonempty_orders = 0;
+        _nr_free_pages = 0;
+        _nr_splits = 0;
+        _nr_merges = 0;
+        return true;
+    }
+
+    /**
+     * Returns the friendly name of the allocation algorithm, for debugging and selection purposes.
+     */
+    const char* name() const override { return "buddy-bitmap"; }
+
+    /**
+     * Dumps out the current state of the buddy system, in the same format as the list-based allocator.
+     */
+    void dump_state() const override
+    {
+        mm_log.messagef(LogLevel::DEBUG, "BUDDY STATE:");
+        for (int order = 0; order <= MAX_ORDER and _pool != NULL; order++) {
+            char buffer[256];
+            int len = snprintf(buffer, sizeof(buffer), "[%d] ", order);
+            const OrderBitmap& bitmap = _orders[order];
+            uint64_t nr_words = (((_nr_pgd + (1ull << order) - 1) >> order) + 63) / 64;
+            for (uint64_t w = 0; w < nr_words; w++) {
+                for (uint64_t word = bitmap.levels[0][w]; word != 0; word &= word - 1) {
+                    if (len > (int)sizeof(buffer) - 20) {
+                        mm_log.messagef(LogLevel::DEBUG, "%s", buffer);
+                        len = snprintf(buffer, sizeof(buffer), "[%d] ", order);
+                    }
+                    pfn_t pfn = (w * 64 + __builtin_ctzll(word)) << order;
+                    len += snprintf(buffer + len, sizeof(buffer) - len, "%lx ", pfn);
+                }
+            }
+            mm_log.messagef(LogLevel::DEBUG, "%s", buffer);
+        }
+        mm_log.messagef(LogLevel::DEBUG, "[stats] free pages %lu splits %lu merges %lu",
+                        _nr_free_pages, _nr_splits, _nr_merges);
+        for (int order = 0; order <= MAX_ORDER; order++) {
+            mm_log.messagef(LogLevel::DEBUG, "[stats] order %d: free blocks %lu failures %lu",
+                            order, _orders[order].nr_free, _nr_failures[order]);
+        }
+    }
+
+private:
+    SpinLock _lock;
+    OrderBitmap _orders[MAX_ORDER + 1];
+    uint32_t _nonempty_orders;      // bit k is set if order k has a free block
+    uint64_t _nr_pgd;               // number of pages the bitmaps cover
+    uint64_t* _pool;                // the words of every bitmap, or NULL until they are carved out of memory
+    uint64_t _nr_pool_words;
+    BitmapPendingRange _pending[BITMAP_MAX_PENDING];   // inserted before the bitmaps were set up, sorted by pfn
+    unsigned int _nr_pending;
+    uint64_t _nr_free_pages;
+    uint64_t _nr_splits;
+    uint64_t _nr_merges;
+    uint64_t _nr_failures[MAX_ORDER + 1];
+};
+
+/*
+ * Allocation algorithm registration framework
+ */
+RegisterPageAllocator(BitmapBuddyPageAllocator);
@@ -7,20 +7,288 @@
 #include <infos/mm/mm.h>
 #include <infos/kernel/kernel.h>
 #include <infos/kernel/log.h>
+#include <infos/kernel/cmdline.h>
 #include <infos/util/math.h>
 #include <infos/util/printf.h>
+#include <infos/util/string.h>
+
+#include "buddy.h"
+#include "smp.h"
+#include "tunables.h"
 
 using namespace infos::kernel;
 using namespace infos::mm;
 using namespace infos::util;
 
-#define MAX_ORDER	18
+#define NO_PFN		0xffffffffu	// marks the end of a free list in BuddyPageMeta::prev_free (and bounds the pfns we track)
+#define ORDER_NOT_FREE	(-1)		// marks a page that does not head a free block
+#define MAX_PENDING_RANGES	32	// ranges of memory kept aside by insert_page_range() until the first allocation
+
+/**
+ * Allocator-private metadata for a page frame.  The PageDescriptor belongs to the kernel and only gives us
+ * the next_free link, so the back link and the "free, order = k" tag of every page live in this side table,
+ * indexed by pfn.  Together they let us find, unlink and merge a buddy without walking any free list.
+ * The table is sized from the number of page descriptors, and carved out of the memory being managed (see
+ * BuddyPageAllocator::ingest_pending_ranges()).  It is shared by every buddy flavour registered in this file;
+ * only the selected one ever sets it up.
+ */
+struct BuddyPageMeta {
+    uint32_t prev_free;     // pfn of the previous block in the free list, or NO_PFN if this block is the list head
+    int8_t free_order;      // order of the free block headed by this page, or ORDER_NOT_FREE
+    uint8_t migratetype;    // which type's free list the block is on (only meaningful while it is free)
+};
+
+static BuddyPageMeta* page_meta;
+
+#define PAGEBLOCK_ORDER	9	// free memory is grouped by migrate type in naturally aligned blocks of this order
+
+/*
+ * The migrate type that owns each pageblock.  Frees go to the owner's free lists, and an allocation only takes
+ * memory from another type's pageblock when its own type has nothing left (see steal_block()).
+ * Free blocks larger than a pageblock are always owned by MIGRATE_MOVABLE, except in the CMA region, whose
+ * pageblocks are MIGRATE_CMA for good.  Carved out of managed memory right behind page_meta.
+ */
+static uint8_t* pageblock_type;
+
+/**
+ * A range of pages inserted before the page metadata has been set up, [start, end) in pfns.
+ */
+struct PendingRange {
+    pfn_t start;
+    pfn_t end;
+};
+
+/*
+ * The order in which an allocation of each type falls back to the free lists of the other types.
+ * MIGRATE_CMA is not in here: only movable allocations may borrow from it, and they do so before anything else.
+ */
+static const MigrateType fallbacks[MIGRATE_PCPTYPES][MIGRATE_PCPTYPES - 1] = {
+    { MIGRATE_RECLAIMABLE, MIGRATE_MOVABLE },     // MIGRATE_UNMOVABLE
+    { MIGRATE_UNMOVABLE, MIGRATE_MOVABLE },       // MIGRATE_RECLAIMABLE
+    { MIGRATE_RECLAIMABLE, MIGRATE_UNMOVABLE },   // MIGRATE_MOVABLE
+};
+
+#define PCP_MAX_ORDER	3	// orders 0..PCP_MAX_ORDER are served from the per-CPU page caches
+#define PCP_MAX_BATCH	256	// upper limit for pgalloc.pcp.batch
+
+/**
+ * A per-CPU cache of recently freed blocks for each of the small orders.  Each list is a LIFO stack linked
+ * through next_free (and BuddyPageMeta::prev_free as the back link, since cached blocks are not on any buddy
+ * free list): allocation pops the hottest block from the head, draining gives the coldest blocks from the tail
+ * back to the buddy lists.  Cached blocks count as allocated as far as the buddy lists are concerned.
+ * There is a set of lists per migrate type, so that a cache never hands one type's pages to another (pages of the
+ * CMA region go on the movable lists, since movable allocations are the only ones that may have them).
+ * The lists are protected by the lock, which only their own CPU takes, except when every cache is drained; it
+ * also keeps interrupts off, so that an interrupt handler that allocates never finds a list half-updated.
+ */
+struct alignas(64) PerCpuPageCache {
+    SpinLock lock;
+    PageDescriptor* head[MIGRATE_PCPTYPES][PCP_MAX_ORDER + 1];
+    PageDescriptor* tail[MIGRATE_PCPTYPES][PCP_MAX_ORDER + 1];
+    unsigned int count[MIGRATE_PCPTYPES][PCP_MAX_ORDER + 1];
+};
+
+/**
+ * A zone of physical memory: a contiguous, pageblock-aligned range of page frames with its own buddy free lists,
+ * counters and lock.  Blocks never merge across a zone boundary, so each zone is an independent buddy allocator
+ * and CPUs working in different zones never touch the same state.  Everything but start_pfn and end_pfn is
+ * protected by the lock.
+ */
+struct alignas(64) BuddyZone {
+    pfn_t start_pfn;
+    pfn_t end_pfn;
+    SpinLock lock;
+
+    PageDescriptor* free_areas[MIGRATE_TYPES][MAX_ORDER + 1];   // +1 to account also for order=0
+    PageDescriptor* free_tails[MIGRATE_TYPES][MAX_ORDER + 1];   // last block of each free list, for in-order ingestion
+    PageDescriptor* zeroed_free;                // order-0 pages zeroed ahead of time, see allocate_zeroed_pages()
+    uint64_t nr_free_blocks[MAX_ORDER + 1];     // free blocks of each order, over all types
+    uint64_t nr_free_pages;                     // pages on all free lists
+    uint64_t nr_free_pages_by_type[MIGRATE_TYPES];
+    uint64_t nr_pageblocks[MIGRATE_TYPES];      // pageblocks owned by each type
+
+    uint64_t nr_splits;             // counted in both modes, so that lazy and eager can be compared
+    uint64_t nr_merges;
+    uint64_t nr_coalesce_passes;
+    uint64_t nr_fallbacks;          // allocations that had to take memory from another type
+    uint64_t nr_pageblock_claims;   // ... and took over the pageblock while at it
+    uint64_t nr_remote_allocs;      // allocations served here for a CPU whose own zone had run out
+
+    uint64_t nr_zeroed_pages;       // pages on zeroed_free (not counted in nr_free_pages)
+    uint64_t nr_zeroed_hits;        // zeroed allocations served from zeroed_free
+    uint64_t nr_idle_zeroed;        // pages zeroed in the background and put on zeroed_free
+
+    PageDescriptor* coloured_free[MAX_PAGE_COLOURS];    // order-0 pages of each colour, see allocate_coloured_page()
+    unsigned int nr_coloured[MAX_PAGE_COLOURS];
+    uint64_t nr_coloured_pages;     // pages on the colour lists (not counted in nr_free_pages)
+    uint64_t nr_colour_hits;        // coloured allocations served from the colour lists
+};
+
+// The orders of the huge page pools, indexed like BuddyAllocatorStats::nr_huge_*.
+static const int huge_page_orders[NR_HUGE_PAGE_SIZES] = { HUGE_PAGE_ORDER, GIGANTIC_PAGE_ORDER };
+
+/**
+ * A pool of free blocks of one huge page size, taken off the buddy free lists at boot so that large mappings
+ * can always be backed.  The blocks are kept on a LIFO stack linked through next_free.
+ */
+struct HugePagePool {
+    SpinLock lock;
+    PageDescriptor* head;
+    uint64_t nr_free;       // blocks in the pool
+    uint64_t nr_reserved;   // blocks the pool keeps when they are freed (pgalloc.hugepages.*)
+    uint64_t nr_hits;       // allocations served from the pool
+    uint64_t nr_fallbacks;  // allocations that found the pool empty and went to the buddy lists
+};
+
+#define TRACE_RING_SIZE	4096	// events kept per CPU by pgalloc.trace (a power of two)
+
+/**
+ * An allocator event recorded by pgalloc.trace.  The type is the letter the event is dumped with:
+ *   'a' allocation and 'f' free of 2^arg pages at pfn, 'x' failed allocation of order arg,
+ *   's' split and 'm' merge of a free block of order arg at pfn,
+ *   'i' insertion and 'r' removal of a range of arg pages at pfn.
+ */
+struct PageTraceEvent {
+    uint64_t timestamp;     // time-stamp counter
+    uintptr_t caller;       // return address of the call that led to the event
+    uint32_t pfn;
+    uint32_t arg;           // order, or number of pages for range events
+    char type;
+};
+
+/**
+ * A per-CPU ring of the most recent allocator events.  Writers claim a slot with an atomic increment of head,
+ * so an interrupt that allocates in the middle of recording an event just takes the next slot; no lock is
+ * needed, and a CPU never writes another CPU's ring.
+ */
+struct PageTraceRing {
+    uint64_t head;          // events ever recorded; the next one goes to events[head % TRACE_RING_SIZE]
+    PageTraceEvent events[TRACE_RING_SIZE];
+};
+
+static PageTraceRing trace_rings[MAX_CPUS];
+
+/**
+ * Reads the CPU's time-stamp counter.  Used to time memory ingestion, which happens before the kernel's
+ * own clock is running.
+ */
+static inline uint64_t read_cycle_counter() {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Lazy buddy tunable: the number of free blocks an order may hold before frees into it merge again.
+static unsigned int lazy_slack = 16;
+
+RegisterCmdLineArgument(BuddyLazySlack, "pgalloc.lazy.slack") { lazy_slack = parse_cmdline_uint(value); }
+
+// Number of zones to split memory into; 0 means one per CPU.
+static unsigned int nr_zones_wanted = 0;
+
+RegisterCmdLineArgument(BuddyZones, "pgalloc.zones") { nr_zones_wanted = parse_cmdline_uint(value); }
+
+// Per-CPU page cache tunables: pgalloc.pcp.high=0 disables the caches.
+static unsigned int pcp_batch = 16;     // number of blocks moved between a cache and the buddy lists at once
+static unsigned int pcp_high = 64;      // drain a batch back to the buddy lists when a cache grows above this
+static unsigned int pcp_low = 0;        // refill a batch from the buddy lists when a cache shrinks to this
+
+RegisterCmdLineArgument(BuddyPcpBatch, "pgalloc.pcp.batch") { pcp_batch = parse_cmdline_uint(value); }
+RegisterCmdLineArgument(BuddyPcpHigh, "pgalloc.pcp.high") { pcp_high = parse_cmdline_uint(value); }
+RegisterCmdLineArgument(BuddyPcpLow, "pgalloc.pcp.low") { pcp_low = parse_cmdline_uint(value); }
+
+// Huge page pools: the number of 2 MiB (order 9) and 1 GiB (order 18) blocks to reserve at boot.
+static uint64_t nr_huge_pages_wanted[NR_HUGE_PAGE_SIZES];
+
+RegisterCmdLineArgument(BuddyHugePages2M, "pgalloc.hugepages.2m") { nr_huge_pages_wanted[0] = parse_cmdline_uint(value); }
+RegisterCmdLineArgument(BuddyHugePages1G, "pgalloc.hugepages.1g") { nr_huge_pages_wanted[1] = parse_cmdline_uint(value); }
+
+// Memory-pressure watermarks: the free page count below which allocations reclaim memory themselves (0 means
+// 1/256 of memory, but at least 32 pages).  The low and high watermarks are 5/4 and 3/2 of it.
+static uint64_t watermark_min_wanted = 0;
+
+RegisterCmdLineArgument(BuddyWatermarkMin, "pgalloc.watermark.min") { watermark_min_wanted = parse_cmdline_uint(value); }
+
+// The size of the CMA region, in pages (rounded up to whole pageblocks); 0 means there is none.
+static uint64_t cma_pages_wanted = 0;
+
+RegisterCmdLineArgument(BuddyCma, "pgalloc.cma") { cma_pages_wanted = parse_cmdline_uint(value); }
+
+#define RECLAIM_RETRIES	3	// rounds of direct reclaim a failing allocation goes through before giving up
+
+// Every shrinker that has been constructed, in order of registration.
+static Shrinker* shrinkers;
+
+Shrinker::Shrinker(const char* name, uint64_t (*shrink)(uint64_t nr_pages))
+    : _name(name), _shrink(shrink), _nr_calls(0), _nr_reclaimed(0), _next(NULL)
+{
+    // append, so that shrinkers are asked in the order they were registered:
+    Shrinker** link = &shrinkers;
+    while (*link != NULL) link = &(*link)->_next;
+    *link = this;
+}
+
+uint64_t Shrinker::shrink(uint64_t nr_pages)
+{
+    uint64_t nr_reclaimed = _shrink(nr_pages);
+    _nr_calls++;
+    _nr_reclaimed += nr_reclaimed;
+    return nr_reclaimed;
+}
+
+// Every page migrator that has been constructed, in order of registration.
+static PageMigrator* migrators;
+
+PageMigrator::PageMigrator(const char* name, bool (*migrate)(PageDescriptor* pgd))
+    : _name(name), _migrate(migrate), _nr_calls(0), _nr_migrated(0), _next(NULL)
+{
+    PageMigrator** link = &migrators;
+    while (*link != NULL) link = &(*link)->_next;
+    *link = this;
+}
+
+bool PageMigrator::migrate(PageDescriptor* pgd)
+{
+    bool migrated = _migrate(pgd);
+    _nr_calls++;
+    if (migrated) _nr_migrated++;
+    return migrated;
+}
+
+// Allocation event tracing (see PageTraceRing): pgalloc.trace=1 turns it on.
+static bool trace_enabled = false;
+
+RegisterCmdLineArgument(BuddyTrace, "pgalloc.trace") { trace_enabled = parse_cmdline_uint(value) != 0; }
+
+// Pre-zeroed pages: how many to keep zeroed ahead of time (0 disables); one is zeroed per idle call.
+static uint64_t nr_zeroed_pages_wanted = 256;
+
+RegisterCmdLineArgument(BuddyZeroedPages, "pgalloc.zeroed.pages") { nr_zeroed_pages_wanted = parse_cmdline_uint(value); }
+
+// Page colouring: the number of cache colours that pages for buddy_allocate_coloured_page() are sorted by
+// (rounded down to a power of two, at most MAX_PAGE_COLOURS; 0 turns colouring off).
+static unsigned int nr_page_colours_wanted = 0;
+
+RegisterCmdLineArgument(BuddyColours, "pgalloc.colours") { nr_page_colours_wanted = parse_cmdline_uint(value); }
+
+#define COLOUR_HIGH	16	// a colour list holding more pages than this gives the older half back
+
+class BuddyPageAllocator;
+
+// The buddy allocator that was initialised (i.e. selected with pgalloc.algorithm), for the API in buddy.h.
+static BuddyPageAllocator* active_buddy;
 
 /**
  * A buddy page allocation algorithm.
  */
 class BuddyPageAllocator : public PageAllocatorAlgorithm
 {
+public:
+    /**
+     * @param lazy selects the lazy-coalescing flavour of the algorithm (see LazyBuddyPageAllocator).
+     */
+    explicit BuddyPageAllocator(bool lazy = false) : _lazy(lazy) { }
+
 private:
 
     /**
@@ -28,7 +296,7 @@ private:
      * @param order is the size of the memory block
      * @return 2^order;
      */
-    uint64_t get_block_size(uint64_t order) {
+    uint64_t get_block_size(uint64_t order) const {
         return 1u << order;
     }
 
@@ -82,39 +350,80 @@ private:
     }
 
     /**
-     * Checks if a given pgd is within the memory block of order = 'order', where
-     * the page block starts from 'block'.
-     * Note: a page can be in a block but not be free.
-     * @param block is a pointer to the start of the range of contiguous pages that form the block
-     * @param order is the size (power) of the block
+     * Obtains the allocator-private metadata of the given page.
+     * @param pgd is the page under inspection
+     * @return the entry of page_meta that belongs to pgd
+     */
+    BuddyPageMeta& meta_of(PageDescriptor* pgd) {
+        return page_meta[pgd_to_pfn(pgd)];
+    }
+
+    /**
+     * Obtains the migrate type that owns the pageblock of the given page.
      * @param pgd is the page under inspection
-     * @return true if the page given by 'pgd' is within the block, else false.
+     * @return the owner of the pageblock containing pgd
+     */
+    MigrateType pageblock_type_of(PageDescriptor* pgd) {
+        return (MigrateType)pageblock_type[pgd_to_pfn(pgd) >> PAGEBLOCK_ORDER];
+    }
+
+    /**
+     * Hands every pageblock overlapping a block over to the given migrate type.
+     * @param pgd is the first page of the block
+     * @param order is the size of the block
+     * @param type is the new owner
      */
-    bool is_page_in_block(PageDescriptor* block, int order, PageDescriptor* pgd) {
-        uint64_t block_size = get_block_size(order);
-        PageDescriptor* last_page_in_block = block + block_size;
-        return (pgd >= block) && (pgd < last_page_in_block);
+    void set_pageblock_type(BuddyZone& zone, PageDescriptor* pgd, int order, MigrateType type) {
+        pfn_t first = pgd_to_pfn(pgd) >> PAGEBLOCK_ORDER;
+        pfn_t last = (pgd_to_pfn(pgd) + get_block_size(order) - 1) >> PAGEBLOCK_ORDER;
+        for (pfn_t pb = first; pb <= last; pb++) {
+            zone.nr_pageblocks[pageblock_type[pb]]--;
+            zone.nr_pageblocks[type]++;
+            pageblock_type[pb] = type;
+        }
+    }
+
+    /**
+     * Checks whether a block would hold pages both inside and outside of the CMA region.  Such a block must never
+     * be formed, since the region's pages may only ever be on the CMA free lists.
+     * @param pgd is the first page of the block
+     * @param order is the size of the block
+     * @return true if the block overlaps the region without lying inside of it.
+     */
+    bool straddles_cma_region(PageDescriptor* pgd, int order) {
+        pfn_t start = pgd_to_pfn(pgd);
+        pfn_t end = start + get_block_size(order);
+        pfn_t cma_end = _cma_start_pfn + _cma_pages;
+        return start < cma_end and _cma_start_pfn < end and (start < _cma_start_pfn or end > cma_end);
+    }
+
+    /**
+     * Checks whether a free block can merge with its buddy: the buddy must be a free block of the same order, and
+     * the merged block must not reach across the edge of the CMA region.
+     * @param pgd is the free block
+     * @param order is the order of the block
+     */
+    bool can_merge(BuddyZone& zone, PageDescriptor* pgd, int order) {
+        PageDescriptor* buddy = buddy_of(pgd, order);
+        return is_page_free(zone, buddy, order) and !straddles_cma_region(pgd < buddy ? pgd : buddy, order + 1);
     }
 
     /**
-     * Checks whether the given page in the block of size 2^order is free (i.e. contained in
-     * a free spaces linked list) and returns the pointer to the pointer to where the pgd is.
+     * Checks whether the given page heads a free block of size 2^order (i.e. is contained in the
+     * order's free spaces linked list) of the given zone.  This is a tag lookup and never walks the list.
+     * @param zone is the zone the block must belong to
      * @param pgd is the pgd under inspection
      * @param order is the size (power) of the block
-     * @return the list node ptrptr if the pgd can be found, else return NULL.
+     * @return true if pgd heads a free block of the given order, else false (also for pages outside of the zone).
      */
-    PageDescriptor** is_page_free(PageDescriptor* pgd, int order) {
+    bool is_page_free(BuddyZone& zone, PageDescriptor* pgd, int order) {
         enforce_valid_order_input(order);
-        enforce_valid_pgd_input(pgd);
-        PageDescriptor** list_node_ptr_ptr = &_free_areas[order];
-        // iterate through the order's free spaces linked list until we find the link that is = pgd:
-        while (*list_node_ptr_ptr != NULL) {
-            if (*list_node_ptr_ptr == pgd) {
-                return list_node_ptr_ptr;
-            }
-            list_node_ptr_ptr = &(*list_node_ptr_ptr)->next_free;
+        pfn_t pfn = pgd_to_pfn(pgd);
+        if (pgd < pgd_base or pfn < zone.start_pfn or pfn >= zone.end_pfn) {
+            // e.g. the buddy of a block at the very end of memory, or just across a zone boundary:
+            return false;
         }
-        return NULL;
+        return meta_of(pgd).free_order == order;
     }
 
 	/** Given a page descriptor, and an order, returns the buddy PGD.  The buddy could either be
@@ -144,296 +453,1843 @@ private:
 	}
 
     /**
-     * Insert pgd block into the linked list of the given order.
-     * Inserts block in between two nodes where the left node is of smaller/equal pgd address than block, and
-     * where right node has larger pgd address than block OR is NULL;
+     * Insert pgd block at the head of the linked list of the given order and type, and tag it as free.
+     * @param pgd
+     * @param order
+     * @param type
+     */
+    void insert_block(BuddyZone& zone, PageDescriptor* pgd, int order, MigrateType type) {
+        enforce_valid_order_input(order);
+        enforce_valid_pgd_input(pgd);
+        BuddyPageMeta& meta = meta_of(pgd);
+        assert(meta.free_order == ORDER_NOT_FREE);
+        PageDescriptor* old_head = zone.free_areas[type][order];
+        pgd->next_free = old_head;
+        if (old_head != NULL) {
+            meta_of(old_head).prev_free = pgd_to_pfn(pgd);
+        }
+        meta.prev_free = NO_PFN;
+        meta.free_order = order;
+        meta.migratetype = type;
+        zone.free_areas[type][order] = pgd;
+        zone.nr_free_blocks[order]++;
+        zone.nr_free_pages += get_block_size(order);
+        zone.nr_free_pages_by_type[type] += get_block_size(order);
+        if (old_head == NULL) {
+            zone.free_tails[type][order] = pgd;
+        }
+    }
+
+    /**
+     * Appends pgd block to the tail of the linked list of the given order and type, and tags it as free.
+     * Used when ingesting memory, so that every list is built in address order in a single pass.
      * @param pgd
      * @param order
+     * @param type
      */
-    PageDescriptor** insert_block(PageDescriptor* pgd, int order) {
+    void append_block(BuddyZone& zone, PageDescriptor* pgd, int order, MigrateType type) {
         enforce_valid_order_input(order);
         enforce_valid_pgd_input(pgd);
-        // Find the ll_ptr_ptr to the free_areas array in which the page descriptor should be inserted.
-        PageDescriptor **ll_ptr_ptr = &_free_areas[order];
-        // Iterate through the linked list to get to the point where prev_free pgd block is the
-        // largest block that is smaller than ll_ptr_ptr; stop at the end of the linked list.
-        while (*ll_ptr_ptr < pgd and *ll_ptr_ptr != NULL) {
-            ll_ptr_ptr = &(*ll_ptr_ptr)->next_free;
+        BuddyPageMeta& meta = meta_of(pgd);
+        assert(meta.free_order == ORDER_NOT_FREE);
+        PageDescriptor* old_tail = zone.free_tails[type][order];
+        pgd->next_free = NULL;
+        if (old_tail != NULL) {
+            old_tail->next_free = pgd;
+            meta.prev_free = pgd_to_pfn(old_tail);
+        } else {
+            meta.prev_free = NO_PFN;
+            zone.free_areas[type][order] = pgd;
         }
-        // Insert pgd into the linked list at where ll_ptr_ptr is pointing to:
-        pgd->next_free = *ll_ptr_ptr;
-        *ll_ptr_ptr = pgd;
-        // Return the insert point ll_ptr_ptr:
-        return ll_ptr_ptr;
+        meta.free_order = order;
+        meta.migratetype = type;
+        zone.free_tails[type][order] = pgd;
+        zone.nr_free_blocks[order]++;
+        zone.nr_free_pages += get_block_size(order);
+        zone.nr_free_pages_by_type[type] += get_block_size(order);
     }
 
     /**
-     * Removes pgd block of size=order from the free memory linked list.
-     * Will only remove the block if it exists!
+     * Removes pgd block of size=order from the free memory linked list (of whichever type it is on).
+     * The block must be in the list; it is unlinked through its back link in O(1).
      * @param pgd is the pgd pointer to the block to be removed
      * @param order is the size of the block
      */
-    void remove_block(PageDescriptor* pgd, int order) {
+    void remove_block(BuddyZone& zone, PageDescriptor* pgd, int order) {
         enforce_valid_order_input(order);
         enforce_valid_pgd_input(pgd);
-        // Starting from the _free_area array, iterate until the block has been located in the ll_ptr_ptr.
-        PageDescriptor **ll_ptr_ptr = &_free_areas[order];
-        while (*ll_ptr_ptr < pgd and *ll_ptr_ptr != NULL) {
-            ll_ptr_ptr = &(*ll_ptr_ptr)->next_free;
-        }
+        BuddyPageMeta& meta = meta_of(pgd);
         // Make sure the block actually exists in linked list before attempting to remove:
-        assert(*ll_ptr_ptr == pgd);
-        // Remove the block from the free ll_ptr_ptr.
-        *ll_ptr_ptr = pgd->next_free;
+        assert(meta.free_order == order);
+        MigrateType type = (MigrateType)meta.migratetype;
+        PageDescriptor* next = pgd->next_free;
+        if (meta.prev_free == NO_PFN) {
+            zone.free_areas[type][order] = next;
+        } else {
+            pfn_to_pgd(meta.prev_free)->next_free = next;
+        }
+        if (next != NULL) {
+            meta_of(next).prev_free = meta.prev_free;
+        } else {
+            zone.free_tails[type][order] = meta.prev_free == NO_PFN ? NULL : pfn_to_pgd(meta.prev_free);
+        }
+        meta.prev_free = NO_PFN;
+        meta.free_order = ORDER_NOT_FREE;
         pgd->next_free = NULL;
+        zone.nr_free_blocks[order]--;
+        zone.nr_free_pages -= get_block_size(order);
+        zone.nr_free_pages_by_type[type] -= get_block_size(order);
     }
 
 	/**
-	 * Given a pointer to a block of free memory in the order "source_order", this function will
+	 * Given a block of free memory in the order "source_order", this function will
 	 * split the block in half, and insert it into the order below.
-	 * @param block_pointer A pointer to a pointer containing the beginning of a block of free memory.
+	 * @param block A pointer to the beginning of a block of free memory.
 	 * @param source_order The order in which the block of free memory exists.  Naturally,
 	 * the split will insert the two new blocks into the order below.
 	 * @return Returns the left-hand-side of the new block.
 	 */
-	PageDescriptor *split_block(PageDescriptor **block_pointer, int source_order)
+	PageDescriptor *split_block(BuddyZone& zone, PageDescriptor *block, int source_order)
 	{
         enforce_valid_order_input(source_order);
-        enforce_valid_pgd_input(*block_pointer);
+        enforce_valid_pgd_input(block);
         // check that the block pointer is properly aligned:
-        if (!is_aligned(*block_pointer, source_order)) {
+        if (!is_aligned(block, source_order)) {
             syslog.message(LogLevel::ERROR, "Page descriptor is not aligned within source order! Split operation aborted.");
             return NULL;
         }
         if (source_order == 0) {
             syslog.message(LogLevel::INFO, "Cannot split blocks of order zero; returning original block");
-            return *block_pointer;
+            return block;
         }
-        // Find the buddy of the given *block_pointer in the lower order
-        PageDescriptor *new_block_LHS = *block_pointer;
+        // Find the buddy of the given block in the lower order
+        PageDescriptor *new_block_LHS = block;
         PageDescriptor *new_block_RHS = buddy_of(new_block_LHS, source_order - 1);    // should give the order=source_order-1 block on the RHS of new_block_LHS
         // ensure that the buddy pgd addresses are in the correct order:
         assert(new_block_LHS < new_block_RHS);
         // Remove source_order block from the source order free mem linked list:
-        remove_block(*block_pointer, source_order);
-        // Insert new lower order blocks to the lower order free mem linked list:
-        insert_block(new_block_LHS, source_order - 1);
-        insert_block(new_block_RHS, source_order - 1);
+        MigrateType type = (MigrateType)meta_of(block).migratetype;
+        remove_block(zone, block, source_order);
+        zone.nr_splits++;
+        trace('s', block, source_order, __builtin_return_address(0));
+        // Insert new lower order blocks to the lower order free mem linked list of the same type
+        // (RHS first, so that the LHS ends up at the head of the list):
+        insert_block(zone, new_block_RHS, source_order - 1, type);
+        insert_block(zone, new_block_LHS, source_order - 1, type);
         return new_block_LHS;
 	}
 
 	/**
 	 * Takes a block in the given source order, and merges it (and its buddy) into the next order.
-	 * @param block_pointer A pointer to a pointer containing a block in the pair to merge.
+	 * Both the block and its buddy must be free.
+	 * @param block A pointer to a block in the pair to merge.
 	 * @param source_order The order in which the pair of blocks live.
-	 * @return Returns the new slot that points to the merged block.
+	 * @return Returns the merged block.
 	 */
-	PageDescriptor **merge_block(PageDescriptor **block_pointer, int source_order)
+	PageDescriptor *merge_block(BuddyZone& zone, PageDescriptor *block, int source_order)
 	{
         enforce_valid_order_input(source_order);
-        enforce_valid_pgd_input(*block_pointer);
+        enforce_valid_pgd_input(block);
         // check alignment of pgd in source_order:
-        if (!is_aligned(*block_pointer, source_order)) {
+        if (!is_aligned(block, source_order)) {
             syslog.message(LogLevel::ERROR, "Page descriptor is not aligned within source order! Merge operation aborted.");
             return NULL;
         }
         if (source_order == MAX_ORDER) {
-            syslog.message(LogLevel::INFO, "Cannot merge blocks of order MAX_ORDER; returning original slot");
-            return block_pointer;
+            syslog.message(LogLevel::INFO, "Cannot merge blocks of order MAX_ORDER; returning original block");
+            return block;
         }
         // find buddy of given block in order=source_order:
         // note: at this point, we can't tell whether the buddy is on the left or right of the original pgd pointer
-        PageDescriptor* source_order_buddy = buddy_of(*block_pointer, source_order);
+        PageDescriptor* source_order_buddy = buddy_of(block, source_order);
         // remove source_order blocks from source_order linked list:
-        remove_block(*block_pointer, source_order);
-        remove_block(source_order_buddy, source_order);
+        remove_block(zone, block, source_order);
+        remove_block(zone, source_order_buddy, source_order);
         // insert new higher order blocks into higher order linked list:
-        PageDescriptor* new_higher_order_block = (*block_pointer < source_order_buddy) ? *block_pointer : source_order_buddy;
-        return insert_block(new_higher_order_block, source_order + 1);
+        PageDescriptor* new_higher_order_block = (block < source_order_buddy) ? block : source_order_buddy;
+        if (source_order + 1 > PAGEBLOCK_ORDER and pageblock_type_of(new_higher_order_block) != MIGRATE_CMA) {
+            // a free block spanning several pageblocks holds no allocations at all, so it goes back to the default:
+            set_pageblock_type(zone, new_higher_order_block, source_order + 1, MIGRATE_MOVABLE);
+        }
+        insert_block(zone, new_higher_order_block, source_order + 1, pageblock_type_of(new_higher_order_block));
+        zone.nr_merges++;
+        trace('m', new_higher_order_block, source_order, __builtin_return_address(0));
+        return new_higher_order_block;
 	}
 
-public:
+    /**
+     * Checks whether a fallback allocation should take over the pageblock it steals from, rather than just the
+     * pages it needs.  Large allocations would leave little of the pageblock to its owner anyway, and unmovable
+     * or reclaimable memory scattered through movable pageblocks is exactly what grouping is meant to prevent.
+     */
+    static bool should_claim_pageblock(int order, MigrateType type) {
+        return order >= PAGEBLOCK_ORDER / 2 or type != MIGRATE_MOVABLE;
+    }
+
+    /**
+     * Moves the free blocks of a pageblock to the free lists of the given type, and hands the pageblock itself
+     * over to that type if at least half of it is free (so that most of its future frees go to the new owner too).
+     * @param pgd is any page in the pageblock
+     * @param type is the claiming type
+     */
+    void claim_pageblock(BuddyZone& zone, PageDescriptor* pgd, MigrateType type) {
+        pfn_t start = pgd_to_pfn(pgd) & ~(pfn_t)(get_block_size(PAGEBLOCK_ORDER) - 1);
+        pfn_t end = start + get_block_size(PAGEBLOCK_ORDER);
+        if (end > zone.end_pfn) end = zone.end_pfn;
+        uint64_t nr_free = 0;
+        for (pfn_t pfn = start; pfn < end; ) {
+            int order = page_meta[pfn].free_order;
+            if (order == ORDER_NOT_FREE) {
+                pfn++;
+                continue;
+            }
+            PageDescriptor* block = pfn_to_pgd(pfn);
+            remove_block(zone, block, order);
+            insert_block(zone, block, order, type);
+            nr_free += get_block_size(order);
+            pfn += get_block_size(order);
+        }
+        if (nr_free >= get_block_size(PAGEBLOCK_ORDER) / 2 and pageblock_type_of(pgd) != type) {
+            set_pageblock_type(zone, pgd, 0, type);
+            zone.nr_pageblock_claims++;
+        }
+    }
+
+    /**
+     * Finds a block for an allocation whose own type has run out, on the free lists of the fallback types.
+     * The smallest block of a pageblock or more is preferred: a small allocation cuts it down to a single
+     * pageblock and claims all of it, so that the allocations that follow it fill that pageblock instead of
+     * stealing again elsewhere, and the larger free blocks are left alone.  Only when no other type has a whole
+     * pageblock free is a smaller block taken, and then its pageblock is claimed if worthwhile.
+     * Movable allocations first borrow the smallest block that fits from the CMA region, which is never claimed
+     * (except while a contiguous allocation is emptying part of it).
+     * @param order is the order of the allocation
+     * @param type is the type of the allocation
+     * @param block_order receives the order of the block found
+     * @return a free block of at least 2^order pages (still on its free list), or NULL if there is none.
+     */
+    PageDescriptor* steal_block(BuddyZone& zone, int order, MigrateType type, int& block_order) {
+        if (type == MIGRATE_MOVABLE and !_cma_evacuating) {
+            for (int current_order = order; current_order <= MAX_ORDER; current_order++) {
+                if (zone.free_areas[MIGRATE_CMA][current_order] != NULL) {
+                    block_order = current_order;
+                    return zone.free_areas[MIGRATE_CMA][current_order];
+                }
+            }
+        }
+        int min_order = order > PAGEBLOCK_ORDER ? order : PAGEBLOCK_ORDER;
+        for (int current_order = min_order; current_order <= MAX_ORDER; current_order++) {
+            for (MigrateType fallback : fallbacks[type]) {
+                PageDescriptor* block = zone.free_areas[fallback][current_order];
+                if (block == NULL) continue;
+                zone.nr_fallbacks++;
+                if (order < PAGEBLOCK_ORDER) {
+                    for (; current_order > PAGEBLOCK_ORDER; current_order--) {
+                        block = split_block(zone, block, current_order);
+                    }
+                    claim_pageblock(zone, block, type);
+                }
+                // (a block of a pageblock or more is handed out whole and comes back whole, so it is not claimed)
+                block_order = current_order;
+                return block;
+            }
+        }
+        for (int current_order = order; current_order < min_order; current_order++) {
+            for (MigrateType fallback : fallbacks[type]) {
+                PageDescriptor* block = zone.free_areas[fallback][current_order];
+                if (block == NULL) continue;
+                zone.nr_fallbacks++;
+                if (should_claim_pageblock(order, type)) {
+                    claim_pageblock(zone, block, type);
+                }
+                block_order = current_order;
+                return block;
+            }
+        }
+        return NULL;
+    }
+
+    /**
+     * Finds the smallest free block of at least 2^order pages on the free lists of the given type, or else on
+     * those of the fallback types.
+     * @param order is the order of the allocation
+     * @param type is the type of the allocation
+     * @param block_order receives the order of the block found
+     * @return a free block (still on its free list), or NULL if no block is large enough.
+     */
+    PageDescriptor* find_block(BuddyZone& zone, int order, MigrateType type, int& block_order) {
+        for (int i = order; i <= MAX_ORDER; i++) {
+            if (zone.free_areas[type][i] != NULL) {
+                block_order = i;
+                return zone.free_areas[type][i];
+            }
+        }
+        return steal_block(zone, order, type, block_order);
+    }
+
 	/**
-	 * Allocates 2^order number of contiguous pages
+	 * Takes 2^order contiguous pages off the buddy free lists of a zone, splitting a larger block if need be.
+	 * The zone's lock must be held (as for every function below that takes a zone).
+	 * @param zone The zone to allocate from.
 	 * @param order The power of two, of the number of contiguous pages to allocate.
-	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
-	 * allocation failed.
+	 * @param type The migrate type of the allocation.
+	 * @return Returns the first page descriptor of the block, or NULL if no block is large enough.
 	 */
-	PageDescriptor *allocate_pages(int order) override
+	PageDescriptor *allocate_block(BuddyZone& zone, int order, MigrateType type)
 	{
         enforce_valid_order_input(order);
         // find smallest order which is >= 'order' that has an empty block for allocation:
-        bool has_found_free_space = false;
-        int alloc_starting_order = order;
-        for (int i = order; i <= MAX_ORDER; i ++) {
-            if (_free_areas[i] != NULL) {
-                // this order contains free memory space available for allocation:
-                alloc_starting_order = i;
-                has_found_free_space = true;
-                break;
-            }
-        }
-        if (!has_found_free_space) {
-            syslog.messagef(LogLevel::FATAL, "Could not find free memory space; block of order size [%d] not allocated", order);
+        int alloc_starting_order;
+        PageDescriptor* alloc_block = find_block(zone, order, type, alloc_starting_order);
+        if (alloc_block == NULL) {
             return NULL;
         }
-        // Get free block at the START of the linked list for chosen order:
-        // (we choose to allocate from the head of the linked list cuz it's easier)
-        PageDescriptor* alloc_block = _free_areas[alloc_starting_order];
         // split the starting alloc block down to obtain the correctly-sized block (of size 'order') to allocate
         for (int j = alloc_starting_order; j > order; j--) {
-            alloc_block = split_block(&alloc_block, j);
+            alloc_block = split_block(zone, alloc_block, j);
         }
         // remove alloc_block from free spaces linked list cuz it's already allocated.
-        remove_block(alloc_block, order);
+        remove_block(zone, alloc_block, order);
         return alloc_block;
 	}
 
     /**
-	 * Frees 2^order contiguous pages.
-	 * @param pgd A pointer to an array of page descriptors to be freed.
-	 * @param order The power of two number of contiguous pages to free.
-	 */
-    void free_pages(PageDescriptor *pgd, int order) override
+     * Returns 2^order contiguous pages to the buddy free lists, merging with free buddies on the way up.
+     * @param zone The zone the block belongs to.
+     * @param pgd A pointer to the first page descriptor of the block.
+     * @param order The power of two number of contiguous pages to free.
+     */
+    void free_block(BuddyZone& zone, PageDescriptor *pgd, int order)
     {
         enforce_valid_order_input(order);
         enforce_valid_pgd_input(pgd);
         // check that pgd is properly aligned in order = 'order':
         assert(is_aligned(pgd, order));
-        // insert block back into the free spaces linked list of order = 'order':
-        insert_block(pgd, order);
+        // insert block back into the free spaces linked list of order = 'order', of the pageblock's owner:
+        insert_block(zone, pgd, order, pageblock_type_of(pgd));
         // Check if the buddy in the current order is free; if so, merge and move to order + 1 and perform the
         // same checks and operations, and so on... until we reach MAX_ORDER
-        PageDescriptor* buddy_ptr = buddy_of(pgd, order);
-        while (is_page_free(buddy_ptr, order) != NULL and order < MAX_ORDER) {
-            pgd = *merge_block(&pgd, order);
+        // (in lazy mode, only while an order holds more free blocks than its slack allows)
+        while (order < MAX_ORDER and should_coalesce(zone, order) and can_merge(zone, pgd, order)) {
+            pgd = merge_block(zone, pgd, order);
             order++;
-            // set buddy_ptr to point to the buddy of the new pgd:
-            buddy_ptr = buddy_of(pgd, order);
         }
     }
 
     /**
-     * Marks a range of pages as available for allocation.
-     * @param start A pointer to the first page descriptors to be made available.
-     * @param count The number of page descriptors to make available.
-     *
-     * Hint: You may assume that the pages being inserted are not already in the free lists.
-     * You may also assume that the incoming page descriptor is valid and that the number of
-     * pages to insert is also valid. You may not, however, assume anything about the alignment
-     * of the incoming page descriptor.
+     * Checks whether freeing into the given order should merge with a free buddy right away.  The eager allocator
+     * always does; the lazy one leaves blocks unmerged while the order has no more than its slack of free blocks,
+     * since a block of the same order is likely to be asked for again soon.
      */
-    virtual void insert_page_range(PageDescriptor *start, uint64_t count) override
-    {
-        // ensure that the pages to be inserted are in range:
-        assert(pgd_base <= start && (start + count) <= pgd_last);
+    bool should_coalesce(BuddyZone& zone, int order) const {
+        return !_lazy or zone.nr_free_blocks[order] > _lazy_slack;
+    }
+
+    /**
+     * Merges every pair of free buddies in a zone, working up from order 0, so that blocks left unmerged by the
+     * lazy mode can satisfy a larger request.
+     * @return true if at least one pair was merged.
+     */
+    bool coalesce_zone(BuddyZone& zone) {
+        bool merged = false;
+        for (int order = 0; order < MAX_ORDER; order++) {
+            for (int type = 0; type < MIGRATE_TYPES; type++) {
+                PageDescriptor* pgd = zone.free_areas[type][order];
+                while (pgd != NULL) {
+                    PageDescriptor* next = pgd->next_free;
+                    PageDescriptor* buddy = buddy_of(pgd, order);
+                    if (can_merge(zone, pgd, order)) {
+                        if (buddy == next) next = next->next_free;
+                        // the merged block lands in order + 1, which is looked at on the next pass:
+                        merge_block(zone, pgd, order);
+                        merged = true;
+                    }
+                    pgd = next;
+                }
+            }
+        }
+        zone.nr_coalesce_passes++;
+        return merged;
+    }
+
+    /**
+     * Merges every pair of free buddies in every zone.
+     * @return true if at least one pair was merged.
+     */
+    bool coalesce_all() {
+        bool merged = false;
+        for (unsigned int i = 0; i < _nr_zones; i++) {
+            UniqueSpinLock l(_zones[i].lock);
+            merged |= coalesce_zone(_zones[i]);
+        }
+        return merged;
+    }
+
+    /**
+     * Obtains the order of the largest block that starts at the given page (i.e. that the page is aligned to)
+     * and fits into a run of the given length, without reaching across the edge of the CMA region.  Cutting a run
+     * into such blocks from left to right gives the fewest aligned blocks that cover it.
+     * @param pgd is the first page of the block
+     * @param remaining is the number of pages left in the run (must be > 0)
+     * @return the order of the block
+     */
+    int largest_block_order(PageDescriptor* pgd, uint64_t remaining) {
+        int order = MAX_ORDER;
+        // decrement order until pgd aligns with order:
+        while (!is_aligned(pgd, order) and order >= 0) {
+            // block will at worst be aligned with order=0.
+            order --;
+        }
+        // check if order block size is too large for the run:
+        while (get_block_size(order) > remaining and order >= 0) {
+            // here, remaining will at least be 1, and block will at worst be of size 2^0 = 1.
+            order --;
+        }
+        // (the region is made of whole pageblocks, so a pageblock never straddles its edge)
+        while (order > PAGEBLOCK_ORDER and straddles_cma_region(pgd, order)) {
+            order--;
+        }
+        return order;
+    }
 
+    /**
+     * Puts a run of pages onto the free lists as the largest aligned blocks that fit, without merging.
+     * Each block goes to the free lists of the owner of its pageblock.
+     * Callers must make sure that none of the resulting blocks has a free buddy outside of the run, e.g. because
+     * the run is the unused tail of a block that was just taken off the free lists.
+     * @param zone is the zone that holds the whole run
+     * @param start is the first page of the run
+     * @param count is the number of pages in the run
+     * @param at_tail appends the blocks to the tails of the lists instead of pushing them at the heads
+     * @return the number of blocks inserted
+     */
+    uint64_t insert_range(BuddyZone& zone, PageDescriptor* start, uint64_t count, bool at_tail = false) {
         PageDescriptor* pgd_ptr = start;
         uint64_t remaining_pages_to_insert = count;
+        uint64_t nr_blocks = 0;
         while (remaining_pages_to_insert > 0) {
-            int order = MAX_ORDER;
-            // decrement order until pgt_ptr aligns with order:
-            while (!is_aligned(pgd_ptr, order) and order >= 0) {
-                // block will at worst be aligned with order=0.
-                order --;
-            }
-            // check if order block size is too large for count:
-            while (get_block_size(order) > remaining_pages_to_insert and order >= 0) {
-                // here, remaining_pages_to_insert will at least be 1 (else will exit outer while loop),
-                // and block will at worst be of size 2^0 = 1.
-                order --;
-            }
+            int order = largest_block_order(pgd_ptr, remaining_pages_to_insert);
             // mark block as available for allocation and insert to free spaces linked lists:
             uint64_t block_size = get_block_size(order);
-            insert_block(pgd_ptr, order);
+            if (at_tail) {
+                append_block(zone, pgd_ptr, order, pageblock_type_of(pgd_ptr));
+            } else {
+                insert_block(zone, pgd_ptr, order, pageblock_type_of(pgd_ptr));
+            }
             pgd_ptr += block_size;  // move pgd_ptr to next block
             remaining_pages_to_insert -= block_size;
+            nr_blocks++;
         }
+        return nr_blocks;
     }
 
     /**
-     * Marks a range of pages as unavailable for allocation.
-     * @param start A pointer to the first page descriptors to be made unavailable.
-     * @param count The number of page descriptors to make unavailable.
-     *
-     * Hint: you may assume that the pages being removed are already in the free lists
-     * and that the incoming page descriptor and the number of pages to remove is valid.
-     * You may not assume anything about the alignment of the incoming page descriptor.
+     * Finds the free block that contains the given page.  A free block of order k that contains the page can only
+     * start at the page's pfn rounded down to a multiple of 2^k, so one tag lookup per order is enough.
+     * @param pgd is the page under inspection
+     * @param block_order receives the order of the containing block (ORDER_NOT_FREE if there is none)
+     * @return the first page of the free block containing pgd, or NULL if pgd is not free.
      */
-    virtual void remove_page_range(PageDescriptor *start, uint64_t count) override
-    {
-        // ensure that the pages to be inserted are in range:
-        assert(pgd_base <= start && (start + count) <= pgd_last);
+    PageDescriptor* find_free_block(PageDescriptor* pgd, int& block_order) {
+        pfn_t pfn = pgd_to_pfn(pgd);
+        for (int order = 0; order <= MAX_ORDER; order++) {
+            pfn_t block_pfn = pfn & ~(pfn_t)(get_block_size(order) - 1);
+            if (page_meta[block_pfn].free_order == order) {
+                block_order = order;
+                return pfn_to_pgd(block_pfn);
+            }
+        }
+        block_order = ORDER_NOT_FREE;
+        return NULL;
+    }
 
-        PageDescriptor* pgd_ptr = start;
-        uint64_t remaining_pages_to_remove = count;
-        while (remaining_pages_to_remove > 0) {
-            int order = MAX_ORDER;
-            PageDescriptor* curr_block = NULL;
-            bool is_pages_found = false;
-            bool is_pages_removed = false;
-            while (order >= 0) {
-                // search through free areas (size=order) to find the current pgd_ptr in one of the free memory blocks:
-                curr_block = _free_areas[order];
-                while (curr_block != NULL) { // ignore empty linked lists
-                    if (is_page_in_block(curr_block, order, pgd_ptr)) {
-                        // page is found within block!
-                        is_pages_found = true;
-                        break;
-                    } else {
-                        // move to check (in the next cycle) the next link in the linked list of free mem blocks for this order
-                        curr_block = curr_block->next_free;
-                    }
+    /**
+     * Takes the part of a free block that lies in [from, to) off the free lists, and puts the rest of the block back
+     * as aligned blocks.
+     * @param block is the free block
+     * @param order is the order of the block
+     * @param from is the first page to take, inside the block
+     * @param to is one past the last page to take (may lie beyond the block)
+     * @return one past the last page taken
+     */
+    PageDescriptor* carve_block(BuddyZone& zone, PageDescriptor* block, int order, PageDescriptor* from, PageDescriptor* to) {
+        PageDescriptor* block_end = block + get_block_size(order);
+        PageDescriptor* carve_end = block_end < to ? block_end : to;
+        remove_block(zone, block, order);
+        insert_range(zone, block, from - block);
+        insert_range(zone, carve_end, block_end - carve_end);
+        return carve_end;
+    }
+
+    /**
+     * Logs a run of pages that could not be reserved because they are not free.
+     * @param start is the first page of the run
+     * @param end is one past the last page of the run
+     */
+    void report_not_free(PageDescriptor* start, PageDescriptor* end) {
+        syslog.messagef(LogLevel::ERROR, "Pfns [%lx, %lx) are not free and hence cannot be reserved!",
+                        pgd_to_pfn(start), pgd_to_pfn(end));
+    }
+
+    /**
+     * Obtains the smallest order whose blocks hold at least 'count' pages.
+     * @param count is the number of pages (must be > 0)
+     * @return ceil(log2(count))
+     */
+    static int order_for_count(uint64_t count) {
+        int order = 0;
+        while ((1ul << order) < count) {
+            order++;
+        }
+        return order;
+    }
+
+    /**
+     * Takes up to 'n' blocks of the given order off the buddy free lists.  Rather than splitting once per block,
+     * each round takes one block that is large enough for all remaining requests (or the largest one available),
+     * hands out its pieces, and returns the unused tail to the free lists as aligned blocks.
+     * @param zone is the zone to allocate from
+     * @param order is the order of every block handed out
+     * @param n is the number of blocks wanted
+     * @param out receives the first page descriptor of every block
+     * @param type is the migrate type of the blocks
+     * @return the number of blocks written to out (less than n if memory ran out)
+     */
+    unsigned int allocate_blocks(BuddyZone& zone, int order, unsigned int n, PageDescriptor* out[], MigrateType type) {
+        enforce_valid_order_input(order);
+        unsigned int filled = 0;
+        while (filled < n) {
+            unsigned int wanted = n - filled;
+            int target_order = order + order_for_count(wanted);
+            if (target_order > MAX_ORDER) target_order = MAX_ORDER;
+            // prefer the smallest block that covers everything, else the largest smaller block there is:
+            // (from this type's free lists, and only from the other types' when this one has nothing left at all)
+            int block_order = -1;
+            for (int i = target_order; i <= MAX_ORDER; i++) {
+                if (zone.free_areas[type][i] != NULL) {
+                    block_order = i;
+                    break;
                 }
-                uint64_t block_size = get_block_size(order);
-                if (curr_block == NULL) {
-                    // search smaller order if pgd not found:
-                    order --;
-                } else if (block_size > remaining_pages_to_remove) {
-                    // will need to split the block to get to the appropriate block size to remove!
-                    PageDescriptor* lhs_block = split_block(&curr_block, order);
-                    // if lhs block contains our page pgd_ptr:
-                    if (is_page_in_block(lhs_block, order - 1, pgd_ptr)) {
-                        // Set lhs block to the current block under inspection:
-                        curr_block = lhs_block;
-                    } else {
-                        PageDescriptor* rhs_block = buddy_of(lhs_block, order - 1);
-                        // If the pgd_ptr is in the size=order block but not in the new LHS size=order-1 block,
-                        // it must be in the new RHS size=order-1 block:
-                        assert(is_page_in_block(rhs_block, order - 1, pgd_ptr));
-                        curr_block = rhs_block;
-                    }
-                    // continue splitting until we get to an appropriate order size to remove from linked list:
-                    order--;
-                } else {
-                    // check if block to remove is actually in the free spaces linked list:
-                    PageDescriptor **free_pgd_ptr_ptr = is_page_free(pgd_ptr, order);
-                    if (*free_pgd_ptr_ptr == NULL) {
-                        syslog.messagef(LogLevel::FATAL, "Pfn [%d] is not free and hence cannot be reserved!",
-                                        pgd_to_pfn(pgd_ptr));
-                        break;
-                    } else if (*free_pgd_ptr_ptr != pgd_ptr) {
-                        syslog.messagef(LogLevel::FATAL, "Pfn [%d] is not the same as pfn [%d] found in free spaces linked list; pgd not reserved!",
-                                        pgd_to_pfn(pgd_ptr), pgd_to_pfn(*free_pgd_ptr_ptr));
-                        break;
-                    }
-                    // remove block (starting at pgd_ptr; of size 2^order) from the free spaces linked list:
-                    remove_block(*free_pgd_ptr_ptr, order);
-                    remaining_pages_to_remove -= block_size;
-                    pgd_ptr += block_size;  // move pointer to next block
-                    is_pages_removed = true;
+            }
+            for (int i = target_order - 1; block_order < 0 and i >= order; i--) {
+                if (zone.free_areas[type][i] != NULL) {
+                    block_order = i;
+                }
+            }
+            PageDescriptor* block;
+            if (block_order >= 0) {
+                block = zone.free_areas[type][block_order];
+            } else {
+                block = steal_block(zone, order, type, block_order);
+                if (block == NULL) {
                     break;
                 }
             }
-            if (!is_pages_removed or !is_pages_found) {
-                if (!is_pages_found) syslog.messagef(LogLevel::ERROR, "Pfn %d is not found in free spaces linked list!", pgd_to_pfn(pgd_ptr));
-                if (!is_pages_removed) syslog.messagef(LogLevel::ERROR, "Pfn %d is not removed", pgd_to_pfn(pgd_ptr));
-                break;
+            remove_block(zone, block, block_order);
+            uint64_t nr_pieces = get_block_size(block_order - order);
+            if (nr_pieces > wanted) nr_pieces = wanted;
+            for (uint64_t i = 0; i < nr_pieces; i++) {
+                out[filled++] = block + (i << order);
             }
+            // the unused tail's blocks all have their buddies to the left, inside the pieces we just handed out:
+            uint64_t used_pages = nr_pieces << order;
+            uint64_t nr_tail_blocks = insert_range(zone, block + used_pages, get_block_size(block_order) - used_pages);
+            // count the splits it would have taken to cut the block into these pieces one at a time:
+            zone.nr_splits += nr_pieces + nr_tail_blocks - 1;
         }
+        return filled;
     }
 
-	/**
+    /**
+     * Splits memory into pgalloc.zones equal, pageblock-aligned zones (fewer if memory is too small), and
+     * empties their free lists.
+     */
+    void init_zones() {
+        unsigned int nr_zones = nr_zones_wanted > 0 ? nr_zones_wanted : MAX_CPUS;
+        if (nr_zones > MAX_ZONES) nr_zones = MAX_ZONES;
+        uint64_t pageblock_pages = get_block_size(PAGEBLOCK_ORDER);
+        _zone_pages = (nr_pgd + nr_zones - 1) / nr_zones;
+        _zone_pages = (_zone_pages + pageblock_pages - 1) & ~(pageblock_pages - 1);
+        if (_zone_pages == 0) _zone_pages = pageblock_pages;
+        _nr_zones = (nr_pgd + _zone_pages - 1) / _zone_pages;
+        if (_nr_zones == 0) _nr_zones = 1;
+
+        for (unsigned int i = 0; i < _nr_zones; i++) {
+            BuddyZone& zone = _zones[i];
+            zone.start_pfn = i * _zone_pages;
+            zone.end_pfn = zone.start_pfn + _zone_pages < nr_pgd ? zone.start_pfn + _zone_pages : nr_pgd;
+            // initialise pointers in free_areas and free_tails to NULL;
+            for (int type = 0; type < MIGRATE_TYPES; type++) {
+                for (int order = 0; order <= MAX_ORDER; order++) {
+                    zone.free_areas[type][order] = NULL;
+                    zone.free_tails[type][order] = NULL;
+                }
+                zone.nr_free_pages_by_type[type] = 0;
+                zone.nr_pageblocks[type] = 0;
+            }
+            for (auto & nr_free : zone.nr_free_blocks) {
+                nr_free = 0;
+            }
+            zone.nr_free_pages = 0;
+            zone.nr_splits = 0;
+            zone.nr_merges = 0;
+            zone.nr_coalesce_passes = 0;
+            zone.nr_fallbacks = 0;
+            zone.nr_pageblock_claims = 0;
+            zone.nr_remote_allocs = 0;
+            zone.zeroed_free = NULL;
+            zone.nr_zeroed_pages = 0;
+            zone.nr_zeroed_hits = 0;
+            zone.nr_idle_zeroed = 0;
+            for (int colour = 0; colour < MAX_PAGE_COLOURS; colour++) {
+                zone.coloured_free[colour] = NULL;
+                zone.nr_coloured[colour] = 0;
+            }
+            zone.nr_coloured_pages = 0;
+            zone.nr_colour_hits = 0;
+        }
+    }
+
+    /**
+     * Obtains the zone that holds the given page.
+     */
+    BuddyZone& zone_of(PageDescriptor* pgd) {
+        return _zones[pgd_to_pfn(pgd) / _zone_pages];
+    }
+
+    /**
+     * Takes 2^order contiguous pages from this CPU's zone or, once that has run out, from the other zones in turn.
+     * Takes each zone's lock while working in it.
+     * @param order The power of two, of the number of contiguous pages to allocate.
+     * @param type The migrate type of the allocation.
+     * @return Returns the first page descriptor of the block, or NULL if no zone has a block large enough.
+     */
+    PageDescriptor* allocate_from_zones(int order, MigrateType type) {
+        unsigned int local = this_cpu() % _nr_zones;
+        for (unsigned int i = 0; i < _nr_zones; i++) {
+            BuddyZone& zone = _zones[(local + i) % _nr_zones];
+            UniqueSpinLock l(zone.lock);
+            PageDescriptor* pgd = allocate_block(zone, order, type);
+            if (pgd != NULL) {
+                if (i > 0) zone.nr_remote_allocs++;
+                return pgd;
+            }
+        }
+        return NULL;
+    }
+
+    /**
+     * Takes up to 'n' blocks of the given order from this CPU's zone and, if need be, the other zones in turn.
+     * @return the number of blocks written to out (less than n if memory ran out)
+     */
+    unsigned int allocate_bulk_from_zones(int order, unsigned int n, PageDescriptor* out[], MigrateType type) {
+        unsigned int local = this_cpu() % _nr_zones;
+        unsigned int filled = 0;
+        for (unsigned int i = 0; i < _nr_zones and filled < n; i++) {
+            BuddyZone& zone = _zones[(local + i) % _nr_zones];
+            UniqueSpinLock l(zone.lock);
+            unsigned int nr_blocks = allocate_blocks(zone, order, n - filled, out + filled, type);
+            if (i > 0) zone.nr_remote_allocs += nr_blocks;
+            filled += nr_blocks;
+        }
+        return filled;
+    }
+
+    /**
+     * Returns a block to the free lists of the zone it belongs to, under that zone's lock.
+     */
+    void release_block(PageDescriptor* pgd, int order) {
+        BuddyZone& zone = zone_of(pgd);
+        UniqueSpinLock l(zone.lock);
+        free_block(zone, pgd, order);
+    }
+
+    /**
+     * Obtains the huge page pool of the given order.
+     * @return the pool, or NULL if there is no pool of that order.
+     */
+    HugePagePool* huge_pool_of(int order) {
+        for (int i = 0; i < NR_HUGE_PAGE_SIZES; i++) {
+            if (huge_page_orders[i] == order) return &_huge_pools[i];
+        }
+        return NULL;
+    }
+
+    /**
+     * Puts the memory inserted so far on the free lists (see ingest_pending_ranges()), takes the huge pages asked
+     * for with pgalloc.hugepages.* off them, and then sets up the CMA region.  This happens on the first
+     * allocation rather than in init(), because memory is only ingested after init(); it is still before anything
+     * has had the chance to fragment memory.  The largest huge page size goes first, since it is the hardest to find.
+     */
+    void fill_huge_pools() {
+        _huge_pools_filled = true;
+        ingest_pending_ranges();
+        for (int i = NR_HUGE_PAGE_SIZES - 1; i >= 0; i--) {
+            HugePagePool& pool = _huge_pools[i];
+            UniqueSpinLock l(pool.lock);
+            while (pool.nr_free < pool.nr_reserved) {
+                PageDescriptor* pgd = allocate_from_zones(huge_page_orders[i], MIGRATE_MOVABLE);
+                if (pgd == NULL) {
+                    mm_log.messagef(LogLevel::WARNING, "Only %lu of %lu huge pages of order %d could be reserved",
+                                    pool.nr_free, pool.nr_reserved, huge_page_orders[i]);
+                    break;
+                }
+                pgd->next_free = pool.head;
+                pool.head = pgd;
+                pool.nr_free++;
+            }
+        }
+        setup_cma_region();
+    }
+
+    /**
+     * Takes a contiguous run of the pages asked for with pgalloc.cma= off the buddy free lists, hands its
+     * pageblocks to MIGRATE_CMA and puts it back on the CMA free lists, from which only movable allocations and
+     * allocate_contiguous() take pages.  The run has to fit in a single block, and hence in a single zone.
+     */
+    void setup_cma_region() {
+        uint64_t pageblock_pages = get_block_size(PAGEBLOCK_ORDER);
+        uint64_t nr_pages = (cma_pages_wanted + pageblock_pages - 1) & ~(pageblock_pages - 1);
+        if (nr_pages == 0) return;
+        int order = order_for_count(nr_pages);
+        PageDescriptor* pgd = order <= MAX_ORDER and get_block_size(order) <= _zone_pages
+                            ? allocate_from_zones(order, MIGRATE_MOVABLE) : NULL;
+        if (pgd == NULL) {
+            mm_log.messagef(LogLevel::WARNING, "Could not reserve a CMA region of %lu pages", nr_pages);
+            return;
+        }
+        BuddyZone& zone = zone_of(pgd);
+        UniqueSpinLock l(zone.lock);
+        _cma_start_pfn = pgd_to_pfn(pgd);
+        _cma_pages = nr_pages;
+        for (uint64_t offset = 0; offset < nr_pages; offset += pageblock_pages) {
+            set_pageblock_type(zone, pgd + offset, 0, MIGRATE_CMA);
+        }
+        // neither part can merge with anything: the whole block's buddy is across the region's edge
+        insert_range(zone, pgd, nr_pages);
+        insert_range(zone, pgd + nr_pages, get_block_size(order) - nr_pages);
+        mm_log.messagef(LogLevel::INFO, "CMA region at pfns [%lx, %lx)", _cma_start_pfn, _cma_start_pfn + nr_pages);
+    }
+
+    /**
+     * Finds the first page of a range that is not free.  The zone's lock must be held.
+     * @param start is the first pfn of the range
+     * @param end is one past the last pfn of the range
+     * @return the pfn of the first page that is not on a free list, or end if the whole range is free.
+     */
+    pfn_t first_busy_pfn(pfn_t start, pfn_t end) {
+        pfn_t pfn = start;
+        while (pfn < end) {
+            int block_order = ORDER_NOT_FREE;
+            PageDescriptor* block = find_free_block(pfn_to_pgd(pfn), block_order);
+            if (block == NULL) return pfn;
+            pfn = pgd_to_pfn(block) + get_block_size(block_order);
+        }
+        return end;
+    }
+
+    /**
+     * Asks the registered migrators, in turn, to move the allocation that holds the given page elsewhere.
+     * @return true if one of them did.
+     */
+    bool migrate_page(PageDescriptor* pgd) {
+        for (PageMigrator* migrator = migrators; migrator != NULL; migrator = migrator->next()) {
+            if (migrator->migrate(pgd)) return true;
+        }
+        return false;
+    }
+
+    /**
+     * Moves the allocations out of a range of the CMA region through the migrators, stopping at the first page
+     * that none of them can move.  Called without the zone's lock, since the migrators allocate and free pages.
+     * @param start is the first pfn of the range
+     * @param end is one past the last pfn of the range
+     */
+    void evacuate_range(pfn_t start, pfn_t end) {
+        BuddyZone& zone = zone_of(pfn_to_pgd(start));
+        pfn_t last_migrated = end;
+        for (;;) {
+            pfn_t busy;
+            {
+                UniqueSpinLock l(zone.lock);
+                busy = first_busy_pfn(start, end);
+            }
+            // (a migrator that claims to have moved a page that is still in use has not really moved it)
+            if (busy == end or busy == last_migrated or !migrate_page(pfn_to_pgd(busy))) {
+                return;
+            }
+            _nr_cma_migrations++;
+            last_migrated = busy;
+            start = busy;
+        }
+    }
+
+    /**
+     * Records an event in this CPU's trace ring, if tracing is on.  Costs a single predictable branch when it is not.
+     * @param type is the event's letter (see PageTraceEvent)
+     * @param pgd is the page the event is about, or NULL
+     * @param arg is the order, or the number of pages for range events
+     * @param caller is the return address of the call that led to the event
+     */
+    void trace(char type, PageDescriptor* pgd, uint64_t arg, void* caller) {
+        if (__builtin_expect(!_trace, 1)) return;
+        PageTraceRing& ring = trace_rings[this_cpu()];
+        uint64_t slot = __atomic_fetch_add(&ring.head, 1, __ATOMIC_RELAXED);
+        PageTraceEvent& event = ring.events[slot % TRACE_RING_SIZE];
+        event.timestamp = read_cycle_counter();
+        event.caller = (uintptr_t)caller;
+        event.pfn = pgd != NULL ? pgd_to_pfn(pgd) : NO_PFN;
+        event.arg = arg;
+        event.type = type;
+    }
+
+    /**
+     * Fills a block with zeroes, through the kernel's mapping of physical memory.
+     */
+    void zero_block(PageDescriptor* pgd, int order) {
+        memset((void*)sys.mm().pgalloc().pgd_to_vpa(pgd), 0, get_block_size(order) << PAGE_BITS);
+    }
+
+    /**
+     * Sums the free pages of every zone, without taking their locks.  Pages in the per-CPU caches and the
+     * zeroed lists are not counted, so this errs on the side of memory looking scarcer than it is.
+     */
+    uint64_t nr_free_pages() const {
+        uint64_t nr_free = 0;
+        for (unsigned int i = 0; i < _nr_zones; i++) {
+            nr_free += _zones[i].nr_free_pages;
+        }
+        return nr_free;
+    }
+
+    /**
+     * Sets the watermarks from the number of pages that have been given to the allocator, or pgalloc.watermark.min.
+     */
+    void update_watermarks() {
+        uint64_t min = watermark_min_wanted;
+        if (min == 0) {
+            min = _nr_managed_pages / 256;
+            if (min < 32) min = 32;
+        }
+        _watermark_min = min;
+        _watermark_low = min + min / 4;
+        _watermark_high = min + min / 2;
+    }
+
+    /**
+     * Checks free memory against the watermarks after an allocation.  Below the low watermark, the reclaimer is
+     * asked to run the next time the CPU is idle; below the min watermark, the allocating path reclaims up to the
+     * high watermark itself, since memory is about to run out.
+     */
+    void check_watermarks() {
+        uint64_t nr_free = nr_free_pages();
+        if (nr_free >= _watermark_low) {
+            _reclaim_futile = false;
+            return;
+        }
+        _reclaim_wanted = true;
+        if (nr_free < _watermark_min and !_in_reclaim and !_reclaim_futile) {
+            // (if the shrinkers have nothing to give, do not ask them again on every allocation until memory recovers)
+            _nr_direct_reclaims++;
+            _reclaim_futile = reclaim(_watermark_high - nr_free) == 0;
+        }
+    }
+
+    /**
+     * Asks the registered shrinkers, in turn, to give pages back until 'nr_pages' have been reclaimed, and puts the
+     * pages they freed into the per-CPU caches back on the buddy lists.  Does nothing when called from a shrinker.
+     * @param nr_pages is the number of pages wanted
+     * @return the number of pages reclaimed.
+     */
+    uint64_t reclaim(uint64_t nr_pages) {
+        if (_in_reclaim) return 0;
+        _in_reclaim = true;
+        uint64_t nr_reclaimed = 0;
+        for (Shrinker* shrinker = shrinkers; shrinker != NULL and nr_reclaimed < nr_pages; shrinker = shrinker->next()) {
+            nr_reclaimed += shrinker->shrink(nr_pages - nr_reclaimed);
+        }
+        drain_all_caches();
+        _nr_reclaimed_pages += nr_reclaimed;
+        _in_reclaim = false;
+        return nr_reclaimed;
+    }
+
+    /**
+     * Obtains the cache colour of a page: the low bits of its pfn, which are the page-sized part of the cache set
+     * index.
+     */
+    unsigned int colour_of(PageDescriptor* pgd) {
+        return pgd_to_pfn(pgd) & (_nr_colours - 1);
+    }
+
+    /**
+     * Pushes a page onto the list of its colour.  A list that grows beyond COLOUR_HIGH keeps its most recently
+     * pushed half (which is likely still in the cache) and gives the rest back to the buddy free lists.
+     */
+    void push_coloured(BuddyZone& zone, PageDescriptor* pgd) {
+        unsigned int colour = colour_of(pgd);
+        pgd->next_free = zone.coloured_free[colour];
+        zone.coloured_free[colour] = pgd;
+        zone.nr_coloured[colour]++;
+        zone.nr_coloured_pages++;
+        if (zone.nr_coloured[colour] <= COLOUR_HIGH) return;
+        PageDescriptor* last_kept = zone.coloured_free[colour];
+        for (unsigned int i = 1; i < COLOUR_HIGH / 2; i++) {
+            last_kept = last_kept->next_free;
+        }
+        PageDescriptor* next = last_kept->next_free;
+        last_kept->next_free = NULL;
+        while (next != NULL) {
+            PageDescriptor* page = next;
+            next = page->next_free;
+            zone.nr_coloured[colour]--;
+            zone.nr_coloured_pages--;
+            free_block(zone, page, 0);
+        }
+    }
+
+    /**
+     * Takes a naturally aligned block of one page per colour off the free lists of a zone, and pushes its pages
+     * onto the colour lists.
+     * @return false if the zone has no block that large.
+     */
+    bool refill_colours(BuddyZone& zone) {
+        PageDescriptor* block = allocate_block(zone, _colour_order, MIGRATE_MOVABLE);
+        if (block == NULL) return false;
+        for (unsigned int i = 0; i < _nr_colours; i++) {
+            push_coloured(zone, block + i);
+        }
+        return true;
+    }
+
+    /**
+     * Gives every page on the colour lists back to the buddy free lists.
+     * @return true if there were any.
+     */
+    bool release_coloured_pages() {
+        bool released = false;
+        for (unsigned int i = 0; i < _nr_zones; i++) {
+            BuddyZone& zone = _zones[i];
+            if (zone.nr_coloured_pages == 0) continue;
+            UniqueSpinLock l(zone.lock);
+            for (unsigned int colour = 0; colour < _nr_colours; colour++) {
+                while (zone.coloured_free[colour] != NULL) {
+                    PageDescriptor* pgd = zone.coloured_free[colour];
+                    zone.coloured_free[colour] = pgd->next_free;
+                    free_block(zone, pgd, 0);
+                }
+                zone.nr_coloured[colour] = 0;
+            }
+            zone.nr_coloured_pages = 0;
+            released = true;
+        }
+        return released;
+    }
+
+    /**
+     * Returns the page cache of the CPU we are running on.
+     */
+    PerCpuPageCache& this_cpu_cache() {
+        return _pcp[this_cpu()];
+    }
+
+    /**
+     * Pushes a block onto the hot end (head) of a per-CPU cache list, whose lock must be held.
+     */
+    void cache_push(PerCpuPageCache& pcp, PageDescriptor* pgd, int order, MigrateType type) {
+        PageDescriptor* old_head = pcp.head[type][order];
+        pgd->next_free = old_head;
+        meta_of(pgd).prev_free = NO_PFN;
+        if (old_head != NULL) {
+            meta_of(old_head).prev_free = pgd_to_pfn(pgd);
+        } else {
+            pcp.tail[type][order] = pgd;
+        }
+        pcp.head[type][order] = pgd;
+        pcp.count[type][order]++;
+    }
+
+    /**
+     * Pops a block from the hot end (head) of a per-CPU cache list, whose lock must be held.
+     * @return the most recently freed block, or NULL if the list is empty.
+     */
+    PageDescriptor* cache_pop_hot(PerCpuPageCache& pcp, int order, MigrateType type) {
+        PageDescriptor* pgd = pcp.head[type][order];
+        if (pgd == NULL) return NULL;
+        pcp.head[type][order] = pgd->next_free;
+        if (pgd->next_free != NULL) {
+            meta_of(pgd->next_free).prev_free = NO_PFN;
+        } else {
+            pcp.tail[type][order] = NULL;
+        }
+        pgd->next_free = NULL;
+        pcp.count[type][order]--;
+        return pgd;
+    }
+
+    /**
+     * Pops a block from the cold end (tail) of a per-CPU cache list, whose lock must be held.
+     * @return the least recently freed block, or NULL if the list is empty.
+     */
+    PageDescriptor* cache_pop_cold(PerCpuPageCache& pcp, int order, MigrateType type) {
+        PageDescriptor* pgd = pcp.tail[type][order];
+        if (pgd == NULL) return NULL;
+        BuddyPageMeta& meta = meta_of(pgd);
+        if (meta.prev_free == NO_PFN) {
+            pcp.head[type][order] = NULL;
+            pcp.tail[type][order] = NULL;
+        } else {
+            pcp.tail[type][order] = pfn_to_pgd(meta.prev_free);
+            pcp.tail[type][order]->next_free = NULL;
+        }
+        meta.prev_free = NO_PFN;
+        pcp.count[type][order]--;
+        return pgd;
+    }
+
+    /**
+     * Moves up to a batch of blocks from the buddy free lists into a per-CPU cache, whose lock must be held.
+     */
+    void refill_cache(PerCpuPageCache& pcp, int order, MigrateType type) {
+        PageDescriptor* batch[PCP_MAX_BATCH];
+        unsigned int nr_blocks = allocate_bulk_from_zones(order, _pcp_batch, batch, type);
+        // push in reverse, so that the lowest-addressed block ends up at the hot end:
+        while (nr_blocks > 0) {
+            cache_push(pcp, batch[--nr_blocks], order, type);
+        }
+    }
+
+    /**
+     * Gives up to 'nr_blocks' of the coldest blocks of a per-CPU cache, whose lock must be held, back to the buddy
+     * free lists.
+     */
+    void drain_cache(PerCpuPageCache& pcp, int order, MigrateType type, unsigned int nr_blocks) {
+        for (unsigned int i = 0; i < nr_blocks; i++) {
+            PageDescriptor* pgd = cache_pop_cold(pcp, order, type);
+            if (pgd == NULL) break;
+            release_block(pgd, order);
+        }
+    }
+
+    /**
+     * Gives every cached block of every CPU, and every page on the colour lists, back to the buddy free lists,
+     * e.g. before reserving a page range or when a larger allocation could not be satisfied.
+     * @return true if any block was drained.
+     */
+    bool drain_all_caches() {
+        bool drained = release_coloured_pages();
+        for (auto & pcp : _pcp) {
+            UniqueSpinLock l(pcp.lock);
+            for (int type = 0; type < MIGRATE_PCPTYPES; type++) {
+                for (int order = 0; order <= PCP_MAX_ORDER; order++) {
+                    drained |= pcp.count[type][order] > 0;
+                    drain_cache(pcp, order, (MigrateType)type, pcp.count[type][order]);
+                }
+            }
+        }
+        return drained;
+    }
+
+    /**
+     * Checks whether requests of the given order go through the per-CPU caches.
+     */
+    bool is_cached_order(int order) const {
+        return _pcp_high > 0 and order <= PCP_MAX_ORDER;
+    }
+
+public:
+	/**
+	 * Allocates 2^order number of contiguous pages
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor *allocate_pages(int order) override
+	{
+        // callers that do not say otherwise get kernel memory that stays put (e.g. page tables and kernel stacks,
+        // which nothing will ever migrate); movable memory asks for MIGRATE_MOVABLE through buddy_allocate_pages():
+        return allocate_pages_typed(order, MIGRATE_UNMOVABLE);
+	}
+
+	/**
+	 * Allocates 2^order number of contiguous pages from the pageblocks of the given migrate type, falling
+	 * back to the other types' pageblocks when there is nothing left in its own.
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @param type How easily the memory could be moved or given back.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor *allocate_pages_typed(int order, MigrateType type)
+	{
+        enforce_valid_order_input(order);
+        assert(0 <= type and type < MIGRATE_PCPTYPES);
+        if (!_huge_pools_filled) {
+            fill_huge_pools();
+        }
+        PageDescriptor* pgd;
+        if (is_cached_order(order)) {
+            // small orders come from this CPU's cache, which only goes to the buddy lists in batches:
+            PerCpuPageCache& pcp = this_cpu_cache();
+            UniqueSpinLock l(pcp.lock);
+            if (pcp.count[type][order] <= _pcp_low) {
+                refill_cache(pcp, order, type);
+            }
+            pgd = cache_pop_hot(pcp, order, type);
+        } else {
+            pgd = allocate_from_zones(order, type);
+        }
+        if (pgd == NULL and drain_all_caches()) {
+            // the memory we need may be sitting in the caches as small blocks:
+            pgd = allocate_from_zones(order, type);
+        }
+        if (pgd == NULL and _lazy and coalesce_all()) {
+            // ... or in unmerged buddies left behind by lazy frees:
+            pgd = allocate_from_zones(order, type);
+        }
+        for (unsigned int pass = 0; pgd == NULL and pass < RECLAIM_RETRIES; pass++) {
+            // ... or be held by caches elsewhere in the kernel that can give it back:
+            _nr_direct_reclaims++;
+            if (reclaim(get_block_size(order) + _watermark_high) == 0) break;
+            pgd = allocate_from_zones(order, type);
+        }
+        if (pgd == NULL) {
+            _nr_failures[order]++;
+            syslog.messagef(LogLevel::FATAL, "Could not find free memory space; block of order size [%d] not allocated", order);
+            trace('x', NULL, order, __builtin_return_address(0));
+            if (_trace and !_trace_dumped) {
+                // the events that led here are what the trace is for; dump them once, before they are overwritten:
+                _trace_dumped = true;
+                dump_trace();
+            }
+            return NULL;
+        }
+        trace('a', pgd, order, __builtin_return_address(0));
+        check_watermarks();
+        return pgd;
+	}
+
+    /**
+	 * Frees 2^order contiguous pages.
+	 * @param pgd A pointer to an array of page descriptors to be freed.
+	 * @param order The power of two number of contiguous pages to free.
+	 */
+    void free_pages(PageDescriptor *pgd, int order) override
+    {
+        enforce_valid_order_input(order);
+        enforce_valid_pgd_input(pgd);
+        assert(is_aligned(pgd, order));
+        trace('f', pgd, order, __builtin_return_address(0));
+        if (!is_cached_order(order)) {
+            release_block(pgd, order);
+            return;
+        }
+        // keep the (likely still cache-hot) block on this CPU, and drain the coldest ones once we hold too many:
+        // (on the list of the pageblock's owner, so that it is reused by allocations of the same type)
+        MigrateType type = pageblock_type_of(pgd);
+        if (type == MIGRATE_CMA) {
+            if (_cma_evacuating) {
+                // the migrators' next allocation must not get a page of the range that is being emptied:
+                release_block(pgd, order);
+                return;
+            }
+            type = MIGRATE_MOVABLE;
+        }
+        PerCpuPageCache& pcp = this_cpu_cache();
+        UniqueSpinLock l(pcp.lock);
+        cache_push(pcp, pgd, order, type);
+        if (pcp.count[type][order] > _pcp_high) {
+            drain_cache(pcp, order, type, _pcp_batch);
+        }
+    }
+
+    /**
+     * Allocates 'n' separate blocks of 2^order contiguous pages in one go.  Much cheaper than calling
+     * allocate_pages() n times, because a single large block is split once and all of its pieces are handed out.
+     * The blocks are not necessarily contiguous with each other.
+     * @param order The power of two, of the number of contiguous pages in each block.
+     * @param n The number of blocks to allocate.
+     * @param out Receives a pointer to the first page descriptor of each block.
+     * @param type The migrate type of the blocks.
+     * @return Returns the number of blocks allocated; fewer than n means memory ran out.
+     */
+    unsigned int allocate_pages_bulk(int order, unsigned int n, PageDescriptor* out[],
+                                     MigrateType type = MIGRATE_UNMOVABLE)
+    {
+        if (!_huge_pools_filled) {
+            fill_huge_pools();
+        }
+        unsigned int filled = allocate_bulk_from_zones(order, n, out, type);
+        if (filled < n and drain_all_caches()) {
+            filled += allocate_bulk_from_zones(order, n - filled, out + filled, type);
+        }
+        if (filled < n) {
+            syslog.messagef(LogLevel::ERROR, "Bulk allocation of %d blocks of order [%d] only found %d", n, order, filled);
+        }
+        for (unsigned int i = 0; i < filled; i++) {
+            trace('a', out[i], order, __builtin_return_address(0));
+        }
+        check_watermarks();
+        return filled;
+    }
+
+    /**
+     * Frees 'n' separate blocks of 2^order contiguous pages in one go.  The blocks go straight back to the buddy
+     * free lists (bypassing the per-CPU caches), a zone at a time under a single acquisition of its lock, so pieces
+     * of the same original block merge back up as the last of them is freed.
+     * @param pgds The first page descriptor of each block.
+     * @param n The number of blocks to free.
+     * @param order The power of two number of contiguous pages in each block.
+     */
+    void free_pages_bulk(PageDescriptor* pgds[], unsigned int n, int order)
+    {
+        enforce_valid_order_input(order);
+        for (unsigned int i = 0; i < n; i++) {
+            trace('f', pgds[i], order, __builtin_return_address(0));
+        }
+        for (unsigned int i = 0; i < _nr_zones; i++) {
+            BuddyZone& zone = _zones[i];
+            unsigned int first = 0;
+            while (first < n and &zone_of(pgds[first]) != &zone) first++;
+            if (first == n) continue;
+
+            UniqueSpinLock l(zone.lock);
+            for (unsigned int j = first; j < n; j++) {
+                if (&zone_of(pgds[j]) == &zone) free_block(zone, pgds[j], order);
+            }
+        }
+    }
+
+    /**
+     * Allocates exactly 'count' contiguous pages, rather than rounding up to a power of two.  The smallest
+     * block that fits is taken and the unused tail goes straight back to the free lists as aligned blocks, so
+     * e.g. 65 pages cost 65 pages instead of 128.  The first page is aligned to the block size that was taken.
+     * @param count The number of contiguous pages to allocate (1 to 2^MAX_ORDER).
+     * @param type The migrate type of the allocation.
+     * @return Returns a pointer to the first page descriptor of the range, or NULL if allocation failed.
+     */
+    PageDescriptor* allocate_pages_exact(uint64_t count, MigrateType type = MIGRATE_UNMOVABLE)
+    {
+        if (count == 0 or count > get_block_size(MAX_ORDER)) {
+            syslog.messagef(LogLevel::ERROR, "Cannot allocate %lu contiguous pages!", count);
+            return NULL;
+        }
+        int order = order_for_count(count);
+        PageDescriptor* pgd = allocate_pages_typed(order, type);
+        if (pgd == NULL or count == get_block_size(order)) {
+            return pgd;
+        }
+        // the tail's blocks all have their buddies to the left, in the part we hand out, so none can merge yet:
+        BuddyZone& zone = zone_of(pgd);
+        UniqueSpinLock l(zone.lock);
+        insert_range(zone, pgd + count, get_block_size(order) - count);
+        return pgd;
+    }
+
+    /**
+     * Frees a range of pages allocated with allocate_pages_exact().  The range is returned as the largest
+     * aligned blocks that cover it, each merging with its free buddies (e.g. the tail given back at allocation).
+     * @param pgd A pointer to the first page descriptor of the range.
+     * @param count The number of pages in the range, as passed to allocate_pages_exact().
+     */
+    void free_pages_exact(PageDescriptor* pgd, uint64_t count)
+    {
+        enforce_valid_pgd_input(pgd);
+        assert(0 < count and count <= get_block_size(MAX_ORDER));
+        assert(is_aligned(pgd, order_for_count(count)));
+        // traced as the free of the block the range was cut from, which is what its allocation was traced as:
+        trace('f', pgd, order_for_count(count), __builtin_return_address(0));
+        PageDescriptor* end = pgd + count;
+        while (pgd < end) {
+            int order = largest_block_order(pgd, end - pgd);
+            release_block(pgd, order);
+            pgd += get_block_size(order);
+        }
+    }
+
+    /**
+     * Allocates a huge page (a block of HUGE_PAGE_ORDER or GIGANTIC_PAGE_ORDER) for a large mapping.  Huge pages
+     * come from the pool reserved at boot, which is a pop off a stack; only when the pool is empty does this go
+     * to the buddy free lists, which after a long uptime may no longer have a block that large.
+     * @param order The order of the huge page.
+     * @return Returns a pointer to the first page descriptor of the huge page, or NULL if allocation failed.
+     */
+    PageDescriptor* allocate_huge_page(int order)
+    {
+        HugePagePool* pool = huge_pool_of(order);
+        if (pool == NULL) {
+            syslog.messagef(LogLevel::ERROR, "There are no huge pages of order [%d]!", order);
+            return NULL;
+        }
+        if (!_huge_pools_filled) {
+            fill_huge_pools();
+        }
+        {
+            UniqueSpinLock l(pool->lock);
+            PageDescriptor* pgd = pool->head;
+            if (pgd != NULL) {
+                pool->head = pgd->next_free;
+                pgd->next_free = NULL;
+                pool->nr_free--;
+                pool->nr_hits++;
+                trace('a', pgd, order, __builtin_return_address(0));
+                return pgd;
+            }
+            pool->nr_fallbacks++;
+        }
+        return allocate_pages_typed(order, MIGRATE_MOVABLE);
+    }
+
+    /**
+     * Frees a huge page.  It goes back to its pool if the pool is short of its reservation (whether or not it
+     * came from the pool), and to the buddy free lists otherwise.
+     * @param pgd A pointer to the first page descriptor of the huge page.
+     * @param order The order of the huge page.
+     */
+    void free_huge_page(PageDescriptor* pgd, int order)
+    {
+        enforce_valid_pgd_input(pgd);
+        assert(is_aligned(pgd, order));
+        HugePagePool* pool = huge_pool_of(order);
+        assert(pool != NULL);
+        trace('f', pgd, order, __builtin_return_address(0));
+        {
+            UniqueSpinLock l(pool->lock);
+            // (a huge page borrowed from the CMA region goes back to it, since nothing can move it out of the pool)
+            if (pool->nr_free < pool->nr_reserved and pageblock_type_of(pgd) != MIGRATE_CMA) {
+                pgd->next_free = pool->head;
+                pool->head = pgd;
+                pool->nr_free++;
+                return;
+            }
+        }
+        release_block(pgd, order);
+    }
+
+    /**
+     * Obtains the number of cache colours pages are sorted by (0 if colouring is off).
+     */
+    unsigned int nr_page_colours() const { return _nr_colours; }
+
+    /**
+     * Allocates a page of movable memory of the given cache colour.  Pages come from the colour lists of this CPU's
+     * zone (or else the other zones), which are refilled a block of one page per colour at a time; if no zone has
+     * a page of the colour or a block to refill from, any page will do.
+     * @param colour The colour, taken modulo the number of colours.
+     * @return Returns a pointer to the page descriptor of the page, or NULL if allocation failed.
+     */
+    PageDescriptor* allocate_coloured_page(unsigned int colour)
+    {
+        if (_nr_colours == 0) {
+            return allocate_pages_typed(0, MIGRATE_MOVABLE);
+        }
+        if (!_huge_pools_filled) {
+            fill_huge_pools();
+        }
+        colour &= _nr_colours - 1;
+        unsigned int local = this_cpu() % _nr_zones;
+        PageDescriptor* pgd = NULL;
+        for (unsigned int i = 0; i < _nr_zones and pgd == NULL; i++) {
+            BuddyZone& zone = _zones[(local + i) % _nr_zones];
+            UniqueSpinLock l(zone.lock);
+            if (zone.coloured_free[colour] == NULL and !refill_colours(zone)) continue;
+            pgd = zone.coloured_free[colour];
+            zone.coloured_free[colour] = pgd->next_free;
+            pgd->next_free = NULL;
+            zone.nr_coloured[colour]--;
+            zone.nr_coloured_pages--;
+            zone.nr_colour_hits++;
+        }
+        if (pgd == NULL) {
+            _nr_colour_misses++;
+            return allocate_pages_typed(0, MIGRATE_MOVABLE);
+        }
+        trace('a', pgd, 0, __builtin_return_address(0));
+        check_watermarks();
+        return pgd;
+    }
+
+    /**
+     * Frees a page allocated with allocate_coloured_page().  It goes onto the list of its colour, for the next
+     * allocation of that colour.
+     * @param pgd A pointer to the page descriptor of the page.
+     */
+    void free_coloured_page(PageDescriptor* pgd)
+    {
+        if (_nr_colours == 0) {
+            free_pages(pgd, 0);
+            return;
+        }
+        enforce_valid_pgd_input(pgd);
+        trace('f', pgd, 0, __builtin_return_address(0));
+        if (_cma_evacuating and pageblock_type_of(pgd) == MIGRATE_CMA) {
+            // (see free_pages())
+            release_block(pgd, 0);
+            return;
+        }
+        BuddyZone& zone = zone_of(pgd);
+        UniqueSpinLock l(zone.lock);
+        push_coloured(zone, pgd);
+    }
+
+    /**
+     * Allocates 'count' physically contiguous pages from the CMA region.  A range that is already free is taken
+     * if there is one; otherwise the movable allocations that were lent pages of the region are moved out of a
+     * range through the migrators, one range after the other, until one is emptied.  While this goes on, movable
+     * allocations do not borrow from the region, so the migrators' copies always land outside of it.
+     * @param count The number of pages (at most the size of the region).
+     * @return Returns a pointer to the first page descriptor of the range, which is aligned to the smaller of a
+     * pageblock and count rounded up to a power of two, or NULL if allocation failed.
+     */
+    PageDescriptor* allocate_contiguous(uint64_t count)
+    {
+        if (!_huge_pools_filled) {
+            fill_huge_pools();
+        }
+        if (count == 0 or count > _cma_pages) {
+            syslog.messagef(LogLevel::ERROR, "Cannot allocate %lu contiguous pages from a CMA region of %lu!", count, _cma_pages);
+            _nr_cma_failures++;
+            return NULL;
+        }
+        int align_order = order_for_count(count);
+        if (align_order > PAGEBLOCK_ORDER) align_order = PAGEBLOCK_ORDER;
+        pfn_t align = get_block_size(align_order);
+        pfn_t region_end = _cma_start_pfn + _cma_pages;
+        BuddyZone& zone = zone_of(pfn_to_pgd(_cma_start_pfn));
+
+        UniqueSpinLock cma_lock(_cma_lock);
+        _cma_evacuating = true;
+        // pages of the region may be sitting in the movable per-CPU caches:
+        drain_all_caches();
+        PageDescriptor* pgd = NULL;
+        // look for a range that is free as it is before moving anything, and only then empty one:
+        for (int pass = 0; pass < 2 and pgd == NULL; pass++) {
+            for (pfn_t start = _cma_start_pfn; start + count <= region_end and pgd == NULL; ) {
+                pfn_t end = start + count;
+                if (pass > 0) {
+                    evacuate_range(start, end);
+                }
+                UniqueSpinLock l(zone.lock);
+                pfn_t busy = first_busy_pfn(start, end);
+                if (busy < end) {
+                    // the next candidate starts past the page that is in the way:
+                    start = (busy + align) & ~(align - 1);
+                    continue;
+                }
+                pgd = pfn_to_pgd(start);
+                for (PageDescriptor* pgd_ptr = pgd; pgd_ptr < pgd + count; ) {
+                    int block_order = ORDER_NOT_FREE;
+                    PageDescriptor* block = find_free_block(pgd_ptr, block_order);
+                    assert(block != NULL);     // (first_busy_pfn() found the whole range free under the same lock)
+                    pgd_ptr = carve_block(zone, block, block_order, pgd_ptr, pgd + count);
+                }
+            }
+        }
+        _cma_evacuating = false;
+
+        if (pgd == NULL) {
+            _nr_cma_failures++;
+            syslog.messagef(LogLevel::ERROR, "Could not empty %lu contiguous pages of the CMA region", count);
+            trace('x', NULL, order_for_count(count), __builtin_return_address(0));
+            return NULL;
+        }
+        _nr_cma_allocs++;
+        _nr_cma_allocated += count;
+        trace('a', pgd, order_for_count(count), __builtin_return_address(0));
+        return pgd;
+    }
+
+    /**
+     * Gives a range allocated with allocate_contiguous() back to the CMA region, where it can be lent out again.
+     * @param pgd A pointer to the first page descriptor of the range.
+     * @param count The number of pages in the range, as passed to allocate_contiguous().
+     */
+    void free_contiguous(PageDescriptor* pgd, uint64_t count)
+    {
+        enforce_valid_pgd_input(pgd);
+        assert(_cma_start_pfn <= pgd_to_pfn(pgd) and pgd_to_pfn(pgd) + count <= _cma_start_pfn + _cma_pages);
+        trace('f', pgd, order_for_count(count), __builtin_return_address(0));
+        PageDescriptor* end = pgd + count;
+        while (pgd < end) {
+            int order = largest_block_order(pgd, end - pgd);
+            release_block(pgd, order);
+            pgd += get_block_size(order);
+        }
+        UniqueSpinLock cma_lock(_cma_lock);
+        _nr_cma_allocated -= count;
+    }
+
+    /**
+     * Allocates 2^order contiguous pages that are filled with zeroes, e.g. for user memory or page tables.
+     * Single pages come from the zeroed free lists when they have any, so that the cost of zeroing has already
+     * been paid while the CPU was idle (see zero_idle_pages()); anything else is zeroed on the spot.
+     * @param order The power of two, of the number of contiguous pages to allocate.
+     * @return Returns a pointer to the first page descriptor of the zeroed block, or NULL if allocation failed.
+     */
+    PageDescriptor* allocate_zeroed_pages(int order)
+    {
+        enforce_valid_order_input(order);
+        if (order == 0) {
+            unsigned int local = this_cpu() % _nr_zones;
+            for (unsigned int i = 0; i < _nr_zones; i++) {
+                BuddyZone& zone = _zones[(local + i) % _nr_zones];
+                if (zone.nr_zeroed_pages == 0) continue;
+                UniqueSpinLock l(zone.lock);
+                PageDescriptor* pgd = zone.zeroed_free;
+                if (pgd != NULL) {
+                    zone.zeroed_free = pgd->next_free;
+                    pgd->next_free = NULL;
+                    zone.nr_zeroed_pages--;
+                    zone.nr_zeroed_hits++;
+                    trace('a', pgd, 0, __builtin_return_address(0));
+                    return pgd;
+                }
+            }
+        }
+        PageDescriptor* pgd = allocate_pages_typed(order, MIGRATE_UNMOVABLE);
+        if (pgd != NULL) {
+            _nr_zeroed_misses++;
+            zero_block(pgd, order);
+        }
+        return pgd;
+    }
+
+    /**
+     * Gives pre-zeroed pages back to the buddy free lists, e.g. when memory runs low.
+     * @param nr_pages The largest number of pages to give back.
+     * @return Returns the number of pages given back.
+     */
+    uint64_t release_zeroed_pages(uint64_t nr_pages)
+    {
+        uint64_t nr_released = 0;
+        for (unsigned int i = 0; i < _nr_zones and nr_released < nr_pages; i++) {
+            BuddyZone& zone = _zones[i];
+            UniqueSpinLock l(zone.lock);
+            while (zone.zeroed_free != NULL and nr_released < nr_pages) {
+                PageDescriptor* pgd = zone.zeroed_free;
+                zone.zeroed_free = pgd->next_free;
+                zone.nr_zeroed_pages--;
+                free_block(zone, pgd, 0);
+                nr_released++;
+            }
+        }
+        return nr_released;
+    }
+
+    /**
+     * Does the allocator's background work, when the CPU has nothing else to do: first reclaims memory up to the
+     * high watermark if an allocation found free memory below the low one, and then, while there is plenty of
+     * free memory, zeroes a few pages ahead of time.
+     */
+    void idle()
+    {
+        if (_reclaim_wanted) {
+            _reclaim_wanted = false;
+            uint64_t nr_free = nr_free_pages();
+            if (nr_free < _watermark_high) {
+                _nr_background_reclaims++;
+                reclaim(_watermark_high - nr_free);
+            }
+        }
+        if (nr_free_pages() > _watermark_high) {
+            zero_idle_pages();
+        }
+    }
+
+    /**
+     * Zeroes a single free page and moves it to the zeroed free lists, if they hold fewer than the number of pages
+     * asked for with pgalloc.zeroed.pages.  Only one page is zeroed per call, so that an idle CPU that has to
+     * run something else is never kept waiting for longer than that; and it is zeroed outside of the zone lock.
+     */
+    void zero_idle_pages()
+    {
+        if (_nr_zeroed_wanted == 0) return;
+        uint64_t nr_per_zone = (_nr_zeroed_wanted + _nr_zones - 1) / _nr_zones;
+        unsigned int local = this_cpu() % _nr_zones;
+        for (unsigned int i = 0; i < _nr_zones; i++) {
+            BuddyZone& zone = _zones[(local + i) % _nr_zones];
+            // (checked without the lock: at worst a page too many or too few is zeroed)
+            if (zone.nr_zeroed_pages >= nr_per_zone) continue;
+            if (!_huge_pools_filled) {
+                // the huge pages must not be broken up for this:
+                fill_huge_pools();
+            }
+            PageDescriptor* pgd;
+            {
+                UniqueSpinLock l(zone.lock);
+                pgd = allocate_block(zone, 0, MIGRATE_UNMOVABLE);
+            }
+            if (pgd == NULL) continue;
+            zero_block(pgd, 0);
+            UniqueSpinLock l(zone.lock);
+            pgd->next_free = zone.zeroed_free;
+            zone.zeroed_free = pgd;
+            zone.nr_zeroed_pages++;
+            zone.nr_idle_zeroed++;
+            return;
+        }
+    }
+
+    /**
+     * Marks a range of pages as available for allocation.
+     * @param start A pointer to the first page descriptors to be made available.
+     * @param count The number of page descriptors to make available.
+     *
+     * Hint: You may assume that the pages being inserted are not already in the free lists.
+     * You may also assume that the incoming page descriptor is valid and that the number of
+     * pages to insert is also valid. You may not, however, assume anything about the alignment
+     * of the incoming page descriptor.
+     */
+    virtual void insert_page_range(PageDescriptor *start, uint64_t count) override
+    {
+        // ensure that the pages to be inserted are in range:
+        assert(pgd_base <= start && (start + count) <= pgd_last);
+        trace('i', start, count, __builtin_return_address(0));
+        _ingested_pages += count;
+        _nr_managed_pages += count;
+        update_watermarks();
+        if (page_meta == NULL) {
+            // the free lists need the page metadata, which waits for the first allocation:
+            if (add_pending_range(pgd_to_pfn(start), pgd_to_pfn(start + count))) return;
+            // (the kernel reserves pages by inserting them and then removing them, so ingesting early risks
+            // carving the metadata out of something the kernel uses; but there is no room to wait)
+            mm_log.messagef(LogLevel::WARNING, "More than %u ranges inserted before the first allocation", MAX_PENDING_RANGES);
+            ingest_pending_ranges();
+            if (page_meta == NULL) return;
+        }
+        ingest_range(start, count);
+    }
+
+    /**
+     * Puts a range of pages on the free lists of the zones it spans.
+     * @param start A pointer to the first page descriptor of the range.
+     * @param count The number of pages in the range.
+     */
+    void ingest_range(PageDescriptor* start, uint64_t count)
+    {
+        // Ingest the range in one pass: the aligned blocks come out in address order, and appending them means
+        // no list is ever walked, so bringing up memory is linear in the number of blocks.
+        // (a range that spans several zones is ingested zone by zone, so that no block straddles a boundary)
+        uint64_t start_cycles = read_cycle_counter();
+        uint64_t nr_blocks = 0;
+        PageDescriptor* end = start + count;
+        for (PageDescriptor* pgd_ptr = start; pgd_ptr < end; ) {
+            BuddyZone& zone = zone_of(pgd_ptr);
+            PageDescriptor* zone_end = pfn_to_pgd(zone.end_pfn);
+            PageDescriptor* segment_end = zone_end < end ? zone_end : end;
+            UniqueSpinLock l(zone.lock);
+            nr_blocks += insert_range(zone, pgd_ptr, segment_end - pgd_ptr, true);
+            pgd_ptr = segment_end;
+        }
+        uint64_t cycles = read_cycle_counter() - start_cycles;
+
+        _ingested_blocks += nr_blocks;
+        _ingest_cycles += cycles;
+        mm_log.messagef(LogLevel::INFO, "Inserted pfns [%lx, %lx) as %lu blocks in %lu cycles",
+                        pgd_to_pfn(start), pgd_to_pfn(start + count), nr_blocks, cycles);
+    }
+
+    /**
+     * Records a range of pages inserted before the page metadata exists, keeping the pending ranges sorted and
+     * joining the range to its neighbours where they touch.
+     * @return false if there was no room for another range.
+     */
+    bool add_pending_range(pfn_t start, pfn_t end)
+    {
+        unsigned int i = 0;
+        while (i < _nr_pending and _pending[i].start < start) i++;
+        bool joins_previous = i > 0 and _pending[i - 1].end == start;
+        bool joins_next = i < _nr_pending and _pending[i].start == end;
+        if (joins_previous and joins_next) {
+            _pending[i - 1].end = _pending[i].end;
+            for (unsigned int j = i + 1; j < _nr_pending; j++) _pending[j - 1] = _pending[j];
+            _nr_pending--;
+        } else if (joins_previous) {
+            _pending[i - 1].end = end;
+        } else if (joins_next) {
+            _pending[i].start = start;
+        } else {
+            if (_nr_pending == MAX_PENDING_RANGES) return false;
+            for (unsigned int j = _nr_pending; j > i; j--) _pending[j] = _pending[j - 1];
+            _pending[i].start = start;
+            _pending[i].end = end;
+            _nr_pending++;
+        }
+        return true;
+    }
+
+    /**
+     * Takes a range of pages out of the pending ranges, reporting the pages of it that were never inserted.
+     * There must be room for one more pending range, in case the range splits one in two.
+     * @return the number of pages of the range that were not pending.
+     */
+    uint64_t remove_pending_range(pfn_t start, pfn_t end)
+    {
+        uint64_t nr_not_pending = 0;
+        pfn_t covered = start;      // the pages of [start, covered) have been accounted for
+        for (unsigned int i = 0; i < _nr_pending and covered < end; ) {
+            PendingRange& range = _pending[i];
+            if (range.end <= covered) {
+                i++;
+                continue;
+            }
+            if (range.start >= end) break;
+            if (range.start > covered) {
+                report_not_free(pfn_to_pgd(covered), pfn_to_pgd(range.start));
+                nr_not_pending += range.start - covered;
+            }
+            covered = range.end < end ? range.end : end;
+            if (range.start < start and range.end > end) {
+                // the range is split in two around the pages removed:
+                for (unsigned int j = _nr_pending; j > i + 1; j--) _pending[j] = _pending[j - 1];
+                _pending[i + 1].start = end;
+                _pending[i + 1].end = range.end;
+                _nr_pending++;
+                range.end = start;
+                break;
+            } else if (range.start < start) {
+                range.end = start;
+                i++;
+            } else if (range.end > end) {
+                range.start = end;
+                break;
+            } else {
+                for (unsigned int j = i + 1; j < _nr_pending; j++) _pending[j - 1] = _pending[j];
+                _nr_pending--;
+            }
+        }
+        if (covered < end) {
+            report_not_free(pfn_to_pgd(covered), pfn_to_pgd(end));
+            nr_not_pending += end - covered;
+        }
+        return nr_not_pending;
+    }
+
+    /**
+     * Carves the page metadata (page_meta and pageblock_type, sized from the number of page descriptors) out of
+     * the start of the largest range inserted so far, and puts the rest of every inserted range on the free lists.
+     * (A range rarely starts on a large alignment, so its first pages would only form small blocks anyway.)
+     * This waits for the first allocation, because the kernel reserves memory (e.g. its own image and the page
+     * descriptors) by inserting it and then removing it: by the first allocation, every pending range is memory
+     * that nothing else uses.
+     */
+    void ingest_pending_ranges()
+    {
+        if (page_meta != NULL) return;
+        uint64_t nr_pageblocks = (nr_pgd + get_block_size(PAGEBLOCK_ORDER) - 1) >> PAGEBLOCK_ORDER;
+        uint64_t meta_bytes = nr_pgd * sizeof(BuddyPageMeta);
+        uint64_t nr_meta_pages = (meta_bytes + nr_pageblocks + (1ul << PAGE_BITS) - 1) >> PAGE_BITS;
+        int largest = -1;
+        for (unsigned int i = 0; i < _nr_pending; i++) {
+            uint64_t length = _pending[i].end - _pending[i].start;
+            if (length >= nr_meta_pages and (largest < 0 or length > _pending[largest].end - _pending[largest].start)) {
+                largest = i;
+            }
+        }
+        if (largest < 0) {
+            syslog.messagef(LogLevel::FATAL, "No inserted range can hold the %lu pages of buddy allocator metadata!", nr_meta_pages);
+            return;
+        }
+        PageDescriptor* meta_pgd = pfn_to_pgd(_pending[largest].start);
+        _pending[largest].start += nr_meta_pages;
+        page_meta = (BuddyPageMeta*)sys.mm().pgalloc().pgd_to_vpa(meta_pgd);
+        pageblock_type = (uint8_t*)page_meta + meta_bytes;
+        _nr_managed_pages -= nr_meta_pages;
+        update_watermarks();
+        mm_log.messagef(LogLevel::INFO, "Page metadata for %lu pages in pfns [%lx, %lx)",
+                        nr_pgd, pgd_to_pfn(meta_pgd), pgd_to_pfn(meta_pgd + nr_meta_pages));
+
+        // no page heads a free block until it is ingested:
+        for (uint64_t pfn = 0; pfn < nr_pgd; pfn++) {
+            page_meta[pfn].prev_free = NO_PFN;
+            page_meta[pfn].free_order = ORDER_NOT_FREE;
+        }
+        // ... and all memory starts out movable, the type that other types fall back to last:
+        for (uint64_t pb = 0; pb < nr_pageblocks; pb++) {
+            pageblock_type[pb] = MIGRATE_MOVABLE;
+            _zones[(pb << PAGEBLOCK_ORDER) / _zone_pages].nr_pageblocks[MIGRATE_MOVABLE]++;
+        }
+        for (unsigned int i = 0; i < _nr_pending; i++) {
+            if (_pending[i].end > _pending[i].start) {
+                ingest_range(pfn_to_pgd(_pending[i].start), _pending[i].end - _pending[i].start);
+            }
+        }
+        _nr_pending = 0;
+    }
+
+    /**
+     * Marks a range of pages as unavailable for allocation.
+     * @param start A pointer to the first page descriptors to be made unavailable.
+     * @param count The number of page descriptors to make unavailable.
+     *
+     * Hint: you may assume that the pages being removed are already in the free lists
+     * and that the incoming page descriptor and the number of pages to remove is valid.
+     * You may not assume anything about the alignment of the incoming page descriptor.
+     */
+    virtual void remove_page_range(PageDescriptor *start, uint64_t count) override
+    {
+        trace('r', start, count, __builtin_return_address(0));
+        if (page_meta == NULL and _nr_pending == MAX_PENDING_RANGES) {
+            // (the removal may split a pending range, and there is no room for the second half)
+            ingest_pending_ranges();
+        }
+        uint64_t nr_not_free = page_meta == NULL ? remove_pending_range(pgd_to_pfn(start), pgd_to_pfn(start + count))
+                                                 : reserve_range(start, count);
+        _nr_managed_pages -= count - nr_not_free;
+        update_watermarks();
+    }
+
+    /**
+     * Takes every free page of a range off the free lists (e.g. for boot-time or run-time reservations).
+     * The free block holding each part of the range is found from its pfn, and the parts of that block that lie
+     * outside of the range go straight back as aligned blocks, so the cost is O(log N) per block touched rather
+     * than a scan of the free lists.  Pages of the range that are not free are left alone and reported.
+     * @param start A pointer to the first page descriptor to reserve.
+     * @param count The number of pages to reserve.
+     * @return Returns the number of pages in the range that were not free and hence not reserved.
+     */
+    uint64_t reserve_range(PageDescriptor *start, uint64_t count)
+    {
+        // ensure that the pages to be removed are in range:
+        assert(pgd_base <= start && (start + count) <= pgd_last);
+        // pages sitting in the per-CPU caches or the zeroed lists look allocated to the buddy lists, so hand them
+        // back first:
+        drain_all_caches();
+        release_zeroed_pages(nr_pgd);
+
+        PageDescriptor* end = start + count;
+        PageDescriptor* pgd_ptr = start;
+        PageDescriptor* not_free_run = NULL;    // start of the current run of pages that are not free
+        uint64_t nr_not_free = 0;
+        while (pgd_ptr < end) {
+            // work through the range one zone at a time, holding that zone's lock:
+            BuddyZone& zone = zone_of(pgd_ptr);
+            PageDescriptor* zone_end = pfn_to_pgd(zone.end_pfn);
+            PageDescriptor* segment_end = zone_end < end ? zone_end : end;
+            UniqueSpinLock l(zone.lock);
+            while (pgd_ptr < segment_end) {
+                int block_order = ORDER_NOT_FREE;
+                PageDescriptor* block = find_free_block(pgd_ptr, block_order);
+                if (block == NULL) {
+                    if (not_free_run == NULL) not_free_run = pgd_ptr;
+                    nr_not_free++;
+                    pgd_ptr++;
+                    continue;
+                }
+                if (not_free_run != NULL) {
+                    report_not_free(not_free_run, pgd_ptr);
+                    not_free_run = NULL;
+                }
+                // carve the part of the range that overlaps this block out of it:
+                pgd_ptr = carve_block(zone, block, block_order, pgd_ptr, end);
+            }
+        }
+        if (not_free_run != NULL) {
+            report_not_free(not_free_run, end);
+        }
+        return nr_not_free;
+    }
+
+	/**
 	 * Initialises the allocation algorithm.
 	 * @return Returns TRUE if the algorithm was successfully initialised, FALSE otherwise.
 	 *
@@ -446,10 +2302,73 @@ public:
         pgd_base = page_descriptors;
         nr_pgd = nr_page_descriptors;
         pgd_last = pgd_base + nr_pgd;
-        // initialise pointers in _free_areas to NULL;
-        for (auto & _free_area : _free_areas) {
-            _free_area = NULL;
+        if (nr_pgd >= NO_PFN) {
+            syslog.messagef(LogLevel::FATAL, "Buddy allocator can track at most %lu pages, but %lu were given!", (uint64_t)NO_PFN, nr_pgd);
+            return false;
         }
+        init_zones();
+        for (auto & nr_failures : _nr_failures) {
+            nr_failures = 0;
+        }
+        for (int i = 0; i < NR_HUGE_PAGE_SIZES; i++) {
+            _huge_pools[i].head = NULL;
+            _huge_pools[i].nr_free = 0;
+            _huge_pools[i].nr_reserved = nr_huge_pages_wanted[i];
+            _huge_pools[i].nr_hits = 0;
+            _huge_pools[i].nr_fallbacks = 0;
+        }
+        _huge_pools_filled = false;
+        _nr_zeroed_wanted = nr_zeroed_pages_wanted;
+        _nr_zeroed_misses = 0;
+        _nr_managed_pages = 0;
+        update_watermarks();
+        _reclaim_wanted = false;
+        _in_reclaim = false;
+        _reclaim_futile = false;
+        _nr_direct_reclaims = 0;
+        _nr_background_reclaims = 0;
+        _nr_reclaimed_pages = 0;
+        _cma_start_pfn = 0;
+        _cma_pages = 0;
+        _cma_evacuating = false;
+        _nr_cma_allocated = 0;
+        _nr_cma_allocs = 0;
+        _nr_cma_failures = 0;
+        _nr_cma_migrations = 0;
+        // (a block of one page per colour must be naturally aligned for its pages to have every colour once)
+        _colour_order = 0;
+        while (_colour_order < order_for_count(MAX_PAGE_COLOURS)
+               and get_block_size(_colour_order + 1) <= nr_page_colours_wanted) {
+            _colour_order++;
+        }
+        _nr_colours = nr_page_colours_wanted > 0 ? get_block_size(_colour_order) : 0;
+        _nr_colour_misses = 0;
+        _trace = trace_enabled;
+        _trace_dumped = false;
+        for (auto & ring : trace_rings) {
+            ring.head = 0;
+        }
+        _lazy_slack = lazy_slack;
+        active_buddy = this;
+        _ingested_pages = 0;
+        _ingested_blocks = 0;
+        _ingest_cycles = 0;
+        for (auto & pcp : _pcp) {
+            for (int type = 0; type < MIGRATE_PCPTYPES; type++) {
+                for (int order = 0; order <= PCP_MAX_ORDER; order++) {
+                    pcp.head[type][order] = NULL;
+                    pcp.tail[type][order] = NULL;
+                    pcp.count[type][order] = 0;
+                }
+            }
+        }
+        _pcp_batch = pcp_batch > 0 ? (pcp_batch < PCP_MAX_BATCH ? pcp_batch : PCP_MAX_BATCH) : 1;
+        _pcp_high = pcp_high;
+        _pcp_low = pcp_low < _pcp_high ? pcp_low : 0;
+        // the page metadata is only set up once memory has been inserted (see ingest_pending_ranges()):
+        page_meta = NULL;
+        pageblock_type = NULL;
+        _nr_pending = 0;
         return true;
 	}
 
@@ -466,30 +2385,449 @@ public:
 		// Print out a header, so we can find the output in the logs.
 		mm_log.messagef(LogLevel::DEBUG, "BUDDY STATE:");
 
-		// Iterate over each free area.
-		for (unsigned int i = 0; i < ARRAY_SIZE(_free_areas); i++) {
+		// Iterate over each free area (of all migrate types together).
+		for (unsigned int i = 0; i <= MAX_ORDER; i++) {
 			char buffer[256];
-			snprintf(buffer, sizeof(buffer), "[%d] ", i);
+			int len = snprintf(buffer, sizeof(buffer), "[%d] ", i);
 
-			// Iterate over each block in the free area.
-			PageDescriptor *pg = _free_areas[i];
-			while (pg) {
+			// Iterate over each block in the free area, in address order.  The free lists themselves are
+			// unordered, so walk the aligned pfns of this order and look at their free tags instead.
+			// (until the first allocation, memory is not on the free lists yet, and there are no tags)
+			for (pfn_t pfn = 0; page_meta != NULL and pfn < nr_pgd; pfn += (1ul << i)) {
+				if (page_meta[pfn].free_order != (int)i) continue;
+				// Long lists continue on another line rather than overflowing the buffer.
+				if (len > (int)sizeof(buffer) - 20) {
+					mm_log.messagef(LogLevel::DEBUG, "%s", buffer);
+					len = snprintf(buffer, sizeof(buffer), "[%d] ", i);
+				}
 				// Append the PFN of the free block to the output buffer.
-				snprintf(buffer, sizeof(buffer), "%s%lx ", buffer, sys.mm().pgalloc().pgd_to_pfn(pg));
-				pg = pg->next_free;
+				len += snprintf(buffer + len, sizeof(buffer) - len, "%lx ", pfn);
 			}
 
 			mm_log.messagef(LogLevel::DEBUG, "%s", buffer);
 		}
+
+		mm_log.messagef(LogLevel::DEBUG, "[ingest] %lu pages as %lu blocks in %lu cycles",
+						_ingested_pages, _ingested_blocks, _ingest_cycles);
+
+		// Blocks held in the per-CPU caches are not on the lists above.
+		for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+			char buffer[256];
+			int len = snprintf(buffer, sizeof(buffer), "[pcp%d] ", cpu);
+			for (int type = 0; type < MIGRATE_PCPTYPES; type++) {
+				len += snprintf(buffer + len, sizeof(buffer) - len, "%s", type > 0 ? "| " : "");
+				for (int order = 0; order <= PCP_MAX_ORDER; order++) {
+					len += snprintf(buffer + len, sizeof(buffer) - len, "%d:%d ", order, _pcp[cpu].count[type][order]);
+				}
+			}
+			mm_log.messagef(LogLevel::DEBUG, "%s", buffer);
+		}
+
+		dump_stats();
+	}
+
+	/**
+	 * Takes a snapshot of the allocator's counters, summed over the zones; O(zones * MAX_ORDER), without walking
+	 * any free list or taking any lock (so the numbers of a busy zone may be slightly out of step).
+	 * @param stats receives the snapshot
+	 */
+	void get_stats(BuddyAllocatorStats& stats) const
+	{
+		stats.nr_free_pages = 0;
+		stats.nr_splits = 0;
+		stats.nr_merges = 0;
+		stats.nr_coalesce_passes = 0;
+		stats.nr_fallbacks = 0;
+		stats.nr_pageblock_claims = 0;
+		stats.nr_remote_allocs = 0;
+		stats.nr_zeroed_pages = 0;
+		stats.nr_zeroed_wanted = _nr_zeroed_wanted;
+		stats.nr_zeroed_hits = 0;
+		stats.nr_zeroed_misses = _nr_zeroed_misses;
+		stats.nr_idle_zeroed = 0;
+		stats.watermark_min = _watermark_min;
+		stats.watermark_low = _watermark_low;
+		stats.watermark_high = _watermark_high;
+		stats.nr_direct_reclaims = _nr_direct_reclaims;
+		stats.nr_background_reclaims = _nr_background_reclaims;
+		stats.nr_reclaimed_pages = _nr_reclaimed_pages;
+		stats.nr_cma_pages = _cma_pages;
+		stats.nr_cma_allocated = _nr_cma_allocated;
+		stats.nr_cma_allocs = _nr_cma_allocs;
+		stats.nr_cma_failures = _nr_cma_failures;
+		stats.nr_cma_migrations = _nr_cma_migrations;
+		stats.nr_page_colours = _nr_colours;
+		stats.nr_coloured_pages = 0;
+		stats.nr_colour_hits = 0;
+		stats.nr_colour_misses = _nr_colour_misses;
+		for (int type = 0; type < MIGRATE_TYPES; type++) {
+			stats.nr_free_pages_by_type[type] = 0;
+			stats.nr_pageblocks[type] = 0;
+		}
+		for (int order = 0; order <= MAX_ORDER; order++) {
+			stats.nr_free_blocks[order] = 0;
+		}
+		stats.nr_zones = _nr_zones;
+		for (unsigned int i = 0; i < _nr_zones; i++) {
+			const BuddyZone& zone = _zones[i];
+			stats.nr_free_pages_by_zone[i] = zone.nr_free_pages;
+			stats.nr_free_pages += zone.nr_free_pages;
+			stats.nr_splits += zone.nr_splits;
+			stats.nr_merges += zone.nr_merges;
+			stats.nr_coalesce_passes += zone.nr_coalesce_passes;
+			stats.nr_fallbacks += zone.nr_fallbacks;
+			stats.nr_pageblock_claims += zone.nr_pageblock_claims;
+			stats.nr_remote_allocs += zone.nr_remote_allocs;
+			stats.nr_zeroed_pages += zone.nr_zeroed_pages;
+			stats.nr_zeroed_hits += zone.nr_zeroed_hits;
+			stats.nr_idle_zeroed += zone.nr_idle_zeroed;
+			stats.nr_coloured_pages += zone.nr_coloured_pages;
+			stats.nr_colour_hits += zone.nr_colour_hits;
+			for (int type = 0; type < MIGRATE_TYPES; type++) {
+				stats.nr_free_pages_by_type[type] += zone.nr_free_pages_by_type[type];
+				stats.nr_pageblocks[type] += zone.nr_pageblocks[type];
+			}
+			for (int order = 0; order <= MAX_ORDER; order++) {
+				stats.nr_free_blocks[order] += zone.nr_free_blocks[order];
+			}
+		}
+
+		for (int i = 0; i < NR_HUGE_PAGE_SIZES; i++) {
+			stats.nr_huge_free[i] = _huge_pools[i].nr_free;
+			stats.nr_huge_reserved[i] = _huge_pools[i].nr_reserved;
+			stats.nr_huge_hits[i] = _huge_pools[i].nr_hits;
+			stats.nr_huge_fallbacks[i] = _huge_pools[i].nr_fallbacks;
+		}
+
+		uint64_t nr_free_blocks_total = 0;
+		stats.largest_free_order = -1;
+		for (int order = 0; order <= MAX_ORDER; order++) {
+			stats.nr_failures[order] = _nr_failures[order];
+			nr_free_blocks_total += stats.nr_free_blocks[order];
+			if (stats.nr_free_blocks[order] > 0) stats.largest_free_order = order;
+		}
+
+		// see buddy.h for what the fragmentation index means:
+		for (int order = 0; order <= MAX_ORDER; order++) {
+			if (nr_free_blocks_total == 0) {
+				stats.fragmentation_index[order] = 0;
+			} else if (order <= stats.largest_free_order) {
+				stats.fragmentation_index[order] = -1000;
+			} else {
+				uint64_t requested = get_block_size(order);
+				stats.fragmentation_index[order] =
+					1000 - (int)((1000 + stats.nr_free_pages * 1000 / requested) / nr_free_blocks_total);
+			}
+		}
+
+		stats.nr_cached_pages = 0;
+		for (const auto & pcp : _pcp) {
+			for (int type = 0; type < MIGRATE_PCPTYPES; type++) {
+				for (int order = 0; order <= PCP_MAX_ORDER; order++) {
+					stats.nr_cached_pages += pcp.count[type][order] * get_block_size(order);
+				}
+			}
+		}
+	}
+
+	/**
+	 * Writes the allocator's counters to the log.
+	 */
+	void dump_stats() const
+	{
+		BuddyAllocatorStats stats;
+		get_stats(stats);
+
+		mm_log.messagef(LogLevel::DEBUG, "[stats] free pages %lu cached pages %lu largest free order %d",
+						stats.nr_free_pages, stats.nr_cached_pages, stats.largest_free_order);
+		mm_log.messagef(LogLevel::DEBUG, "[stats] splits %lu merges %lu coalesce-passes %lu",
+						stats.nr_splits, stats.nr_merges, stats.nr_coalesce_passes);
+		mm_log.messagef(LogLevel::DEBUG, "[stats] fallbacks %lu pageblock claims %lu",
+						stats.nr_fallbacks, stats.nr_pageblock_claims);
+		static const char* type_names[MIGRATE_TYPES] = { "unmovable", "reclaimable", "movable", "cma" };
+		for (int type = 0; type < MIGRATE_TYPES; type++) {
+			mm_log.messagef(LogLevel::DEBUG, "[stats] %s: pageblocks %lu free pages %lu",
+							type_names[type], stats.nr_pageblocks[type], stats.nr_free_pages_by_type[type]);
+		}
+		for (int i = 0; i < NR_HUGE_PAGE_SIZES; i++) {
+			mm_log.messagef(LogLevel::DEBUG, "[stats] huge pages of order %d: free %lu reserved %lu hits %lu fallbacks %lu",
+							huge_page_orders[i], stats.nr_huge_free[i], stats.nr_huge_reserved[i],
+							stats.nr_huge_hits[i], stats.nr_huge_fallbacks[i]);
+		}
+		mm_log.messagef(LogLevel::DEBUG, "[stats] zeroed pages %lu of %lu hits %lu misses %lu zeroed when idle %lu",
+						stats.nr_zeroed_pages, stats.nr_zeroed_wanted, stats.nr_zeroed_hits,
+						stats.nr_zeroed_misses, stats.nr_idle_zeroed);
+		mm_log.messagef(LogLevel::DEBUG, "[stats] watermarks min %lu low %lu high %lu",
+						stats.watermark_min, stats.watermark_low, stats.watermark_high);
+		mm_log.messagef(LogLevel::DEBUG, "[stats] reclaims direct %lu background %lu reclaimed pages %lu",
+						stats.nr_direct_reclaims, stats.nr_background_reclaims, stats.nr_reclaimed_pages);
+		for (const Shrinker* shrinker = shrinkers; shrinker != NULL; shrinker = shrinker->next()) {
+			mm_log.messagef(LogLevel::DEBUG, "[stats] shrinker %s: calls %lu reclaimed pages %lu",
+							shrinker->name(), shrinker->nr_calls(), shrinker->nr_reclaimed());
+		}
+		mm_log.messagef(LogLevel::DEBUG, "[stats] cma pages %lu allocated %lu allocations %lu failures %lu migrated pages %lu",
+						stats.nr_cma_pages, stats.nr_cma_allocated, stats.nr_cma_allocs,
+						stats.nr_cma_failures, stats.nr_cma_migrations);
+		mm_log.messagef(LogLevel::DEBUG, "[stats] colours %u coloured pages %lu hits %lu misses %lu",
+						stats.nr_page_colours, stats.nr_coloured_pages, stats.nr_colour_hits, stats.nr_colour_misses);
+		for (const PageMigrator* migrator = migrators; migrator != NULL; migrator = migrator->next()) {
+			mm_log.messagef(LogLevel::DEBUG, "[stats] migrator %s: calls %lu migrated %lu",
+							migrator->name(), migrator->nr_calls(), migrator->nr_migrated());
+		}
+		mm_log.messagef(LogLevel::DEBUG, "[stats] zones %u remote allocations %lu",
+						stats.nr_zones, stats.nr_remote_allocs);
+		for (unsigned int i = 0; i < stats.nr_zones; i++) {
+			mm_log.messagef(LogLevel::DEBUG, "[stats] zone %u: pfns [%lx, %lx) free pages %lu",
+							i, _zones[i].start_pfn, _zones[i].end_pfn, stats.nr_free_pages_by_zone[i]);
+		}
+		for (int order = 0; order <= MAX_ORDER; order++) {
+			mm_log.messagef(LogLevel::DEBUG, "[stats] order %d: free blocks %lu failures %lu fragmentation index %d",
+							order, stats.nr_free_blocks[order], stats.nr_failures[order], stats.fragmentation_index[order]);
+		}
+	}
+
+	/**
+	 * Writes the recorded events of every CPU to the log, merged into timestamp order, one per line as
+	 *   [pgtrace] <type> <pfn> <order or pages> <timestamp> <caller>
+	 * so that the log can be fed straight to the replay harness (./bench.sh --trace=FILE).
+	 */
+	void dump_trace() const
+	{
+		if (!_trace) {
+			mm_log.messagef(LogLevel::DEBUG, "[pgtrace] # tracing is off (pgalloc.trace=1 turns it on)");
+			return;
+		}
+		uint64_t next[MAX_CPUS];
+		uint64_t end[MAX_CPUS];
+		uint64_t nr_recorded = 0;
+		uint64_t nr_kept = 0;
+		for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+			end[cpu] = trace_rings[cpu].head;
+			next[cpu] = end[cpu] > TRACE_RING_SIZE ? end[cpu] - TRACE_RING_SIZE : 0;
+			nr_recorded += end[cpu];
+			nr_kept += end[cpu] - next[cpu];
+		}
+		mm_log.messagef(LogLevel::DEBUG, "[pgtrace] # %lu events recorded, the last %lu follow", nr_recorded, nr_kept);
+
+		for (;;) {
+			// take the oldest of the events at the front of each ring:
+			const PageTraceEvent* oldest = NULL;
+			unsigned int oldest_cpu = 0;
+			for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+				if (next[cpu] == end[cpu]) continue;
+				const PageTraceEvent* event = &trace_rings[cpu].events[next[cpu] % TRACE_RING_SIZE];
+				if (oldest == NULL or event->timestamp < oldest->timestamp) {
+					oldest = event;
+					oldest_cpu = cpu;
+				}
+			}
+			if (oldest == NULL) break;
+			next[oldest_cpu]++;
+			mm_log.messagef(LogLevel::DEBUG, "[pgtrace] %c %u %u %lu %lx",
+							oldest->type, oldest->pfn, oldest->arg, oldest->timestamp, oldest->caller);
+		}
 	}
 
 private:
-	PageDescriptor *_free_areas[MAX_ORDER+1];   // +1 to account also for order=0
+	BuddyZone _zones[MAX_ZONES];
+	unsigned int _nr_zones;                     // zones in use
+	uint64_t _zone_pages;                       // pages per zone (a multiple of the pageblock size)
+	uint64_t _nr_failures[MAX_ORDER+1];         // allocations of each order that returned NULL
     PageDescriptor* pgd_base;   // start of available memory
     PageDescriptor* pgd_last;   // end of available memory
     uint64_t nr_pgd;            // number of pages in available memory
+
+    PerCpuPageCache _pcp[MAX_CPUS];
+    unsigned int _pcp_batch;    // copies of the pgalloc.pcp.* tunables, validated in init()
+    unsigned int _pcp_high;
+    unsigned int _pcp_low;
+
+    uint64_t _ingested_pages;   // totals over all insert_page_range() calls, for measuring boot-time ingestion
+    uint64_t _ingested_blocks;
+    uint64_t _ingest_cycles;
+
+    PendingRange _pending[MAX_PENDING_RANGES];  // inserted before the page metadata was set up, sorted by pfn
+    unsigned int _nr_pending;
+
+    const bool _lazy;           // leave freed blocks unmerged until an order exceeds its slack
+    unsigned int _lazy_slack;
+
+    HugePagePool _huge_pools[NR_HUGE_PAGE_SIZES];
+    bool _huge_pools_filled;    // the pools are filled on the first allocation, after memory has been ingested
+
+    uint64_t _nr_zeroed_wanted; // copy of pgalloc.zeroed.pages
+    uint64_t _nr_zeroed_misses; // zeroed allocations that had to zero their pages on the spot
+
+    uint64_t _nr_managed_pages; // pages inserted and not removed again, which the watermarks are scaled to
+    uint64_t _watermark_min;
+    uint64_t _watermark_low;
+    uint64_t _watermark_high;
+    bool _reclaim_wanted;       // free memory fell below the low watermark; reclaim when the CPU is idle
+    bool _in_reclaim;           // the shrinkers are running, so allocations they make must not reclaim again
+    bool _reclaim_futile;       // the last direct reclaim found nothing, and free memory has not been above low since
+    uint64_t _nr_direct_reclaims;
+    uint64_t _nr_background_reclaims;
+    uint64_t _nr_reclaimed_pages;
+
+    pfn_t _cma_start_pfn;       // the CMA region, set up with the huge page pools (empty if there is none)
+    uint64_t _cma_pages;
+    SpinLock _cma_lock;         // serialises contiguous allocations, which may take long to empty a range
+    bool _cma_evacuating;       // a contiguous allocation is emptying a range, so the region is not lent out
+    uint64_t _nr_cma_allocated;
+    uint64_t _nr_cma_allocs;
+    uint64_t _nr_cma_failures;
+    uint64_t _nr_cma_migrations;
+
+    unsigned int _nr_colours;   // pgalloc.colours, validated in init()
+    int _colour_order;          // log2 of _nr_colours
+    uint64_t _nr_colour_misses; // coloured allocations that had to take a page of any colour
+
+    bool _trace;                // record events in trace_rings (pgalloc.trace)
+    bool _trace_dumped;         // the trace has been dumped after a failed allocation
+};
+
+/**
+ * The lazy-coalescing flavour of the buddy allocator, selected with pgalloc.algorithm=buddy-lazy.
+ * Alloc/free ping-pong of one order then reuses the same unmerged blocks instead of merging all the way up on
+ * every free and splitting all the way down again on the next allocation.
+ */
+class LazyBuddyPageAllocator : public BuddyPageAllocator
+{
+public:
+    LazyBuddyPageAllocator() : BuddyPageAllocator(true) { }
+
+	/**
+	 * Returns the friendly name of the allocation algorithm, for debugging and selection purposes.
+	 */
+	const char* name() const override { return "buddy-lazy"; }
 };
 
+RegisterPageAllocator(LazyBuddyPageAllocator);
+
+PageDescriptor* buddy_allocate_pages(int order, MigrateType type)
+{
+    if (active_buddy == NULL) return NULL;
+    return active_buddy->allocate_pages_typed(order, type);
+}
+
+void buddy_free_pages(PageDescriptor* pgd, int order)
+{
+    assert(active_buddy != NULL);
+    active_buddy->free_pages(pgd, order);
+}
+
+unsigned int buddy_allocate_pages_bulk(int order, unsigned int n, PageDescriptor* out[], MigrateType type)
+{
+    if (active_buddy == NULL) return 0;
+    return active_buddy->allocate_pages_bulk(order, n, out, type);
+}
+
+void buddy_free_pages_bulk(PageDescriptor* pgds[], unsigned int n, int order)
+{
+    assert(active_buddy != NULL);
+    active_buddy->free_pages_bulk(pgds, n, order);
+}
+
+PageDescriptor* buddy_allocate_pages_exact(uint64_t count)
+{
+    if (active_buddy == NULL) return NULL;
+    return active_buddy->allocate_pages_exact(count);
+}
+
+void buddy_free_pages_exact(PageDescriptor* pgd, uint64_t count)
+{
+    assert(active_buddy != NULL);
+    active_buddy->free_pages_exact(pgd, count);
+}
+
+PageDescriptor* buddy_allocate_huge_page(int order)
+{
+    if (active_buddy == NULL) return NULL;
+    return active_buddy->allocate_huge_page(order);
+}
+
+void buddy_free_huge_page(PageDescriptor* pgd, int order)
+{
+    assert(active_buddy != NULL);
+    active_buddy->free_huge_page(pgd, order);
+}
+
+PageDescriptor* buddy_allocate_zeroed_pages(int order)
+{
+    if (active_buddy == NULL) return NULL;
+    return active_buddy->allocate_zeroed_pages(order);
+}
+
+PageDescriptor* buddy_allocate_contiguous(uint64_t count)
+{
+    if (active_buddy == NULL) return NULL;
+    return active_buddy->allocate_contiguous(count);
+}
+
+void buddy_free_contiguous(PageDescriptor* pgd, uint64_t count)
+{
+    assert(active_buddy != NULL);
+    active_buddy->free_contiguous(pgd, count);
+}
+
+unsigned int buddy_nr_page_colours()
+{
+    return active_buddy != NULL ? active_buddy->nr_page_colours() : 0;
+}
+
+PageDescriptor* buddy_allocate_coloured_page(unsigned int colour)
+{
+    if (active_buddy == NULL) return NULL;
+    return active_buddy->allocate_coloured_page(colour);
+}
+
+PageDescriptor* buddy_allocate_coloured_page(PageColourSet& colours)
+{
+    if (active_buddy == NULL) return NULL;
+    unsigned int nr_colours = active_buddy->nr_page_colours();
+    unsigned int count = colours.count > 0 and colours.count < nr_colours ? colours.count : nr_colours;
+    unsigned int offset = count > 0 ? colours.next++ % count : 0;
+    return active_buddy->allocate_coloured_page(colours.first + offset);
+}
+
+void buddy_free_coloured_page(PageDescriptor* pgd)
+{
+    assert(active_buddy != NULL);
+    active_buddy->free_coloured_page(pgd);
+}
+
+void buddy_idle()
+{
+    if (active_buddy != NULL) active_buddy->idle();
+}
+
+/**
+ * Gives the pre-zeroed pages back when memory runs low; they are the cheapest memory to reclaim.
+ */
+static uint64_t shrink_zeroed_pages(uint64_t nr_pages)
+{
+    return active_buddy != NULL ? active_buddy->release_zeroed_pages(nr_pages) : 0;
+}
+
+static Shrinker zeroed_page_shrinker("zeroed-pages", shrink_zeroed_pages);
+
+bool buddy_get_stats(BuddyAllocatorStats& stats)
+{
+    if (active_buddy == NULL) return false;
+    active_buddy->get_stats(stats);
+    return true;
+}
+
+void buddy_dump_stats()
+{
+    if (active_buddy != NULL) active_buddy->dump_stats();
+}
+
+void buddy_dump_trace()
+{
+    if (active_buddy != NULL) active_buddy->dump_trace();
+}
+
 /* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
 
 /*
@@ -0,0 +1,314 @@
+/*
+ * The Buddy Page Allocator
+ * Interface for the rest of the kernel; the allocator itself lives in buddy.cpp.
+ */
+#pragma once
+
+#include <infos/mm/page-allocator.h>
+
+#define PAGE_BITS	12	// page frames are 4 KiB
+#define MAX_ORDER	18
+#define MAX_ZONES	8	// largest number of zones memory can be split into (pgalloc.zones)
+
+#define HUGE_PAGE_ORDER		9	// 2 MiB, mapped by a single page directory entry
+#define GIGANTIC_PAGE_ORDER	18	// 1 GiB, mapped by a single page directory pointer table entry
+#define NR_HUGE_PAGE_SIZES	2
+
+#define MAX_PAGE_COLOURS	64	// largest number of cache colours (pgalloc.colours)
+
+/**
+ * How easily the memory handed out by an allocation could be given back or moved, which the buddy allocator
+ * uses to keep allocations of each kind together in their own pageblocks.  That way, long-lived kernel data
+ * does not end up pinning a page in every large block.
+ */
+enum MigrateType {
+    MIGRATE_UNMOVABLE,      // kernel data that stays put (the default for allocate_pages())
+    MIGRATE_RECLAIMABLE,    // caches that can be dropped and rebuilt when memory runs low
+    MIGRATE_MOVABLE,        // pages that are only reached through page tables, e.g. user memory
+    MIGRATE_PCPTYPES,       // the types above are the ones allocations ask for, and have per-CPU caches
+    MIGRATE_CMA = MIGRATE_PCPTYPES, // the CMA region (pgalloc.cma), lent to movable allocations while it is unused
+    MIGRATE_TYPES
+};
+
+/**
+ * A snapshot of the buddy allocator's counters.  Everything in here is maintained incrementally, so taking a
+ * snapshot costs O(MAX_ORDER) and never walks a free list.
+ */
+struct BuddyAllocatorStats {
+    uint64_t nr_free_pages;                     // pages on the buddy free lists
+    uint64_t nr_cached_pages;                   // pages held in the per-CPU caches
+    uint64_t nr_free_blocks[MAX_ORDER + 1];     // free blocks of each order
+    uint64_t nr_failures[MAX_ORDER + 1];        // allocations of each order that returned NULL
+    int fragmentation_index[MAX_ORDER + 1];     // in thousandths, see below
+    int largest_free_order;                     // order of the largest free block, or -1 if there is none
+
+    uint64_t nr_splits;
+    uint64_t nr_merges;
+    uint64_t nr_coalesce_passes;
+
+    uint64_t nr_free_pages_by_type[MIGRATE_TYPES];  // pages on the free lists of each migrate type
+    uint64_t nr_pageblocks[MIGRATE_TYPES];          // pageblocks currently owned by each migrate type
+    uint64_t nr_fallbacks;                          // allocations served from another type's free lists
+    uint64_t nr_pageblock_claims;                   // pageblocks taken over by another type on a fallback
+
+    unsigned int nr_zones;                          // zones memory is split into
+    uint64_t nr_free_pages_by_zone[MAX_ZONES];      // pages on the free lists of each zone
+    uint64_t nr_remote_allocs;                      // allocations served by a zone other than the CPU's own
+
+    // huge page pools, [0] for HUGE_PAGE_ORDER and [1] for GIGANTIC_PAGE_ORDER (not counted in nr_free_pages):
+    uint64_t nr_huge_free[NR_HUGE_PAGE_SIZES];      // huge pages in the pool
+    uint64_t nr_huge_reserved[NR_HUGE_PAGE_SIZES];  // huge pages the pool was asked to keep
+    uint64_t nr_huge_hits[NR_HUGE_PAGE_SIZES];      // allocations served from the pool
+    uint64_t nr_huge_fallbacks[NR_HUGE_PAGE_SIZES]; // allocations that found the pool empty
+
+    uint64_t nr_zeroed_pages;                       // pages zeroed ahead of time (not counted in nr_free_pages)
+    uint64_t nr_zeroed_wanted;                      // pages to keep zeroed (pgalloc.zeroed.pages)
+    uint64_t nr_zeroed_hits;                        // zeroed allocations served by a page zeroed ahead of time
+    uint64_t nr_zeroed_misses;                      // zeroed allocations that were zeroed on the spot
+    uint64_t nr_idle_zeroed;                        // pages zeroed in the background
+
+    uint64_t watermark_min;                         // free pages below which allocations reclaim directly
+    uint64_t watermark_low;                         // ... below which the background reclaimer is woken
+    uint64_t watermark_high;                        // ... up to which reclaim frees memory
+    uint64_t nr_direct_reclaims;                    // reclaims run by an allocation
+    uint64_t nr_background_reclaims;                // reclaims run when the CPU was idle
+    uint64_t nr_reclaimed_pages;                    // pages given back by the shrinkers
+
+    uint64_t nr_cma_pages;                          // pages in the CMA region (pgalloc.cma)
+    uint64_t nr_cma_allocated;                      // ... held by contiguous allocations
+    uint64_t nr_cma_allocs;                         // contiguous allocations served
+    uint64_t nr_cma_failures;                       // contiguous allocations that returned NULL
+    uint64_t nr_cma_migrations;                     // pages moved out of the region to make room
+
+    unsigned int nr_page_colours;                   // cache colours pages are sorted by (0 if colouring is off)
+    uint64_t nr_coloured_pages;                     // pages on the colour lists (not counted in nr_free_pages)
+    uint64_t nr_colour_hits;                        // coloured allocations that got a page of their colour
+    uint64_t nr_colour_misses;                      // ... that had to make do with a page of another colour
+};
+
+/**
+ * A set of cache colours to allocate pages from, in turn.  The colour of a page is the low bits of its pfn, which
+ * pick the last-level cache sets it maps to; giving tasks that run side by side disjoint sets of colours
+ * partitions the cache between them, and cycling through a set spreads a task's pages evenly over its part.
+ * A process would keep one of these, e.g. { pid * 8, 8, 0 } for eight colours of its own.
+ */
+struct PageColourSet {
+    unsigned int first;     // first colour of the set (taken modulo the number of colours)
+    unsigned int count;     // number of colours in the set, or 0 for all of them
+    unsigned int next;      // position of the next allocation in the set, advanced by every allocation
+};
+
+/**
+ * A cache elsewhere in the kernel that can give memory back to the buddy allocator when it runs low.  When free
+ * memory drops below the low watermark, the shrinkers are called (in the order they were constructed) the next
+ * time the CPU is idle; below the min watermark, or when an allocation would fail, they are called straight
+ * away by the allocating path.  Shrinkers are meant to be static objects, e.g.
+ *     static Shrinker slab_shrinker("slab", shrink_slab_caches);
+ * A shrink function must not block, and frees pages through the buddy allocator as it normally would.
+ */
+class Shrinker
+{
+public:
+    /**
+     * @param name names the shrinker in the statistics
+     * @param shrink is asked to free (about) nr_pages pages, and returns the number of pages it freed
+     */
+    Shrinker(const char* name, uint64_t (*shrink)(uint64_t nr_pages));
+
+    uint64_t shrink(uint64_t nr_pages);
+
+    const char* name() const { return _name; }
+    uint64_t nr_calls() const { return _nr_calls; }
+    uint64_t nr_reclaimed() const { return _nr_reclaimed; }
+    Shrinker* next() const { return _next; }
+
+private:
+    const char* _name;
+    uint64_t (*_shrink)(uint64_t nr_pages);
+    uint64_t _nr_calls;
+    uint64_t _nr_reclaimed;
+    Shrinker* _next;
+};
+
+/**
+ * An owner of movable memory that can move its allocations to other pages, which is how the CMA region gets its
+ * pages back from the movable allocations it was lent to (see buddy_allocate_contiguous()).  Migrators are
+ * meant to be static objects, like shrinkers, e.g.
+ *     static PageMigrator user_page_migrator("user-pages", migrate_user_page);
+ * A migrate function is given a page that is in use; if the page belongs to one of its allocations, it copies
+ * that allocation to new pages from buddy_allocate_pages(..., MIGRATE_MOVABLE), points every reference at the
+ * copy, frees the old pages and returns true.  Otherwise it returns false.  It must not block.
+ */
+class PageMigrator
+{
+public:
+    /**
+     * @param name names the migrator in the statistics
+     * @param migrate moves the allocation that holds the given page elsewhere, see above
+     */
+    PageMigrator(const char* name, bool (*migrate)(infos::mm::PageDescriptor* pgd));
+
+    bool migrate(infos::mm::PageDescriptor* pgd);
+
+    const char* name() const { return _name; }
+    uint64_t nr_calls() const { return _nr_calls; }
+    uint64_t nr_migrated() const { return _nr_migrated; }
+    PageMigrator* next() const { return _next; }
+
+private:
+    const char* _name;
+    bool (*_migrate)(infos::mm::PageDescriptor* pgd);
+    uint64_t _nr_calls;
+    uint64_t _nr_migrated;
+    PageMigrator* _next;
+};
+
+/*
+ * The fragmentation index of order k says why an allocation of order k would fail, and is
+ *   -1000          if it would not fail, i.e. there is a free block of order >= k;
+ *   0              if there is no free memory at all;
+ *   otherwise 1000 - (1000 + 1000 * free_pages / 2^k) / free_blocks, which tends to 0 when the failure is due
+ *                  to a lack of memory, and towards 1000 when it is due to fragmentation.
+ */
+
+/**
+ * Allocates 2^order contiguous pages for memory of the given mobility.  Plain allocate_pages() calls carry no
+ * such hint and are treated as MIGRATE_UNMOVABLE.
+ * @param order is the power of two of the number of pages
+ * @param type says how the memory will be used
+ * @return the first page descriptor of the block, or NULL if allocation failed or no buddy allocator is in use.
+ */
+infos::mm::PageDescriptor* buddy_allocate_pages(int order, MigrateType type);
+
+/**
+ * Frees 2^order contiguous pages allocated with buddy_allocate_pages() (or through the page allocator).
+ * @param pgd is the first page descriptor of the block
+ * @param order is the order it was allocated with
+ */
+void buddy_free_pages(infos::mm::PageDescriptor* pgd, int order);
+
+/**
+ * Allocates 'n' separate blocks of 2^order contiguous pages in one go, e.g. for the pages of a page table or of
+ * a loaded image: a large block is split once and all of its pieces handed out.
+ * @param order is the power of two of the number of pages in each block
+ * @param n is the number of blocks
+ * @param out receives the first page descriptor of each block
+ * @param type says how the memory will be used
+ * @return the number of blocks allocated (fewer than n if memory ran out, 0 if no buddy allocator is in use).
+ */
+unsigned int buddy_allocate_pages_bulk(int order, unsigned int n, infos::mm::PageDescriptor* out[], MigrateType type);
+
+/**
+ * Frees 'n' blocks of 2^order contiguous pages in one go, taking each zone's lock once for all of its blocks.
+ * @param pgds is the first page descriptor of each block
+ * @param n is the number of blocks
+ * @param order is the order they were allocated with
+ */
+void buddy_free_pages_bulk(infos::mm::PageDescriptor* pgds[], unsigned int n, int order);
+
+/**
+ * Allocates exactly 'count' contiguous pages (not rounded up to a power of two), as a plain allocation.
+ * @param count is the number of pages, at most 2^MAX_ORDER
+ * @return the first page descriptor of the range, or NULL if allocation failed or no buddy allocator is in use.
+ */
+infos::mm::PageDescriptor* buddy_allocate_pages_exact(uint64_t count);
+
+/**
+ * Frees a range of pages allocated with buddy_allocate_pages_exact().
+ * @param pgd is the first page descriptor of the range
+ * @param count is the number of pages, as passed to buddy_allocate_pages_exact()
+ */
+void buddy_free_pages_exact(infos::mm::PageDescriptor* pgd, uint64_t count);
+
+/**
+ * Allocates a huge page from the pool reserved with pgalloc.hugepages.2m= / pgalloc.hugepages.1g=, falling back
+ * to the buddy free lists when the pool is empty.
+ * @param order is HUGE_PAGE_ORDER or GIGANTIC_PAGE_ORDER
+ * @return the first page descriptor of the huge page, or NULL if allocation failed or no buddy allocator is in use.
+ */
+infos::mm::PageDescriptor* buddy_allocate_huge_page(int order);
+
+/**
+ * Frees a huge page allocated with buddy_allocate_huge_page().
+ * @param pgd is the first page descriptor of the huge page
+ * @param order is the order it was allocated with
+ */
+void buddy_free_huge_page(infos::mm::PageDescriptor* pgd, int order);
+
+/**
+ * Allocates 'count' physically contiguous pages from the CMA region reserved with pgalloc.cma=, e.g. for a device
+ * buffer.  Movable allocations that were lent pages of the region are moved out of the way through the
+ * registered migrators, so this can cost far more than an ordinary allocation.
+ * @param count is the number of pages; the range is aligned to the smaller of count and a pageblock (rounded up to
+ * a power of two)
+ * @return the first page descriptor of the range, or NULL if the region has no such range that could be emptied,
+ * or no buddy allocator is in use.
+ */
+infos::mm::PageDescriptor* buddy_allocate_contiguous(uint64_t count);
+
+/**
+ * Gives a range allocated with buddy_allocate_contiguous() back to the CMA region.
+ * @param pgd is the first page descriptor of the range
+ * @param count is the number of pages, as passed to buddy_allocate_contiguous()
+ */
+void buddy_free_contiguous(infos::mm::PageDescriptor* pgd, uint64_t count);
+
+/**
+ * Obtains the number of cache colours pages are sorted by, as set with pgalloc.colours= (a power of two).
+ * @return the number of colours, or 0 if colouring is off or no buddy allocator is in use.
+ */
+unsigned int buddy_nr_page_colours();
+
+/**
+ * Allocates a page of movable memory of the given cache colour.  If colouring is off, or no page of that colour
+ * can be found, a page of any colour is returned instead.
+ * @param colour is the colour, taken modulo buddy_nr_page_colours()
+ * @return the page, or NULL if allocation failed or no buddy allocator is in use.
+ */
+infos::mm::PageDescriptor* buddy_allocate_coloured_page(unsigned int colour);
+
+/**
+ * Allocates a page of movable memory of the next colour of a set, and moves the set on to the colour after it.
+ * @param colours is the set
+ * @return the page, or NULL if allocation failed or no buddy allocator is in use.
+ */
+infos::mm::PageDescriptor* buddy_allocate_coloured_page(PageColourSet& colours);
+
+/**
+ * Frees a page allocated with buddy_allocate_coloured_page(), keeping it for the next allocation of its colour.
+ * @param pgd is the page descriptor of the page
+ */
+void buddy_free_coloured_page(infos::mm::PageDescriptor* pgd);
+
+/**
+ * Allocates 2^order contiguous pages filled with zeroes.  Single pages are usually served from a pool that was
+ * zeroed while the CPU was idle, which keeps the cost of zeroing off e.g. the page fault path.
+ * @param order is the power of two of the number of pages
+ * @return the first page descriptor of the block, or NULL if allocation failed or no buddy allocator is in use.
+ */
+infos::mm::PageDescriptor* buddy_allocate_zeroed_pages(int order);
+
+/**
+ * Does the buddy allocator's background work: reclaims memory through the shrinkers if it ran low, and zeroes a
+ * free page ahead of time for buddy_allocate_zeroed_pages(), up to pgalloc.zeroed.pages of them.
+ * Called by the schedulers when there is nothing to run; returns straight away when there is nothing to do.
+ */
+void buddy_idle();
+
+/**
+ * Takes a snapshot of the statistics of the buddy allocator.
+ * @param stats receives the snapshot
+ * @return false (leaving stats alone) if no buddy allocator is in use.
+ */
+bool buddy_get_stats(BuddyAllocatorStats& stats);
+
+/**
+ * Writes the statistics of the buddy allocator to the memory manager's log.
+ */
+void buddy_dump_stats();
+
+/**
+ * Writes the allocator events recorded with pgalloc.trace=1 to the memory manager's log, in the trace format of
+ * the replay harness (see bench/pgalloc-bench.cpp).  This also happens by itself the first time an allocation fails.
+ */
+void buddy_dump_trace();
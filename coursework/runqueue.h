@@ -0,0 +1,303 @@
+/*
+ * O(1) Priority Runqueues
+ * Runqueues for the priority schedulers in this directory (sched-mq.cpp and sched-adv.cpp).
+ */
+#pragma once
+
+#include <infos/kernel/sched.h>
+
+#include "smp.h"
+#include "slab.h"
+
+#define ENTITY_TABLE_BITS	10		// log2 of the number of hash chains in an EntityTable
+
+#define NR_PRIORITY_CLASSES	4		// realtime, interactive, normal, daemon
+
+/**
+ * Obtains the priority class of an entity as a runqueue level: 0 for realtime (the highest) to 3 for daemon.
+ */
+static inline unsigned int priority_class_of(infos::kernel::SchedulingEntity& entity)
+{
+    switch (entity.priority()) {
+        case infos::kernel::SchedulingEntityPriority::REALTIME:
+            return 0;
+        case infos::kernel::SchedulingEntityPriority::INTERACTIVE:
+            return 1;
+        case infos::kernel::SchedulingEntityPriority::NORMAL:
+            return 2;
+        default:
+            return 3;
+    }
+}
+
+/**
+ * The scheduler's own record of a runnable entity.  SchedulingEntity belongs to the kernel and has no room for
+ * runqueue links, so they live here, in a node allocated for the entity while it is runnable and looked up by
+ * the entity's address (see EntityTable), and every runqueue operation is a handful of pointer updates on these
+ * nodes.
+ */
+struct RunqueueNode {
+    infos::kernel::SchedulingEntity* entity;
+    RunqueueNode* hash_next;    // the next node in the entity's hash chain of the EntityTable
+    RunqueueNode* prev;
+    RunqueueNode* next;
+    void* runqueue;         // the PriorityRunqueue the node is on, or NULL
+    unsigned int level;     // its priority level on that runqueue (0 is the highest)
+    unsigned int cpu;       // the CPU whose runqueues the node is on
+    bool from_heap;         // the node came from the kernel heap rather than the EntityTable's object cache
+
+    // (history kept by schedulers whose priorities change with it, e.g. o1mq)
+    uint64_t sleep_avg;     // ns of sleep credit, earned while sleeping and spent while running
+    uint64_t runtime_seen;  // the entity's cpu_runtime() when sleep_avg was last charged for it
+    uint64_t slice_left;    // ns of its timeslice the entity has left, for schedulers that give out timeslices
+    uint64_t queued_at;     // sys.runtime() when the entity last joined the back of its queue, for schedulers that age
+};
+
+/**
+ * A set of FIFO queues, one per priority level, of RunqueueNodes, with a bitmap of the levels that are not empty.
+ * Enqueue, dequeue and finding the first node of the highest non-empty level are all O(1): the last is a bit-scan
+ * of (at most a few) bitmap words.
+ */
+template<unsigned int NR_LEVELS>
+class PriorityRunqueue
+{
+public:
+    PriorityRunqueue() : _nr_queued(0) {
+        for (unsigned int level = 0; level < NR_LEVELS; level++) {
+            _heads[level] = NULL;
+            _tails[level] = NULL;
+            _counts[level] = 0;
+        }
+        for (auto & word : _bitmap) {
+            word = 0;
+        }
+    }
+
+    /**
+     * Appends a node to the queue of the given level.
+     * @param node is a node that is not on any runqueue
+     * @param level is the priority level (0 is the highest)
+     */
+    void enqueue(RunqueueNode* node, unsigned int level) {
+        assert(node->runqueue == NULL and level < NR_LEVELS);
+        node->runqueue = this;
+        node->level = level;
+        node->next = NULL;
+        node->prev = _tails[level];
+        if (_tails[level] != NULL) {
+            _tails[level]->next = node;
+        } else {
+            _heads[level] = node;
+            _bitmap[level / 64] |= 1ul << (level % 64);
+        }
+        _tails[level] = node;
+        _counts[level]++;
+        _nr_queued++;
+    }
+
+    /**
+     * Unlinks a node from this runqueue.
+     * @param node is a node on this runqueue
+     */
+    void dequeue(RunqueueNode* node) {
+        assert(node->runqueue == this);
+        unsigned int level = node->level;
+        if (node->prev != NULL) {
+            node->prev->next = node->next;
+        } else {
+            _heads[level] = node->next;
+        }
+        if (node->next != NULL) {
+            node->next->prev = node->prev;
+        } else {
+            _tails[level] = node->prev;
+        }
+        if (_heads[level] == NULL) {
+            _bitmap[level / 64] &= ~(1ul << (level % 64));
+        }
+        node->prev = NULL;
+        node->next = NULL;
+        node->runqueue = NULL;
+        _counts[level]--;
+        _nr_queued--;
+    }
+
+    /**
+     * Moves the first node of a level to the back of its queue, so that the level's entities take turns.
+     * @param level is a non-empty level
+     */
+    void rotate(unsigned int level) {
+        RunqueueNode* node = _heads[level];
+        if (node == _tails[level]) return;
+        dequeue(node);
+        enqueue(node, level);
+    }
+
+    /**
+     * Obtains the highest (lowest-numbered) level that has a node queued.
+     * @return the level, or -1 if the runqueue is empty.
+     */
+    int highest_level() const {
+        for (unsigned int word = 0; word < NR_WORDS; word++) {
+            if (_bitmap[word] != 0) {
+                return word * 64 + __builtin_ctzl(_bitmap[word]);
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * Obtains the lowest (highest-numbered) level that has a node queued.
+     * @return the level, or -1 if the runqueue is empty.
+     */
+    int lowest_level() const {
+        for (int word = NR_WORDS - 1; word >= 0; word--) {
+            if (_bitmap[word] != 0) {
+                return word * 64 + 63 - __builtin_clzl(_bitmap[word]);
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * Obtains the first node of the given level, or NULL if the level is empty.
+     */
+    RunqueueNode* first(unsigned int level) const { return _heads[level]; }
+
+    unsigned int count(unsigned int level) const { return _counts[level]; }
+    unsigned int count() const { return _nr_queued; }
+    bool empty() const { return _nr_queued == 0; }
+
+private:
+    static const unsigned int NR_WORDS = (NR_LEVELS + 63) / 64;
+
+    RunqueueNode* _heads[NR_LEVELS];
+    RunqueueNode* _tails[NR_LEVELS];
+    unsigned int _counts[NR_LEVELS];
+    unsigned int _nr_queued;
+    uint64_t _bitmap[NR_WORDS];     // bit n is set when level n is not empty
+};
+
+/**
+ * The RunqueueNodes of a scheduler, and a chained hash index that finds an entity's node from its address in O(1).
+ * Nodes come from an object cache, so there is no limit on the number of runnable entities other than memory,
+ * and they never move while they are in use, so runqueues can link them by pointer.  The cache takes its slabs
+ * from the buddy allocator, so when that is not the page allocator in use (or is out of memory) nodes come from
+ * the kernel heap instead.
+ */
+class EntityTable
+{
+public:
+    EntityTable() : _node_cache("runqueue-node", sizeof(RunqueueNode), alignof(RunqueueNode)), _nr_nodes(0) {
+        for (auto & bucket : _buckets) {
+            bucket = NULL;
+        }
+    }
+
+    /**
+     * Finds the node of an entity.
+     * @return the node, or NULL if the entity has none.
+     */
+    RunqueueNode* find(infos::kernel::SchedulingEntity* entity) {
+        for (RunqueueNode* node = _buckets[hash(entity)]; node != NULL; node = node->hash_next) {
+            if (node->entity == entity) return node;
+        }
+        return NULL;
+    }
+
+    /**
+     * Gives an entity a node, which is not on any runqueue.
+     * @param entity is an entity that has no node
+     * @return the node, or NULL if there was no memory for it.
+     */
+    RunqueueNode* insert(infos::kernel::SchedulingEntity* entity) {
+        RunqueueNode* node = (RunqueueNode*)_node_cache.allocate();
+        bool from_heap = node == NULL;
+        if (from_heap) {
+            node = new RunqueueNode;
+            if (node == NULL) return NULL;
+        }
+        node->entity = entity;
+        node->from_heap = from_heap;
+        node->prev = NULL;
+        node->next = NULL;
+        node->runqueue = NULL;
+        node->level = 0;
+        node->cpu = 0;
+        node->sleep_avg = 0;
+        node->runtime_seen = 0;
+        node->slice_left = 0;
+        node->queued_at = 0;
+        RunqueueNode*& bucket = _buckets[hash(entity)];
+        node->hash_next = bucket;
+        bucket = node;
+        _nr_nodes++;
+        return node;
+    }
+
+    /**
+     * Takes an entity's node away, once the entity is no longer on a runqueue.
+     * @param node is the node
+     */
+    void remove(RunqueueNode* node) {
+        assert(node->runqueue == NULL);
+        RunqueueNode** link = &_buckets[hash(node->entity)];
+        while (*link != node) {
+            link = &(*link)->hash_next;
+        }
+        *link = node->hash_next;
+        if (node->from_heap) {
+            delete node;
+        } else {
+            _node_cache.free(node);
+        }
+        _nr_nodes--;
+    }
+
+    unsigned int count() const { return _nr_nodes; }
+
+private:
+    static unsigned int hash(infos::kernel::SchedulingEntity* entity) {
+        // Fibonacci hashing of the address, whose low bits are the same for every (aligned) entity:
+        return ((uintptr_t)entity * 0x9e3779b97f4a7c15ul) >> (64 - ENTITY_TABLE_BITS);
+    }
+
+    ObjectCache _node_cache;
+    RunqueueNode* _buckets[1u << ENTITY_TABLE_BITS];    // the first node of each hash chain, linked through hash_next
+    unsigned int _nr_nodes;
+};
+
+/**
+ * Evens out the number of entities queued on a CPU and on the busiest other CPU, by moving half the difference
+ * over, lowest priority first (those are the ones that would wait longest where they are).  An idle CPU calls
+ * this to steal work, and every CPU calls it every so often to keep the queues balanced.  The counts are read
+ * without locks to find the busiest CPU; both CPUs' locks are then taken, in CPU order, to move the entities.
+ * CpuRunqueue is the scheduler's per-CPU state, which has a lock, a count() of the entities queued, a take() that
+ * dequeues a lowest-priority entity (or returns NULL if it has none to give) and a put() that queues an entity
+ * taken from another CPU.
+ * @param cpus is the per-CPU state, indexed by CPU
+ * @param cpu is the CPU to balance
+ * @return the number of entities moved to cpu.
+ */
+template<typename CpuRunqueue>
+unsigned int pull_from_busiest(CpuRunqueue cpus[], unsigned int cpu)
+{
+    unsigned int busiest = cpu;
+    for (unsigned int other = 0; other < MAX_CPUS; other++) {
+        if (cpus[other].count() > cpus[busiest].count()) busiest = other;
+    }
+    if (busiest == cpu or (cpus[busiest].count() - cpus[cpu].count()) / 2 == 0) return 0;
+
+    UniqueSpinLock first(cpus[cpu < busiest ? cpu : busiest].lock);
+    UniqueSpinLock second(cpus[cpu < busiest ? busiest : cpu].lock);
+    // (the counts may have moved on while the locks were not held)
+    if (cpus[busiest].count() <= cpus[cpu].count()) return 0;
+    unsigned int nr_moved = (cpus[busiest].count() - cpus[cpu].count()) / 2;
+    for (unsigned int i = 0; i < nr_moved; i++) {
+        RunqueueNode* node = cpus[busiest].take();
+        if (node == NULL) return i;
+        node->cpu = cpu;
+        cpus[cpu].put(node);
+    }
+    return nr_moved;
+}
@@ -4,13 +4,122 @@
 
 #include <infos/kernel/sched.h>
 #include <infos/kernel/thread.h>
+#include <infos/kernel/kernel.h>
 #include <infos/kernel/log.h>
-#include <infos/util/list.h>
+#include <infos/kernel/cmdline.h>
 #include <infos/util/lock.h>
 
+#include "buddy.h"
+#include "runqueue.h"
+#include "schedstats.h"
+#include "tunables.h"
+
 using namespace infos::kernel;
 using namespace infos::util;
 
+#define O1MQ_LEVELS_PER_CLASS	40				// dynamic priority levels within each priority class
+#define O1MQ_MAX_SLEEP_AVG		1000000000ull	// ns of sleep credit that earns the highest level of a class
+#define O1MQ_INTERACTIVE_SLEEP_AVG	(O1MQ_MAX_SLEEP_AVG * 3 / 4)	// sleep credit from which an entity is interactive
+#define O1MQ_STARVATION_LIMIT	100000000ull	// ns (a long timeslice), per runnable entity, the idle session waits before interactive entities stop jumping it
+#define O1MQ_HISTORY_BITS		10				// log2 of the number of sleeping entities whose history is remembered
+
+// Picks a CPU makes between load balancing passes (0 leaves balancing to idle CPUs alone).
+static unsigned int o1mq_balance_interval = 16;
+
+RegisterCmdLineArgument(O1MQBalanceInterval, "sched.balance.interval") { o1mq_balance_interval = parse_cmdline_uint(value); }
+
+// Whether to keep latency and fairness statistics, and dump them to the log every so often (see SchedStats).
+static bool o1mq_debug = false;
+
+RegisterCmdLineArgument(O1MQDebug, "sched.debug") { o1mq_debug = parse_cmdline_uint(value) != 0; }
+
+// ns an entity of each priority class runs for before it moves to the idle session (0 moves it at the next pick):
+// batch work gets long slices, for fewer switches and warmer caches; interactive work mostly sleeps before its
+// slice is up anyway.
+static uint64_t o1mq_slices[NR_PRIORITY_CLASSES] = { 50000000, 10000000, 50000000, 100000000 };
+
+RegisterCmdLineArgument(O1MQSliceRealtime, "sched.slice.realtime") { o1mq_slices[0] = parse_cmdline_uint(value) * 1000000; }
+RegisterCmdLineArgument(O1MQSliceInteractive, "sched.slice.interactive") { o1mq_slices[1] = parse_cmdline_uint(value) * 1000000; }
+RegisterCmdLineArgument(O1MQSliceNormal, "sched.slice.normal") { o1mq_slices[2] = parse_cmdline_uint(value) * 1000000; }
+RegisterCmdLineArgument(O1MQSliceDaemon, "sched.slice.daemon") { o1mq_slices[3] = parse_cmdline_uint(value) * 1000000; }
+
+typedef PriorityRunqueue<NR_PRIORITY_CLASSES * O1MQ_LEVELS_PER_CLASS> SessionRunqueue;
+
+/**
+ * What is remembered of an entity while it sleeps (and so has no runqueue node), for its priority when it wakes.
+ */
+struct SleepRecord {
+    SchedulingEntity* entity;
+    uint64_t sleep_avg;
+    uint64_t runtime_seen;
+    uint64_t slept_at;      // sys.runtime() when the entity left the runqueues
+};
+
+/**
+ * The Alpha and Beta session runqueues of one CPU.  Each CPU swaps its own sessions, when its active one runs
+ * dry, under its own lock.
+ */
+struct alignas(64) O1MQCpuRunqueue {
+    SpinLock lock;
+    SessionRunqueue session_A;
+    SessionRunqueue session_B;
+
+    // which session is active; swapping them is swapping these pointers:
+    SessionRunqueue* active_session = &session_A;
+    SessionRunqueue* idle_session = &session_B;
+
+    unsigned int nr_picks = 0;  // picks since boot, for timing the balancing passes
+    RunqueueNode* current = NULL;   // the entity last picked, which stays in the active session until its slice is up
+    uint64_t current_since = 0;     // sys.runtime() when it was last picked
+    uint64_t idle_since = 0;    // sys.runtime() when the first entity was queued in the (then empty) idle session
+
+    unsigned int count() const { return session_A.count() + session_B.count(); }
+
+    /**
+     * Dequeues a lowest-priority entity for another CPU, from the active session if it has one (it would
+     * otherwise run before the entities that have already had their turn).  The running entity is never taken.
+     */
+    RunqueueNode* take() {
+        SessionRunqueue* sessions[] = { active_session, idle_session };
+        for (auto session : sessions) {
+            int level = session->lowest_level();
+            if (level < 0) continue;
+            RunqueueNode* node = session->first(level);
+            // (the running entity is the first of its level; if it is the only one, try the other session)
+            if (node == current) node = node->next;
+            if (node == NULL) continue;
+            session->dequeue(node);
+            return node;
+        }
+        return NULL;
+    }
+
+    /**
+     * Queues an entity taken from another CPU, in the idle session.
+     */
+    void put(RunqueueNode* node) {
+        expire(node, node->level, sys.runtime());
+    }
+
+    /**
+     * Queues an entity in the idle session, to wait for the next one.
+     * @param now is sys.runtime()
+     */
+    void expire(RunqueueNode* node, unsigned int level, uint64_t now) {
+        if (idle_session->empty()) idle_since = now;
+        idle_session->enqueue(node, level);
+    }
+
+    /**
+     * Whether the idle session has waited long enough that interactive entities may no longer go back into the
+     * active one (and keep it from ever running dry).
+     * @param now is sys.runtime()
+     */
+    bool idle_session_starving(uint64_t now) const {
+        return not idle_session->empty() and now - idle_since > O1MQ_STARVATION_LIMIT * count();
+    }
+};
+
 class O1MQPriorityScheduler : public SchedulingAlgorithm
 {
 public:
@@ -24,23 +133,20 @@ public:
      */
     void init()
     {
-        session_A_rq_list.append(&rq_realtime_A);
-        session_A_rq_list.append(&rq_interactive_A);
-        session_A_rq_list.append(&rq_normal_A);
-        session_A_rq_list.append(&rq_daemon_A);
-        syslog.messagef(LogLevel::IMPORTANT, "Initialised session A runqueues list");
-
-        session_B_rq_list.append(&rq_realtime_B);
-        session_B_rq_list.append(&rq_interactive_B);
-        session_B_rq_list.append(&rq_normal_B);
-        session_B_rq_list.append(&rq_daemon_B);
-        syslog.messagef(LogLevel::IMPORTANT, "Initialised session B runqueues list");
+        for (auto & rq : cpus) {
+            rq.active_session = &rq.session_A;
+            rq.idle_session = &rq.session_B;
+        }
+        syslog.messagef(LogLevel::IMPORTANT, "Initialised session A and B runqueues of %u levels for %u CPU(s)",
+                        NR_PRIORITY_CLASSES * O1MQ_LEVELS_PER_CLASS, MAX_CPUS);
     }
 
     /**
      * Called when a scheduling entity becomes eligible for running.
      * Adds tasks to the currently-inactive session queues.
      * e.g. if Alpha session is active, add new tasks to the Beta session runqueues.
+     * Interactive tasks (those that have mostly slept) go into the active session instead, so that a task waking
+     * up from e.g. keyboard input runs within a pick or two rather than after the whole active session.
      * @param entity
      */
     void add_to_runqueue(SchedulingEntity& entity) override
@@ -53,13 +159,33 @@ public:
             return;
         }
 
-        if (is_session_A_active) {
-            // add new tasks to Beta session runqueues:
-            add_entity_to_idle_runqueue(session_B_rq_list, entity);
+        uint64_t now = sys.runtime();
+        // the runqueues link the entity through a node of its own, which it keeps while it is runnable:
+        RunqueueNode* node;
+        {
+            UniqueSpinLock tl(entities_lock);
+            if (entities.find(&entity) != NULL) {
+                syslog.messagef(LogLevel::ERROR, "Entity [%s] is already on a runqueue!", entity.name().c_str());
+                return;
+            }
+            node = entities.insert(&entity);
+            if (node != NULL) recall_history(node, now);
+        }
+        if (node == NULL) {
+            syslog.messagef(LogLevel::ERROR, "Out of memory for a runqueue node! Entity [%s] not added.", entity.name().c_str());
+            return;
+        }
+
+        // add new tasks to the idle session's runqueue of their priority, on this CPU:
+        O1MQCpuRunqueue& local = cpus[this_cpu()];
+        UniqueSpinLock rl(local.lock);
+        node->cpu = this_cpu();
+        if (is_interactive(node) and not local.idle_session_starving(now)) {
+            local.active_session->enqueue(node, dynamic_level(node));
         } else {
-            // add new tasks to Alpha session runqueues:
-            add_entity_to_idle_runqueue(session_A_rq_list, entity);
+            local.expire(node, dynamic_level(node), now);
         }
+        if (o1mq_debug) stats.on_wakeup(&entity, now);
     }
 
     /**
@@ -76,53 +202,33 @@ public:
             return;
         }
 
-        // searches runqueues on both Alpha and Beta sessions and removes entity from them.
-        // based on the entity's priority, remove from the appropriate runqueue:
-        switch(entity.priority()) {
-            case SchedulingEntityPriority::REALTIME:
-                if (rq_realtime_A.empty() && rq_realtime_B.empty()) {
-                    //do nothing
-                    syslog.messagef(LogLevel::ERROR, "Realtime runqueues are empty! Entity [%s] not removed.", entity.name().c_str());
-                } else {
-                    rq_realtime_A.remove(&entity);
-                    rq_realtime_B.remove(&entity);
-                }
-                break;
-
-            case SchedulingEntityPriority::INTERACTIVE:
-                if (rq_interactive_A.empty() && rq_interactive_B.empty()) {
-                    //do nothing
-                    syslog.messagef(LogLevel::ERROR, "Interactive runqueues are empty! Entity [%s] not removed.", entity.name().c_str());
-                } else {
-                    rq_interactive_A.remove(&entity);
-                    rq_interactive_B.remove(&entity);
-                }
-                break;
-
-            case SchedulingEntityPriority::NORMAL:
-                if (rq_normal_A.empty() && rq_normal_B.empty()) {
-                    //do nothing
-                    syslog.messagef(LogLevel::ERROR, "Normal runqueues are empty! Entity [%s] not removed.", entity.name().c_str());
-                } else {
-                    rq_normal_A.remove(&entity);
-                    rq_normal_B.remove(&entity);
-                }
-                break;
-
-            case SchedulingEntityPriority::DAEMON:
-                if (rq_daemon_A.empty() && rq_daemon_B.empty()) {
-                    //do nothing
-                    syslog.messagef(LogLevel::ERROR, "Daemon runqueues are empty! Entity [%s] not removed.", entity.name().c_str());
-                } else {
-                    rq_daemon_A.remove(&entity);
-                    rq_daemon_B.remove(&entity);
-                }
-                break;
-            default:
-                // do nothing
+        // the entity's node says which CPU and session's runqueue it is on, so neither session is searched:
+        RunqueueNode* node;
+        {
+            UniqueSpinLock tl(entities_lock);
+            node = entities.find(&entity);
+        }
+        if (node == NULL) {
+            syslog.messagef(LogLevel::ERROR, "Entity [%s] is not on a runqueue! Entity not removed.", entity.name().c_str());
+            return;
+        }
+        for (;;) {
+            // (the balancer may move the node to another CPU until we hold the lock of the CPU it is on)
+            unsigned int cpu = __atomic_load_n(&node->cpu, __ATOMIC_RELAXED);
+            UniqueSpinLock rl(cpus[cpu].lock);
+            if (node->cpu == cpu) {
+                static_cast<SessionRunqueue*>(node->runqueue)->dequeue(node);
+                if (cpus[cpu].current == node) cpus[cpu].current = NULL;
                 break;
+            }
         }
-
+        uint64_t now = sys.runtime();
+        if (o1mq_debug) stats.on_sleep(&entity, now);
+        // the entity is going to sleep, so remember its history until it wakes up:
+        UniqueSpinLock tl(entities_lock);
+        charge_runtime(node);
+        remember_history(node, now);
+        entities.remove(node);
     }
 
     /**
@@ -133,145 +239,164 @@ public:
      * Only runnable tasks can be scheduled onto a CPU!
      * For a task in a particular queue to be scheduled, all the higher priority queues must
      * be EMPTY at the point when the scheduling event occurs.
+     *
+     * The entity picked keeps its place at the head of its active queue until the timeslice of its priority class
+     * is used up, so it is picked again, without touching the runqueues, unless a higher priority entity is waiting.
      */
     SchedulingEntity *pick_next_entity() override
     {
         // disable interrupts before modifying runqueue:
         UniqueIRQLock l;
-        // deal with runqueues in order of priority:
-        if (is_session_A_active) {
-            return search_runqueues_for_next_entity(session_A_rq_list, session_B_rq_list, is_session_A_active);
-        } else {
-            return search_runqueues_for_next_entity(session_B_rq_list, session_A_rq_list, is_session_A_active);
+        unsigned int cpu = this_cpu();
+        O1MQCpuRunqueue& local = cpus[cpu];
+        // an idle CPU steals work straight away; a busy one evens its load out every so often:
+        local.nr_picks++;
+        if (local.count() == 0 or (o1mq_balance_interval > 0 and local.nr_picks % o1mq_balance_interval == 0)) {
+            pull_from_busiest(cpus, cpu);
+        }
+
+        uint64_t now = sys.runtime();
+        SchedulingEntity* entity;
+        {
+            UniqueSpinLock rl(local.lock);
+            entity = pick_local(local, cpu, now);
+        }
+        if (entity == NULL) {
+            // nothing to run, so let the page allocator do its background work, without holding the runqueue
+            // lock (which it could otherwise keep other CPUs waiting on for a page's worth of zeroing):
+            buddy_idle();
         }
+        return entity;
     }
 
 private:
     /**
-     * Run-queues (Alpha session) for realtime, interactive, normal, daemon:
+     * Picks the next entity to run on a CPU from its own sessions, whose lock must be held.
+     * @param now is sys.runtime()
+     * @return the entity, or NULL if both sessions are empty.
      */
-    List<SchedulingEntity *> rq_realtime_A;
-    List<SchedulingEntity *> rq_interactive_A;
-    List<SchedulingEntity *> rq_normal_A;
-    List<SchedulingEntity *> rq_daemon_A;
-    List<List<SchedulingEntity *> *> session_A_rq_list;
+    SchedulingEntity* pick_local(O1MQCpuRunqueue& local, unsigned int cpu, uint64_t now)
+    {
+        RunqueueNode* current = local.current;
+        if (current != NULL) {
+            // the entity that has been running is charged for the time since it was picked:
+            uint64_t ran = now - local.current_since;
+            current->slice_left = ran < current->slice_left ? current->slice_left - ran : 0;
+            local.current = NULL;
+            if (current->slice_left == 0) {
+                // the entity has had its turn in this session, so it waits in the idle session for the next one,
+                // at a level that reflects the time it has spent running, unless it is still interactive:
+                local.active_session->dequeue(current);
+                charge_runtime(current);
+                if (is_interactive(current) and not local.idle_session_starving(now)) {
+                    local.active_session->enqueue(current, dynamic_level(current));
+                } else {
+                    local.expire(current, dynamic_level(current), now);
+                }
+            }
+        }
+
+        // deal with runqueues in order of priority:
+        int level = local.active_session->highest_level();
+        if (level < 0) {
+            // all priority queues in this session are empty; toggle active session to the other session:
+            SessionRunqueue* swap = local.active_session;
+            local.active_session = local.idle_session;
+            local.idle_session = swap;
+            level = local.active_session->highest_level();
+            if (level < 0) {
+                // all priority queues in both sessions are empty:
+                if (o1mq_debug) stats.on_pick(NULL, cpu, now);
+                return NULL;
+            }
+        }
+        // (an entity still part way through its slice, e.g. after being preempted, carries on with what is left)
+        RunqueueNode* node = local.active_session->first(level);
+        if (node->slice_left == 0) node->slice_left = o1mq_slices[level / O1MQ_LEVELS_PER_CLASS];
+        local.current = node;
+        local.current_since = now;
+        if (o1mq_debug) stats.on_pick(node->entity, cpu, now);
+        return node->entity;
+    }
 
     /**
-     * Run-queues (Beta session) for realtime, interactive, normal, daemon:
+     * Works out the level of an entity from its priority class and its sleep credit: the levels of a class run
+     * from the highest, for an entity that has slept O1MQ_MAX_SLEEP_AVG more than it has run, to the lowest, for
+     * one that has done nothing but run.  A class never reaches into the levels of another.
      */
-    List<SchedulingEntity *> rq_realtime_B;
-    List<SchedulingEntity *> rq_interactive_B;
-    List<SchedulingEntity *> rq_normal_B;
-    List<SchedulingEntity *> rq_daemon_B;
-    List<List<SchedulingEntity *> *> session_B_rq_list;
+    static unsigned int dynamic_level(RunqueueNode* node) {
+        unsigned int bonus = node->sleep_avg * (O1MQ_LEVELS_PER_CLASS - 1) / O1MQ_MAX_SLEEP_AVG;
+        return priority_class_of(*node->entity) * O1MQ_LEVELS_PER_CLASS + (O1MQ_LEVELS_PER_CLASS - 1 - bonus);
+    }
 
-    // flag to control which session is active:
-    bool is_session_A_active = true;
+    static bool is_interactive(RunqueueNode* node) {
+        return node->sleep_avg >= O1MQ_INTERACTIVE_SLEEP_AVG;
+    }
 
     /**
-     * Helper function for add_to_runqueue().
-     * Adds the entity to the appropriate idle runqueue according to level of priority.
+     * Takes the CPU time an entity has used since it was last charged out of its sleep credit.
      */
-    static void add_entity_to_idle_runqueue(List<List<SchedulingEntity *> *>& idle_session_rq_list, SchedulingEntity& entity) {
-        // based on the entity's priority, enqueue into appropriate runqueue:
-        switch(entity.priority()) {
-            case SchedulingEntityPriority::REALTIME:
-                // enqueue to rq_realtime:
-                idle_session_rq_list.at(0)->enqueue(&entity);
-                break;
-            case SchedulingEntityPriority::INTERACTIVE:
-                // enqueue to rq_interactive:
-                idle_session_rq_list.at(1)->enqueue(&entity);
-                break;
-            case SchedulingEntityPriority::NORMAL:
-                // enqueue to rq_normal:
-                idle_session_rq_list.at(2)->enqueue(&entity);
-                break;
-            case SchedulingEntityPriority::DAEMON:
-                // enqueue to rq_daemon:
-                idle_session_rq_list.at(3)->enqueue(&entity);
-                break;
-            default:
-                // do nothing
-                break;
-        }
+    static void charge_runtime(RunqueueNode* node) {
+        uint64_t runtime = node->entity->cpu_runtime();
+        uint64_t ran = runtime - node->runtime_seen;
+        node->runtime_seen = runtime;
+        node->sleep_avg = ran < node->sleep_avg ? node->sleep_avg - ran : 0;
     }
 
     /**
-     * Helper function for pick_next_entity().
-     * Searches active runqueues to find next entity to pass to scheduler;
-     * If active runqueues are all empty, inspect the idle runqueues;
-     * If all runqueues are empty, return NULL.
-     * @param active_session_rq_list is the list of active runqueues / session
-     * @param idle_session_rq_list is the list of idle runqueues / session
-     * @param is_session_A_active is bool flag indicating if runqueues in session A are active.
-     * @return entity chosen from the active / idle runqueues.
+     * Gives a waking entity's new node the history it had when it went to sleep, plus credit for the time it
+     * slept.  An entity that is not remembered (new, or forgotten) starts half way up its class.
+     * @param now is sys.runtime()
      */
-    static SchedulingEntity *search_runqueues_for_next_entity(List<List<SchedulingEntity *> *>& active_session_rq_list,
-                                                                   List<List<SchedulingEntity *> *>& idle_session_rq_list,
-                                                                   bool& is_session_A_active) {
-        if (!active_session_rq_list.at(0)->empty()) {
-            // inspect active rq_realtime:
-            return get_entity_from_runqueue(active_session_rq_list.at(0), idle_session_rq_list.at(0));
-        } else if (!active_session_rq_list.at(1)->empty()) {
-            // inspect active rq_interactive:
-            return get_entity_from_runqueue(active_session_rq_list.at(1), idle_session_rq_list.at(1));
-        } else if (!active_session_rq_list.at(2)->empty()) {
-            // inspect active rq_normal:
-            return get_entity_from_runqueue(active_session_rq_list.at(2), idle_session_rq_list.at(2));
-        } else if (!active_session_rq_list.at(3)->empty()) {
-            // inspect active rq_daemon:
-            return get_entity_from_runqueue(active_session_rq_list.at(3), idle_session_rq_list.at(3));
+    void recall_history(RunqueueNode* node, uint64_t now) {
+        SleepRecord& record = sleepers[history_slot(node->entity)];
+        if (record.entity == node->entity) {
+            uint64_t slept = now - record.slept_at;
+            node->sleep_avg = record.sleep_avg + (slept < O1MQ_MAX_SLEEP_AVG ? slept : O1MQ_MAX_SLEEP_AVG);
+            if (node->sleep_avg > O1MQ_MAX_SLEEP_AVG) node->sleep_avg = O1MQ_MAX_SLEEP_AVG;
+            node->runtime_seen = record.runtime_seen;
+            record.entity = NULL;
         } else {
-
-            // all priority queues in this session are empty; toggle active session to the other session:
-            is_session_A_active = !is_session_A_active;
-
-            if (!idle_session_rq_list.at(0)->empty()) {
-                // inspect idle rq_realtime:
-                return get_entity_from_runqueue(idle_session_rq_list.at(0), active_session_rq_list.at(0));
-            } else if (!idle_session_rq_list.at(1)->empty()) {
-                // inspect idle rq_interactive:
-                return get_entity_from_runqueue(idle_session_rq_list.at(1), active_session_rq_list.at(1));
-            } else if (!idle_session_rq_list.at(2)->empty()) {
-                // inspect idle rq_normal:
-                return get_entity_from_runqueue(idle_session_rq_list.at(2), active_session_rq_list.at(2));
-            } else if (!idle_session_rq_list.at(3)->empty()) {
-                // inspect idle rq_daemon:
-                return get_entity_from_runqueue(idle_session_rq_list.at(3), active_session_rq_list.at(3));
-            } else {
-                // all priority queues in both sessions are empty:
-                return NULL;
-            }
+            node->sleep_avg = O1MQ_MAX_SLEEP_AVG / 2;
+            node->runtime_seen = node->entity->cpu_runtime();
         }
     }
 
     /**
-     * Helper function for pick_next_entity().
-     * Pops the first still-runnable entity from the queue and returns it.
-     * Enqueues the to-be-returned entity back to the end of the active_runqueue
-     * @param active_runqueue is the active_runqueue that we wish to obtain the scheduling entity from.
-     * @return the next scheduling entity in the active_runqueue.
+     * Remembers the history of an entity that is leaving the runqueues, in place of whichever entity last
+     * slept in the same slot.
+     * @param now is sys.runtime()
      */
-        static SchedulingEntity *get_entity_from_runqueue(List<SchedulingEntity *>* active_runqueue, List<SchedulingEntity *>* idle_runqueue) {
-            unsigned int org_active_rq_len = active_runqueue->count();
-            unsigned int org_idle_rq_len = idle_runqueue->count();
-            // pop entity from start of active queue:
-            SchedulingEntity* entityPtr = active_runqueue->pop();
-            if (entityPtr != NULL) {
-                // enqueue entity to end of idle queue:
-                idle_runqueue->enqueue(entityPtr);
-                if (active_runqueue->count() != org_active_rq_len - 1) {
-                    syslog.messagef(LogLevel::ERROR, "Active runqueue has wrong length after fetching next entity [%s].", entityPtr->name().c_str());
-                }
-                if (idle_runqueue->count() != org_idle_rq_len + 1) {
-                    syslog.messagef(LogLevel::ERROR, "Idle runqueue has wrong length after fetching next entity [%s].", entityPtr->name().c_str());
-                }
-            } else {
-                syslog.message(LogLevel::ERROR, "Dequeued next-Entity is NULL! Entity not re-enqueued.");
-            }
-            return entityPtr;
-        }
+    void remember_history(RunqueueNode* node, uint64_t now) {
+        SleepRecord& record = sleepers[history_slot(node->entity)];
+        record.entity = node->entity;
+        record.sleep_avg = node->sleep_avg;
+        record.runtime_seen = node->runtime_seen;
+        record.slept_at = now;
+    }
+
+    static unsigned int history_slot(SchedulingEntity* entity) {
+        return ((uintptr_t)entity * 0x9e3779b97f4a7c15ul) >> (64 - O1MQ_HISTORY_BITS);
+    }
+
+    /**
+     * Run-queues (Alpha and Beta sessions) for realtime, interactive, normal, daemon, each of O1MQ_LEVELS_PER_CLASS
+     * levels, of every CPU:
+     */
+    O1MQCpuRunqueue cpus[MAX_CPUS];
+
+    /**
+     * The runqueue nodes of the runnable entities, of every CPU.
+     */
+    EntityTable entities;
+    SpinLock entities_lock;     // protects the table and sleepers, but not the nodes (which the runqueue locks do)
+
+    /**
+     * The history of sleeping entities, indexed by a hash of their address.
+     */
+    SleepRecord sleepers[1 << O1MQ_HISTORY_BITS];
+
+    SchedStats stats;           // (only kept up to date with sched.debug=1)
 
 };
 
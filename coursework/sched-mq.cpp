@@ -5,13 +5,67 @@
 
 #include <infos/kernel/sched.h>
 #include <infos/kernel/thread.h>
+#include <infos/kernel/kernel.h>
 #include <infos/kernel/log.h>
-#include <infos/util/list.h>
+#include <infos/kernel/cmdline.h>
 #include <infos/util/lock.h>
 
+#include "buddy.h"
+#include "runqueue.h"
+#include "schedstats.h"
+#include "tunables.h"
+
 using namespace infos::kernel;
 using namespace infos::util;
 
+// Picks a CPU makes between load balancing passes (0 leaves balancing to idle CPUs alone).
+static unsigned int mq_balance_interval = 16;
+
+RegisterCmdLineArgument(MQBalanceInterval, "sched.balance.interval") { mq_balance_interval = parse_cmdline_uint(value); }
+
+// Whether to keep latency and fairness statistics, and dump them to the log every so often (see SchedStats).
+static bool mq_debug = false;
+
+RegisterCmdLineArgument(MQDebug, "sched.debug") { mq_debug = parse_cmdline_uint(value) != 0; }
+
+// ns the entity at the head of a queue may wait while higher priority queues run, before it is promoted for a
+// pick (0 keeps the priorities strict, so lower priority entities may wait forever):
+static uint64_t mq_aging_threshold = 500000000;
+
+RegisterCmdLineArgument(MQAgingThreshold, "sched.aging.threshold") { mq_aging_threshold = parse_cmdline_uint(value) * 1000000; }
+
+/**
+ * The runqueues of one CPU: levels 0 to 3 of a priority runqueue for realtime, interactive, normal, daemon.
+ * Each CPU picks from its own runqueues, under its own lock, so CPUs only meet when work is moved between them.
+ */
+struct alignas(64) MQCpuRunqueue {
+    SpinLock lock;
+    PriorityRunqueue<NR_PRIORITY_CLASSES> runqueue;
+    unsigned int nr_picks = 0;  // picks since boot, for timing the balancing passes
+    uint64_t nr_promotions = 0; // picks of an entity that had waited past mq_aging_threshold
+    bool promoted_last = false; // whether the last pick was a promotion (the next one never is)
+
+    unsigned int count() const { return runqueue.count(); }
+
+    /**
+     * Dequeues the entity that has waited longest in the lowest-priority non-empty queue, for another CPU.
+     */
+    RunqueueNode* take() {
+        int level = runqueue.lowest_level();
+        if (level < 0) return NULL;
+        RunqueueNode* node = runqueue.first(level);
+        runqueue.dequeue(node);
+        return node;
+    }
+
+    /**
+     * Queues an entity taken from another CPU, at the back of its priority's queue.
+     */
+    void put(RunqueueNode* node) {
+        runqueue.enqueue(node, node->level);
+    }
+};
+
 /**
  * A Multiple Queue priority scheduling algorithm
  */
@@ -45,24 +99,29 @@ public:
             return;
         }
 
-        //based on the entity's priority, enqueue into appropriate runqueue:
-        switch(entity.priority()) {
-            case SchedulingEntityPriority::REALTIME:
-                rq_realtime.enqueue(&entity);
-                break;
-            case SchedulingEntityPriority::INTERACTIVE:
-                rq_interactive.enqueue(&entity);
-                break;
-            case SchedulingEntityPriority::NORMAL:
-                rq_normal.enqueue(&entity);
-                break;
-            case SchedulingEntityPriority::DAEMON:
-                rq_daemon.enqueue(&entity);
-                break;
-            default:
-                // do nothing
-                break;
-        } 
+        // the runqueues link the entity through a node of its own, which it keeps while it is runnable:
+        RunqueueNode* node;
+        {
+            UniqueSpinLock tl(entities_lock);
+            if (entities.find(&entity) != NULL) {
+                syslog.messagef(LogLevel::ERROR, "Entity [%s] is already on a runqueue!", entity.name().c_str());
+                return;
+            }
+            node = entities.insert(&entity);
+        }
+        if (node == NULL) {
+            syslog.messagef(LogLevel::ERROR, "Out of memory for a runqueue node! Entity [%s] not added.", entity.name().c_str());
+            return;
+        }
+
+        //based on the entity's priority, enqueue into appropriate runqueue of this CPU:
+        // (the balancer moves it elsewhere if this CPU has more than its share)
+        MQCpuRunqueue& local = cpus[this_cpu()];
+        UniqueSpinLock rl(local.lock);
+        node->cpu = this_cpu();
+        node->queued_at = sys.runtime();
+        local.runqueue.enqueue(node, priority_class_of(entity));
+        if (mq_debug) stats.on_wakeup(&entity, node->queued_at);
     }
 
     /**
@@ -79,48 +138,28 @@ public:
             return;
         }
 
-        // based on the entity's priority, remove from the appropriate runqueue:
-        switch(entity.priority()) {
-            case SchedulingEntityPriority::REALTIME:
-                if (rq_realtime.empty()) {
-                    //do nothing
-                    syslog.messagef(LogLevel::ERROR, "Realtime runqueue is empty! Entity [%s] not removed.", entity.name().c_str());
-                } else {
-                    rq_realtime.remove(&entity);
-                }
-                break;
-
-            case SchedulingEntityPriority::INTERACTIVE:
-                if (rq_interactive.empty()) {
-                    //do nothing
-                    syslog.messagef(LogLevel::ERROR, "Interactive runqueue is empty! Entity [%s] not removed.", entity.name().c_str());
-                } else {
-                    rq_interactive.remove(&entity);
-                }
-                break;
-
-            case SchedulingEntityPriority::NORMAL:
-                if (rq_normal.empty()) {
-                    //do nothing
-                    syslog.messagef(LogLevel::ERROR, "Normal runqueue is empty! Entity [%s] not removed.", entity.name().c_str());
-                } else {
-                    rq_normal.remove(&entity);
-                }
-                break;
-
-            case SchedulingEntityPriority::DAEMON:
-                if (rq_daemon.empty()) {
-                    //do nothing
-                    syslog.messagef(LogLevel::ERROR, "Daemon runqueue is empty! Entity [%s] not removed.", entity.name().c_str());
-                } else {
-                    rq_daemon.remove(&entity);
-                }
-                break;
-            default:
-                // do nothing
+        // the entity's node says where it is queued, so this never searches a runqueue:
+        RunqueueNode* node;
+        {
+            UniqueSpinLock tl(entities_lock);
+            node = entities.find(&entity);
+        }
+        if (node == NULL) {
+            syslog.messagef(LogLevel::ERROR, "Entity [%s] is not on a runqueue! Entity not removed.", entity.name().c_str());
+            return;
+        }
+        for (;;) {
+            // (the balancer may move the node to another CPU until we hold the lock of the CPU it is on)
+            unsigned int cpu = __atomic_load_n(&node->cpu, __ATOMIC_RELAXED);
+            UniqueSpinLock rl(cpus[cpu].lock);
+            if (node->cpu == cpu) {
+                cpus[cpu].runqueue.dequeue(node);
                 break;
-        } 
-
+            }
+        }
+        if (mq_debug) stats.on_sleep(&entity, sys.runtime());
+        UniqueSpinLock tl(entities_lock);
+        entities.remove(node);
     }
 
     /**
@@ -131,60 +170,94 @@ public:
      * Only runnable tasks can be scheduled onto a CPU!
      * For a task in a particular queue to be scheduled, all the higher priority queues must
      * be EMPTY at the point when the scheduling event occurs.
+     *
+     * The exception is aging: an entity that has waited at the head of a lower priority queue for longer than
+     * mq_aging_threshold is promoted for one pick, after which it goes to the back of its own queue.  Promotions
+     * never follow one another, so starved entities take at most every other pick until they have caught up, and
+     * higher priority entities are never kept waiting for more than one pick by them.
      */
     SchedulingEntity *pick_next_entity() override
     {
         // disable interrupts before modifying runqueue:
         UniqueIRQLock l;
-        // deal with runqueues in order of priority:
-        SchedulingEntity* next_entity;
-        if (!rq_realtime.empty()) {
-            return get_entity_from_runqueue(&rq_realtime);
-        } else if (!rq_interactive.empty()) {
-            return get_entity_from_runqueue(&rq_interactive);
-        } else if (!rq_normal.empty()) {
-            return get_entity_from_runqueue(&rq_normal);
-        } else if (!rq_daemon.empty()) {
-            return get_entity_from_runqueue(&rq_daemon);
-        } else {
-            return NULL;
+        unsigned int cpu = this_cpu();
+        MQCpuRunqueue& local = cpus[cpu];
+        // an idle CPU steals work straight away; a busy one evens its load out every so often:
+        local.nr_picks++;
+        if (local.runqueue.empty() or (mq_balance_interval > 0 and local.nr_picks % mq_balance_interval == 0)) {
+            pull_from_busiest(cpus, cpu);
+        }
+
+        uint64_t now = sys.runtime();
+        SchedulingEntity* entity;
+        {
+            UniqueSpinLock rl(local.lock);
+            entity = pick_local(local, cpu, now);
         }
+        if (entity == NULL) {
+            // nothing to run, so let the page allocator do its background work, without holding the runqueue
+            // lock (which it could otherwise keep other CPUs waiting on for a page's worth of zeroing):
+            buddy_idle();
+        }
+        return entity;
     }
 
 
 private:
     /**
-     * Run-queuese for realtime, interactive, normal, daemon:
-     */
-    List<SchedulingEntity *> rq_realtime;
-    List<SchedulingEntity *> rq_interactive;
-    List<SchedulingEntity *> rq_normal;
-    List<SchedulingEntity *> rq_daemon;
-
-    /**
-     * Helper function for pick_next_entity().
-     * Pops the first still-runnable entity from the queue and returns it.
-     * Enqueues the to-be-returned entity back to the end of the runqueue
-     * @param runqueue is the runqueue that we wish to obtain the scheduling entity from.
-     * @return the next scheduling entity in the runqueue.
+     * Picks the next entity to run on a CPU from its own runqueues, whose lock must be held.
+     * @param now is sys.runtime()
+     * @return the entity, or NULL if the runqueues are empty.
      */
-    static SchedulingEntity *get_entity_from_runqueue(List<SchedulingEntity *> *runqueue) {
-        unsigned int org_rq_len = runqueue->count();
-        // pop entity from start of queue:
-        SchedulingEntity* entityPtr = runqueue->pop();
-        if (entityPtr != NULL) {
-            // enqueue entity back to the end of the queue:
-            runqueue->enqueue(entityPtr);
-            // check if entity has been successfully enqueued:
-            if (runqueue->count() != org_rq_len) {
-                syslog.messagef(LogLevel::ERROR, "Entity(s) lost from queue when fetching next entity [%s].", entityPtr->name().c_str());
+    SchedulingEntity* pick_local(MQCpuRunqueue& local, unsigned int cpu, uint64_t now)
+    {
+        // the highest non-empty priority level is a single bit-scan of the runqueue's bitmap:
+        int level = local.runqueue.highest_level();
+        if (level < 0) {
+            if (mq_debug) stats.on_pick(NULL, cpu, now);
+            return NULL;
+        }
+        if (local.promoted_last) {
+            local.promoted_last = false;
+        } else if (mq_aging_threshold > 0) {
+            // promote whichever lower priority head has waited longest, if it has waited past the threshold:
+            // (the head of a queue is the entity in it that has waited longest)
+            uint64_t longest_wait = mq_aging_threshold;
+            int aged_level = -1;
+            for (unsigned int lower = level + 1; lower < NR_PRIORITY_CLASSES; lower++) {
+                RunqueueNode* head = local.runqueue.first(lower);
+                if (head != NULL and now - head->queued_at > longest_wait) {
+                    longest_wait = now - head->queued_at;
+                    aged_level = lower;
+                }
+            }
+            if (aged_level >= 0) {
+                level = aged_level;
+                local.nr_promotions++;
+                local.promoted_last = true;
             }
-        } else {
-            syslog.message(LogLevel::ERROR, "Dequeued next-Entity is NULL! Entity not re-enqueued to runqueue.");
         }
-        return entityPtr;
+        // the entities of a level take turns: the one picked goes to the back of its queue:
+        RunqueueNode* node = local.runqueue.first(level);
+        local.runqueue.rotate(level);
+        node->queued_at = now;
+        if (mq_debug) stats.on_pick(node->entity, cpu, now);
+        return node->entity;
     }
 
+    /**
+     * Run-queues for realtime, interactive, normal, daemon, of every CPU:
+     */
+    MQCpuRunqueue cpus[MAX_CPUS];
+
+    /**
+     * The runqueue nodes of the runnable entities, of every CPU.
+     */
+    EntityTable entities;
+    SpinLock entities_lock;     // protects the table, but not the nodes (which the runqueue locks do)
+
+    SchedStats stats;           // (only kept up to date with sched.debug=1)
+
 };
 
 /* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
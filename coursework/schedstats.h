@@ -0,0 +1,207 @@
+/*
+ * Scheduler Statistics
+ * Latency and fairness accounting for the priority schedulers in this directory, turned on with sched.debug=1.
+ */
+#pragma once
+
+#include <infos/kernel/sched.h>
+#include <infos/kernel/log.h>
+#include <infos/util/printf.h>
+
+#include "smp.h"
+#include "runqueue.h"
+
+#define SCHED_STATS_BITS		9				// log2 of the number of entities whose statistics are kept at once
+#define SCHED_STATS_NAME_LEN	16				// characters of an entity's name kept with its statistics
+#define SCHED_LATENCY_BUCKETS	40				// bucket n of a latency histogram counts latencies of [2^(n-1), 2^n) ns
+#define SCHED_STATS_INTERVAL	5000000000ull	// ns between dumps of the statistics to the log
+
+/**
+ * The statistics of one entity, since it was first seen (or took over the slot of another).
+ */
+struct EntitySchedStats {
+    infos::kernel::SchedulingEntity* entity;
+    char name[SCHED_STATS_NAME_LEN];    // (the entity may be gone by the time the statistics are dumped)
+    unsigned int priority_class;
+
+    uint64_t run_time;              // ns spent running, from one pick to the next
+    uint64_t wait_time;             // ns spent runnable but not running
+    uint64_t nr_switches;           // times the entity was switched to
+    uint64_t nr_wakeups;            // times the entity was added to the runqueues
+    uint64_t wakeup_latency;        // ns from being added to first running, over all wakeups that have run
+    uint64_t nr_latencies;          // ... and the number of them
+    uint64_t max_wakeup_latency;
+
+    uint64_t woken_at;              // sys.runtime() of a wakeup that has not yet run, or 0
+    uint64_t waiting_since;         // sys.runtime() since when the entity has been runnable but not running, or 0
+};
+
+/**
+ * The statistics of a priority class, over every entity of the class.
+ */
+struct ClassSchedStats {
+    uint64_t run_time;
+    uint64_t wait_time;
+    uint64_t nr_switches;
+    uint64_t nr_wakeups;
+    uint64_t latency_histogram[SCHED_LATENCY_BUCKETS];     // wakeup-to-run latencies, on a log2 scale
+};
+
+/**
+ * Records when entities become runnable, run and stop, and from that their run time, wait time, switches and
+ * wakeup-to-run latencies.  Each hook is a hash lookup and a few additions under a lock of the statistics' own;
+ * schedulers only call them when sched.debug is on, so that otherwise the cost is a test of a flag.
+ *
+ * Entities are kept in a direct-mapped table indexed by a hash of their address: an entity whose slot is taken
+ * by another loses its own numbers (but not its share of the totals of its class).
+ */
+class SchedStats
+{
+public:
+    /**
+     * Called when an entity is added to the runqueues.
+     * @param now is sys.runtime()
+     */
+    void on_wakeup(infos::kernel::SchedulingEntity* entity, uint64_t now) {
+        UniqueSpinLock l(_lock);
+        EntitySchedStats& stats = lookup(entity);
+        stats.nr_wakeups++;
+        _classes[stats.priority_class].nr_wakeups++;
+        stats.woken_at = now;
+        stats.waiting_since = now;
+    }
+
+    /**
+     * Called when an entity is removed from the runqueues (whether or not it is running).
+     * @param now is sys.runtime()
+     */
+    void on_sleep(infos::kernel::SchedulingEntity* entity, uint64_t now) {
+        UniqueSpinLock l(_lock);
+        EntitySchedStats& stats = lookup(entity);
+        for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if (_current[cpu] == entity) {
+                charge_run(stats, now - _current_since[cpu]);
+                _current[cpu] = NULL;
+            }
+        }
+        if (stats.waiting_since != 0) charge_wait(stats, now - stats.waiting_since);
+        stats.woken_at = 0;
+        stats.waiting_since = 0;
+    }
+
+    /**
+     * Called with the entity a CPU has picked to run.
+     * @param entity is the entity, or NULL if the CPU is to idle
+     * @param now is sys.runtime()
+     */
+    void on_pick(infos::kernel::SchedulingEntity* entity, unsigned int cpu, uint64_t now) {
+        UniqueSpinLock l(_lock);
+        infos::kernel::SchedulingEntity* previous = _current[cpu];
+        if (previous != NULL) {
+            EntitySchedStats& stats = lookup(previous);
+            charge_run(stats, now - _current_since[cpu]);
+            // (an entity that is switched away from while it is still runnable starts waiting again)
+            if (previous != entity) stats.waiting_since = now;
+        }
+        _current[cpu] = entity;
+        _current_since[cpu] = now;
+
+        if (entity != NULL and entity != previous) {
+            EntitySchedStats& stats = lookup(entity);
+            stats.nr_switches++;
+            _classes[stats.priority_class].nr_switches++;
+            if (stats.waiting_since != 0) charge_wait(stats, now - stats.waiting_since);
+            stats.waiting_since = 0;
+            if (stats.woken_at != 0) {
+                uint64_t latency = now - stats.woken_at;
+                stats.wakeup_latency += latency;
+                stats.nr_latencies++;
+                if (latency > stats.max_wakeup_latency) stats.max_wakeup_latency = latency;
+                unsigned int bucket = latency == 0 ? 0 : 64 - __builtin_clzl(latency);
+                if (bucket >= SCHED_LATENCY_BUCKETS) bucket = SCHED_LATENCY_BUCKETS - 1;
+                _classes[stats.priority_class].latency_histogram[bucket]++;
+                stats.woken_at = 0;
+            }
+        }
+
+        if (now - _last_dump >= SCHED_STATS_INTERVAL) {
+            _last_dump = now;
+            dump();
+        }
+    }
+
+    /**
+     * Writes the statistics of every priority class, and of every entity remembered, to the log.
+     */
+    void dump() const {
+        static const char* class_names[NR_PRIORITY_CLASSES] = { "realtime", "interactive", "normal", "daemon" };
+
+        for (unsigned int priority_class = 0; priority_class < NR_PRIORITY_CLASSES; priority_class++) {
+            const ClassSchedStats& stats = _classes[priority_class];
+            infos::kernel::syslog.messagef(infos::kernel::LogLevel::DEBUG,
+                            "[schedstats] %s: run %lu us wait %lu us switches %lu wakeups %lu",
+                            class_names[priority_class], stats.run_time / 1000, stats.wait_time / 1000,
+                            stats.nr_switches, stats.nr_wakeups);
+
+            // only the buckets that have latencies in them, as <upper bound in ns>:<count>
+            char buffer[256];
+            int start = infos::util::snprintf(buffer, sizeof(buffer), "[schedstats] %s latency ", class_names[priority_class]);
+            int len = start;
+            for (unsigned int bucket = 0; bucket < SCHED_LATENCY_BUCKETS; bucket++) {
+                if (stats.latency_histogram[bucket] == 0) continue;
+                if (len > (int)sizeof(buffer) - 32) {
+                    infos::kernel::syslog.messagef(infos::kernel::LogLevel::DEBUG, "%s", buffer);
+                    len = infos::util::snprintf(buffer, sizeof(buffer), "[schedstats] %s latency ", class_names[priority_class]);
+                }
+                len += infos::util::snprintf(buffer + len, sizeof(buffer) - len, "<%lu:%lu ",
+                                1ul << bucket, stats.latency_histogram[bucket]);
+            }
+            if (len > start) infos::kernel::syslog.messagef(infos::kernel::LogLevel::DEBUG, "%s", buffer);
+        }
+
+        for (const auto & stats : _entities) {
+            if (stats.entity == NULL) continue;
+            infos::kernel::syslog.messagef(infos::kernel::LogLevel::DEBUG,
+                            "[schedstats] %s (%s): run %lu us wait %lu us switches %lu wakeups %lu latency avg %lu us max %lu us",
+                            stats.name, class_names[stats.priority_class], stats.run_time / 1000,
+                            stats.wait_time / 1000, stats.nr_switches, stats.nr_wakeups,
+                            stats.nr_latencies > 0 ? stats.wakeup_latency / stats.nr_latencies / 1000 : 0,
+                            stats.max_wakeup_latency / 1000);
+        }
+    }
+
+private:
+    /**
+     * Finds the statistics of an entity, taking over its slot (and starting from nothing) if it is not there.
+     */
+    EntitySchedStats& lookup(infos::kernel::SchedulingEntity* entity) {
+        EntitySchedStats& stats = _entities[((uintptr_t)entity * 0x9e3779b97f4a7c15ul) >> (64 - SCHED_STATS_BITS)];
+        if (stats.entity != entity) {
+            stats = EntitySchedStats();
+            stats.entity = entity;
+            stats.priority_class = priority_class_of(*entity);
+            const char* name = entity->name().c_str();
+            for (unsigned int i = 0; i < SCHED_STATS_NAME_LEN - 1 and name[i] != 0; i++) {
+                stats.name[i] = name[i];
+            }
+        }
+        return stats;
+    }
+
+    void charge_run(EntitySchedStats& stats, uint64_t ns) {
+        stats.run_time += ns;
+        _classes[stats.priority_class].run_time += ns;
+    }
+
+    void charge_wait(EntitySchedStats& stats, uint64_t ns) {
+        stats.wait_time += ns;
+        _classes[stats.priority_class].wait_time += ns;
+    }
+
+    SpinLock _lock;
+    EntitySchedStats _entities[1 << SCHED_STATS_BITS] = {};
+    ClassSchedStats _classes[NR_PRIORITY_CLASSES] = {};
+    infos::kernel::SchedulingEntity* _current[MAX_CPUS] = {};     // the entity each CPU last picked, if still runnable
+    uint64_t _current_since[MAX_CPUS] = {};
+    uint64_t _last_dump = 0;
+};
@@ -0,0 +1,367 @@
+/*
+ * Slab Object Caches
+ * Fixed-size kernel objects on top of the buddy page allocator.
+ */
+
+#include <infos/mm/page-allocator.h>
+#include <infos/mm/mm.h>
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/log.h>
+#include <infos/util/lock.h>
+
+#include "buddy.h"
+#include "slab.h"
+
+using namespace infos::kernel;
+using namespace infos::mm;
+using namespace infos::util;
+
+/**
+ * The header at the front of every slab.  Free objects are linked through their first word.
+ */
+struct Slab {
+    Slab* prev;             // neighbours in the cache's partial, full or empty list
+    Slab* next;
+    PageDescriptor* pgd;    // first page of the slab
+    void* free_objects;     // first free object, or NULL if the slab is full
+    unsigned int nr_in_use; // objects allocated from this slab
+};
+
+// Every object cache that has been constructed, for slab_shrink() and slab_dump_stats().
+static ObjectCache* object_caches;
+
+/**
+ * Pushes a slab onto the front of a slab list.
+ */
+static void slab_list_push(Slab*& list, Slab* slab)
+{
+    slab->prev = NULL;
+    slab->next = list;
+    if (list != NULL) list->prev = slab;
+    list = slab;
+}
+
+/**
+ * Unlinks a slab from the slab list it is on.
+ */
+static void slab_list_remove(Slab*& list, Slab* slab)
+{
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        list = slab->next;
+    }
+    if (slab->next != NULL) slab->next->prev = slab->prev;
+    slab->prev = NULL;
+    slab->next = NULL;
+}
+
+ObjectCache::ObjectCache(const char* name, unsigned int object_size, unsigned int align)
+    : _name(name), _partial(NULL), _full(NULL), _empty(NULL), _nr_partial(0), _nr_full(0), _nr_empty(0),
+      _nr_objects_in_use(0), _nr_slabs_allocated(0), _nr_slabs_reclaimed(0)
+{
+    assert(align > 0 and (align & (align - 1)) == 0);
+    // every free object holds the free list link, and every object starts on an aligned boundary:
+    if (align < sizeof(void*)) align = sizeof(void*);
+    if (object_size < sizeof(void*)) object_size = sizeof(void*);
+    _object_size = (object_size + align - 1) & ~(align - 1);
+    _first_object = (sizeof(Slab) + align - 1) & ~(align - 1);
+
+    // take the smallest slab that wastes no more than an eighth of itself:
+    for (_slab_order = 0; _slab_order < SLAB_MAX_ORDER; _slab_order++) {
+        unsigned int slab_size = 1u << (PAGE_BITS + _slab_order);
+        if (slab_size < _first_object + _object_size) continue;
+        unsigned int waste = (slab_size - _first_object) % _object_size;
+        if (waste <= slab_size / 8) break;
+    }
+    _objects_per_slab = ((1u << (PAGE_BITS + _slab_order)) - _first_object) / _object_size;
+    assert(_objects_per_slab > 0);
+
+    for (auto & magazine : _magazines) {
+        magazine.count = 0;
+        magazine.nr_hits = 0;
+        magazine.nr_refills = 0;
+        magazine.nr_flushes = 0;
+    }
+
+    _next = object_caches;
+    object_caches = this;
+}
+
+void* ObjectCache::allocate()
+{
+    // the magazine belongs to this CPU, so it only has to be kept safe from interrupts:
+    UniqueIRQLock l;
+    SlabMagazine& magazine = _magazines[this_cpu()];
+    if (magazine.count > 0) {
+        magazine.nr_hits++;
+        return magazine.objects[--magazine.count];
+    }
+    return refill(magazine);
+}
+
+void ObjectCache::free(void* object)
+{
+    assert(object != NULL);
+    UniqueIRQLock l;
+    SlabMagazine& magazine = _magazines[this_cpu()];
+    if (magazine.count == SLAB_MAGAZINE_SIZE) {
+        flush(magazine, SLAB_MAGAZINE_SIZE / 2);
+    }
+    magazine.objects[magazine.count++] = object;
+}
+
+uint64_t ObjectCache::shrink(uint64_t nr_pages)
+{
+    Slab* empty = NULL;
+    {
+        UniqueIRQLock l;
+        SlabMagazine& magazine = _magazines[this_cpu()];
+        flush(magazine, magazine.count);
+
+        // detach enough empty slabs, and give their pages back without holding the lock:
+        UniqueSpinLock sl(_lock);
+        for (uint64_t nr_detached = 0; nr_detached < nr_pages and _empty != NULL; nr_detached += 1u << _slab_order) {
+            Slab* slab = _empty;
+            slab_list_remove(_empty, slab);
+            _nr_empty--;
+            _nr_slabs_reclaimed++;
+            slab->next = empty;
+            empty = slab;
+        }
+    }
+    uint64_t nr_freed = 0;
+    while (empty != NULL) {
+        Slab* next = empty->next;
+        delete_slab(empty);
+        nr_freed += 1u << _slab_order;
+        empty = next;
+    }
+    return nr_freed;
+}
+
+/**
+ * Fills half of an empty magazine from the slabs, growing the cache by a slab if they are all full, and
+ * hands out one of the objects.
+ * @param magazine is this CPU's magazine, which is empty
+ * @return the object, or NULL if there was no memory for a new slab.
+ */
+void* ObjectCache::refill(SlabMagazine& magazine)
+{
+    magazine.nr_refills++;
+    for (;;) {
+        {
+            UniqueSpinLock l(_lock);
+            while (magazine.count < SLAB_MAGAZINE_SIZE / 2 and (_partial != NULL or _empty != NULL)) {
+                magazine.objects[magazine.count++] = take_object();
+            }
+        }
+        if (magazine.count > 0) {
+            return magazine.objects[--magazine.count];
+        }
+        // the lock is not held here, as a failing page allocation may come back to shrink this very cache:
+        Slab* slab = new_slab();
+        if (slab == NULL) {
+            return NULL;
+        }
+        UniqueSpinLock l(_lock);
+        slab_list_push(_empty, slab);
+        _nr_empty++;
+    }
+}
+
+/**
+ * Gives the coldest objects of a magazine (those at the bottom of the stack) back to their slabs.
+ * @param magazine is this CPU's magazine
+ * @param nr_objects is the number of objects to give back
+ */
+void ObjectCache::flush(SlabMagazine& magazine, unsigned int nr_objects)
+{
+    if (nr_objects == 0) return;
+    magazine.nr_flushes++;
+    {
+        UniqueSpinLock l(_lock);
+        for (unsigned int i = 0; i < nr_objects; i++) {
+            put_object(magazine.objects[i]);
+        }
+    }
+    for (unsigned int i = nr_objects; i < magazine.count; i++) {
+        magazine.objects[i - nr_objects] = magazine.objects[i];
+    }
+    magazine.count -= nr_objects;
+}
+
+/**
+ * Allocates the pages of a new slab from the buddy allocator and threads its objects onto its free list.
+ * Every page of the slab points at the slab's first page through next_free (which is unused while the pages
+ * are allocated), so that slab_of() can find the header of any object.
+ * @return the new slab, which is not on any list yet, or NULL if there was no memory.
+ */
+Slab* ObjectCache::new_slab()
+{
+    PageDescriptor* pgd = buddy_allocate_pages(_slab_order, MIGRATE_UNMOVABLE);
+    if (pgd == NULL) {
+        mm_log.messagef(LogLevel::ERROR, "Could not allocate a slab for object cache %s", _name);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < (1u << _slab_order); i++) {
+        pgd[i].next_free = pgd;
+    }
+
+    Slab* slab = (Slab*)sys.mm().pgalloc().pgd_to_vpa(pgd);
+    slab->prev = NULL;
+    slab->next = NULL;
+    slab->pgd = pgd;
+    slab->nr_in_use = 0;
+    // link the objects in address order, so that a fresh slab hands them out front to back:
+    char* object = (char*)slab + _first_object;
+    slab->free_objects = object;
+    for (unsigned int i = 1; i < _objects_per_slab; i++) {
+        *(void**)object = object + _object_size;
+        object += _object_size;
+    }
+    *(void**)object = NULL;
+
+    UniqueSpinLock l(_lock);
+    _nr_slabs_allocated++;
+    return slab;
+}
+
+/**
+ * Gives the pages of an empty slab back to the buddy allocator.
+ */
+void ObjectCache::delete_slab(Slab* slab)
+{
+    assert(slab->nr_in_use == 0);
+    PageDescriptor* pgd = slab->pgd;
+    for (unsigned int i = 0; i < (1u << _slab_order); i++) {
+        pgd[i].next_free = NULL;
+    }
+    buddy_free_pages(pgd, _slab_order);
+}
+
+/**
+ * Takes a free object out of a partial slab, or else an empty one.  The cache's lock must be held, and one of
+ * the two lists must not be empty.
+ */
+void* ObjectCache::take_object()
+{
+    Slab* slab = _partial;
+    if (slab == NULL) {
+        slab = _empty;
+        slab_list_remove(_empty, slab);
+        _nr_empty--;
+        slab_list_push(_partial, slab);
+        _nr_partial++;
+    }
+    void* object = slab->free_objects;
+    slab->free_objects = *(void**)object;
+    slab->nr_in_use++;
+    _nr_objects_in_use++;
+    if (slab->free_objects == NULL) {
+        slab_list_remove(_partial, slab);
+        _nr_partial--;
+        slab_list_push(_full, slab);
+        _nr_full++;
+    }
+    return object;
+}
+
+/**
+ * Puts an object back onto the free list of its slab, moving the slab to the list it now belongs on.
+ * The cache's lock must be held.
+ */
+void ObjectCache::put_object(void* object)
+{
+    Slab* slab = slab_of(object);
+    assert(slab->nr_in_use > 0);
+    if (slab->free_objects == NULL) {
+        slab_list_remove(_full, slab);
+        _nr_full--;
+        slab_list_push(_partial, slab);
+        _nr_partial++;
+    }
+    *(void**)object = slab->free_objects;
+    slab->free_objects = object;
+    slab->nr_in_use--;
+    _nr_objects_in_use--;
+    if (slab->nr_in_use == 0) {
+        slab_list_remove(_partial, slab);
+        _nr_partial--;
+        slab_list_push(_empty, slab);
+        _nr_empty++;
+    }
+}
+
+/**
+ * Finds the slab that an object was allocated from.
+ */
+Slab* ObjectCache::slab_of(void* object) const
+{
+    PageDescriptor* pgd = sys.mm().pgalloc().vpa_to_pgd((virt_addr_t)object);
+    return (Slab*)sys.mm().pgalloc().pgd_to_vpa(pgd->next_free);
+}
+
+void ObjectCache::get_stats(ObjectCacheStats& stats) const
+{
+    stats.object_size = _object_size;
+    stats.objects_per_slab = _objects_per_slab;
+    stats.slab_order = _slab_order;
+    stats.nr_partial_slabs = _nr_partial;
+    stats.nr_full_slabs = _nr_full;
+    stats.nr_empty_slabs = _nr_empty;
+    stats.nr_objects_in_use = _nr_objects_in_use;
+    stats.nr_slabs_allocated = _nr_slabs_allocated;
+    stats.nr_slabs_reclaimed = _nr_slabs_reclaimed;
+    stats.nr_magazine_objects = 0;
+    stats.nr_hits = 0;
+    stats.nr_refills = 0;
+    stats.nr_flushes = 0;
+    for (const auto & magazine : _magazines) {
+        stats.nr_magazine_objects += magazine.count;
+        stats.nr_hits += magazine.nr_hits;
+        stats.nr_refills += magazine.nr_refills;
+        stats.nr_flushes += magazine.nr_flushes;
+    }
+}
+
+void ObjectCache::dump_stats() const
+{
+    ObjectCacheStats stats;
+    get_stats(stats);
+
+    mm_log.messagef(LogLevel::DEBUG, "[slab] %s: %u-byte objects, %u per order-%d slab",
+                    _name, stats.object_size, stats.objects_per_slab, stats.slab_order);
+    mm_log.messagef(LogLevel::DEBUG, "[slab] %s: slabs partial %lu full %lu empty %lu, objects in use %lu in magazines %lu",
+                    _name, stats.nr_partial_slabs, stats.nr_full_slabs, stats.nr_empty_slabs,
+                    stats.nr_objects_in_use, stats.nr_magazine_objects);
+    mm_log.messagef(LogLevel::DEBUG, "[slab] %s: hits %lu refills %lu flushes %lu, slabs allocated %lu reclaimed %lu",
+                    _name, stats.nr_hits, stats.nr_refills, stats.nr_flushes,
+                    stats.nr_slabs_allocated, stats.nr_slabs_reclaimed);
+}
+
+uint64_t slab_shrink(uint64_t nr_pages)
+{
+    uint64_t nr_freed = 0;
+    for (ObjectCache* cache = object_caches; cache != NULL and nr_freed < nr_pages; cache = cache->next()) {
+        nr_freed += cache->shrink(nr_pages - nr_freed);
+    }
+    return nr_freed;
+}
+
+/**
+ * Gives empty slabs back when memory runs low, until the buddy allocator has the pages it asked for.
+ */
+static uint64_t shrink_slab_caches(uint64_t nr_pages)
+{
+    return slab_shrink(nr_pages);
+}
+
+static Shrinker slab_shrinker("slab", shrink_slab_caches);
+
+void slab_dump_stats()
+{
+    for (ObjectCache* cache = object_caches; cache != NULL; cache = cache->next()) {
+        cache->dump_stats();
+    }
+}
@@ -0,0 +1,149 @@
+/*
+ * Slab Object Caches
+ * Caches of fixed-size kernel objects, carved out of pages from the buddy allocator (see buddy.h).
+ */
+#pragma once
+
+#include <infos/mm/page-allocator.h>
+
+#include "smp.h"
+
+#define SLAB_MAX_ORDER		3	// largest slab, as an order of pages
+#define SLAB_MAGAZINE_SIZE	32	// free objects a CPU can hold on to, per cache
+
+struct Slab;
+
+/**
+ * A per-CPU stack of free objects of one cache.  Allocation pops from it and freeing pushes onto it, without
+ * taking the cache's lock; only when it runs empty or full is half a magazine's worth of objects moved
+ * between it and the slabs in one go.
+ */
+struct SlabMagazine {
+    unsigned int count;
+    void* objects[SLAB_MAGAZINE_SIZE];
+
+    uint64_t nr_hits;       // allocations served straight from the magazine
+    uint64_t nr_refills;    // times the magazine ran empty and was refilled from the slabs
+    uint64_t nr_flushes;    // times the magazine ran full and was half emptied into the slabs
+};
+
+/**
+ * A snapshot of the counters of an object cache.
+ */
+struct ObjectCacheStats {
+    unsigned int object_size;       // bytes per object, after alignment
+    unsigned int objects_per_slab;
+    int slab_order;
+
+    uint64_t nr_partial_slabs;      // slabs with both free and allocated objects
+    uint64_t nr_full_slabs;         // slabs with no free objects
+    uint64_t nr_empty_slabs;        // slabs with no allocated objects, given back under memory pressure
+    uint64_t nr_objects_in_use;     // objects not free in their slab (including those held in magazines)
+    uint64_t nr_magazine_objects;   // free objects held in the magazines
+
+    uint64_t nr_hits;
+    uint64_t nr_refills;
+    uint64_t nr_flushes;
+    uint64_t nr_slabs_allocated;    // slabs taken from the buddy allocator over the cache's lifetime
+    uint64_t nr_slabs_reclaimed;    // ... and given back to it
+};
+
+/**
+ * A cache of objects of one type (size and alignment).  Objects live in slabs: blocks of 2^slab_order pages
+ * from the buddy allocator, each with its header at the front and a free list threaded through its free
+ * objects.  The cache keeps its slabs on partial, full and empty lists, and allocates from partial slabs first
+ * so that empty ones stay empty and can be reclaimed.  Every CPU has a magazine of free objects in front of
+ * the slabs, which makes a hot allocation or free a few pointer operations.
+ *
+ * Caches are meant to be static objects, e.g.
+ *     static ObjectCache thread_cache("thread", sizeof(Thread), alignof(Thread));
+ * and need no set-up beyond their constructor.
+ */
+class ObjectCache
+{
+public:
+    /**
+     * @param name names the cache in the statistics
+     * @param object_size is the size of each object, in bytes
+     * @param align is the alignment of each object (a power of two)
+     */
+    ObjectCache(const char* name, unsigned int object_size, unsigned int align = sizeof(void*));
+
+    /**
+     * Allocates an object.
+     * @return the (uninitialised) object, or NULL if there was no memory for a new slab.
+     */
+    void* allocate();
+
+    /**
+     * Frees an object allocated from this cache.
+     * @param object is the object
+     */
+    void free(void* object);
+
+    /**
+     * Gives this CPU's magazine back to the slabs, and empty slabs back to the buddy allocator.
+     * @param nr_pages is the number of pages wanted; slabs are given back until at least that many are
+     * @return the number of pages given back.
+     */
+    uint64_t shrink(uint64_t nr_pages = ~0ull);
+
+    /**
+     * Takes a snapshot of the cache's counters.
+     * @param stats receives the snapshot
+     */
+    void get_stats(ObjectCacheStats& stats) const;
+
+    /**
+     * Writes the cache's counters to the memory manager's log.
+     */
+    void dump_stats() const;
+
+    const char* name() const { return _name; }
+
+    ObjectCache* next() const { return _next; }
+
+private:
+    void* refill(SlabMagazine& magazine);
+    void flush(SlabMagazine& magazine, unsigned int nr_objects);
+
+    Slab* new_slab();
+    void delete_slab(Slab* slab);
+    void* take_object();
+    void put_object(void* object);
+    Slab* slab_of(void* object) const;
+
+    const char* _name;
+    unsigned int _object_size;
+    unsigned int _first_object;     // offset of the first object in a slab, after the header
+    unsigned int _objects_per_slab;
+    int _slab_order;
+
+    SpinLock _lock;                 // protects the slab lists and everything in the slabs
+    Slab* _partial;
+    Slab* _full;
+    Slab* _empty;
+    uint64_t _nr_partial;
+    uint64_t _nr_full;
+    uint64_t _nr_empty;
+    uint64_t _nr_objects_in_use;
+    uint64_t _nr_slabs_allocated;
+    uint64_t _nr_slabs_reclaimed;
+
+    SlabMagazine _magazines[MAX_CPUS];
+
+    ObjectCache* _next;             // in the list of all caches, for slab_shrink()
+};
+
+/**
+ * Shrinks the object caches, in turn, until enough pages have been given back; the buddy allocator does this
+ * through a shrinker when it runs low on memory.
+ * @param nr_pages is the number of pages wanted (by default, every empty slab is given back)
+ * @return the number of pages given back to the buddy allocator.
+ */
+uint64_t slab_shrink(uint64_t nr_pages = ~0ull);
+
+/**
+ * Writes the counters of every object cache to the memory manager's log.
+ */
+void slab_dump_stats();
@@ -0,0 +1,57 @@
+/*
+ * Per-CPU and locking helpers shared by the allocators in this directory.
+ */
+#pragma once
+
+#include <infos/util/lock.h>
+
+#define MAX_CPUS	1	// InfOS only runs the allocators on the boot CPU, so there is one of each per-CPU structure today
+
+/**
+ * Returns the number of the CPU we are running on, for indexing per-CPU structures.
+ */
+static inline unsigned int this_cpu()
+{
+    return 0;
+}
+
+/**
+ * A test-and-set spin lock, for state that is only ever held for a handful of list operations, where spinning
+ * is cheaper than sleeping.  The uncontended case is a single atomic exchange.  Take it through UniqueSpinLock,
+ * which keeps interrupts off while it is held.
+ */
+class SpinLock
+{
+public:
+    void lock() {
+        while (__atomic_test_and_set(&_locked, __ATOMIC_ACQUIRE)) {
+            // wait with plain loads, so that the cache line is not bounced around while the lock is held:
+            while (__atomic_load_n(&_locked, __ATOMIC_RELAXED)) {
+                asm volatile("pause");
+            }
+        }
+    }
+
+    void unlock() {
+        __atomic_clear(&_locked, __ATOMIC_RELEASE);
+    }
+
+private:
+    bool _locked = false;
+};
+
+/**
+ * Holds a spin lock for as long as it is in scope, with interrupts disabled: otherwise an interrupt handler
+ * that allocates could spin forever on a lock held by the code it interrupted on the same CPU.  Interrupts are
+ * disabled before the lock is taken and restored (to whatever they were) after it is released, so these nest.
+ */
+class UniqueSpinLock
+{
+public:
+    explicit UniqueSpinLock(SpinLock& lock) : _lock(lock) { _lock.lock(); }
+    ~UniqueSpinLock() { _lock.unlock(); }
+
+private:
+    infos::util::UniqueIRQLock _irq;    // (declared first, so it is constructed before and destroyed after _lock is held)
+    SpinLock& _lock;
+};
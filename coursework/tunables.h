@@ -0,0 +1,22 @@
+/*
+ * Kernel command-line tunables of the allocators and schedulers in this directory.
+ */
+#pragma once
+
+#include <infos/define.h>
+
+/**
+ * Parses an unsigned decimal kernel command-line value (e.g. of pgalloc.pcp.batch or sched.balance.interval);
+ * stops at the first non-digit.
+ * @param value is the string given on the command line
+ * @return the parsed number (0 for an empty string)
+ */
+static inline uint64_t parse_cmdline_uint(const char* value)
+{
+    uint64_t n = 0;
+    while (*value >= '0' and *value <= '9') {
+        n = n * 10 + (*value - '0');
+        value++;
+    }
+    return n;
+}
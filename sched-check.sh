@@ -0,0 +1,17 @@
+#!/bin/sh
+# Builds the scheduler model check for the host (no kernel or QEMU needed) and runs it; see
+# bench/sched-check.cpp for the options.
+
+TOP=`pwd`
+BENCH_DIR=$TOP/bench
+OUT_DIR=$BENCH_DIR/out
+CXX=${CXX:-c++}
+
+# (the schedulers' &entity == NULL checks are kept from the kernel's own, hence -Wno-address -Wno-nonnull-compare)
+mkdir -p $OUT_DIR
+$CXX -std=gnu++17 -O2 -g -Wall -Wno-address -Wno-nonnull-compare -I$BENCH_DIR/shim -o $OUT_DIR/sched-check \
+	$BENCH_DIR/sched-check.cpp $BENCH_DIR/shim/shim.cpp $TOP/coursework/buddy.cpp $TOP/coursework/buddy-bitmap.cpp $TOP/coursework/slab.cpp \
+	$TOP/coursework/sched-mq.cpp $TOP/coursework/sched-adv.cpp || exit 1
+$OUT_DIR/sched-check $* || exit 1
+# (and again under a page allocator the runqueue nodes' slab cache cannot take pages from)
+$OUT_DIR/sched-check --pgalloc=buddy-bitmap $*